@@ -1,48 +1,77 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include "ast.h"
 #include "log.h"
 #include "debug.h"
 
 #define TRY(p, x, e) do { \
-	void *_p = (void *) (p = x); \
-	if (!_p) goto e; \
+	if (!((p) = (x))) goto e; \
 } while (0)
 
 #define D() do { \
 	(void)fprintf(stderr, "debug(%s): ", __FUNCTION__); \
-	gh_token_print(stderr, *tidx); \
+	gh_token _token = gh_token_get(toks, CUR()); \
+	gh_token_print(stderr, &_token); \
 	(void) fputc('\n', stderr);\
 } while (0)
 
-static inline gh_ast *ALLOC_NODE(enum gh_ast_type type) {
-	gh_ast *ptr = calloc(1, sizeof(gh_ast));
-	if (UNLIKELY(!ptr)) return NULL;
-	ptr->type = type;
-	return ptr;
+DEFINE_VEC(gh_tok);
+static gh_ast_tree *tree;
+static VEC(u32) scratch;   // the lists being built, innermost last
+static VEC(gh_tok) prefix; // prefix operators waiting for their operand
+
+// The node array doubles, so pointers from NODE() do not survive a call
+// that may allocate: parse the children first, then fill in the node.
+#define NODE(n) gh_ast_get(tree, (n))
+
+static gh_node ALLOC_NODE(enum gh_ast_type type, gh_tok tok) {
+	if (tree->nodes.used == tree->nodes.size)
+		GROW_VEC(tree->nodes, tree->nodes.size);
+	APPEND_VEC_RAW(tree->nodes, ((gh_ast) {.type = type, .tok = tok}));
+	return (gh_node) (tree->nodes.used - 1);
+}
+
+// Lists are built on the scratch stack, since nested lists are parsed
+// while their parent is still open, and copied out once complete
+static u64 gh_list_begin(void) {
+	return scratch.used;
+}
+
+static void gh_list_push(gh_node node) {
+	if (scratch.used == scratch.size)
+		GROW_VEC(scratch, scratch.size);
+	APPEND_VEC_RAW(scratch, node);
 }
 
-static inline void DEALLOC_NODE(gh_ast *ast) {
-	if (LIKELY(ast))
-		free(ast);
+static gh_list gh_list_end(u64 top) {
+	gh_list list = {
+		.start = (u32) tree->extra.used,
+		.len = (u32) (scratch.used - top),
+	};
+	if (tree->extra.size - tree->extra.used < list.len)
+		GROW_VEC(tree->extra, tree->extra.size + list.len);
+	(void) memcpy(&tree->extra.data[tree->extra.used], &scratch.data[top],
+		list.len * sizeof(u32));
+	tree->extra.used += list.len;
+	scratch.used = top;
+	return list;
 }
 
 #define EXPECT(token, exp, label) do { \
-	gh_token *_token = (token); \
+	gh_tok _token = (token); \
 	enum gh_token_id _exp = (exp); \
-	if (_token->id != _exp) { \
-		if (!is_optional) { \
-			(void) fprintf(stderr, "function %s: ", __FUNCTION__);\
-			gh_ast_errtokens(_token, &(gh_token){.id=_exp}); \
-		} \
+	if (KIND(_token) != _exp) { \
+		(void) fprintf(stderr, "function %s: ", __FUNCTION__);\
+		gh_ast_errtokens(_token, &(gh_token){.id=_exp}); \
 		goto label; \
 	} \
 } while (0)
 
 #define EXPECT_TYPE(token, label) do { \
-	gh_token *_token = (token); \
-	switch (_token->id) { \
+	gh_tok _token = (token); \
+	switch (KIND(_token)) { \
 		case GH_TOK_KW_UNIT: \
 		case GH_TOK_KW_I8:  \
 		case GH_TOK_KW_U8:  \
@@ -53,515 +82,576 @@ static inline void DEALLOC_NODE(gh_ast *ast) {
 		case GH_TOK_KW_I64: \
 		case GH_TOK_KW_U64: \
 		case GH_TOK_KW_F32: \
-		case GH_TOK_KW_F64: break; \
+		case GH_TOK_KW_F64: \
+		case GH_TOK_KW_V4I32: \
+		case GH_TOK_KW_V2I64: \
+		case GH_TOK_KW_STR: break; \
 		default: \
-			if (!is_optional) \
-				gh_ast_errtype(_token); \
+			gh_ast_errtype(_token); \
 			goto label; \
 	} \
 } while (0)
 
 #define GH_AST_ERR_FP (stderr)
 
-static int is_optional;
-static void gh_ast_errtoken(gh_token *got) {
-	(void) fprintf(stderr, "line: %llu, col: %llu: ",
-				got->lineno, got->colno);
+static const gh_lexer *toks;
+#define KIND(t) ((enum gh_token_id) (t).kind)
+#define CUR() gh_lex_peek(lx, 0)
+#define PEEK() KIND(gh_lex_peek(lx, 0))
+#define NEXT() gh_lex_next(lx)
+
+static void gh_ast_errtoken(gh_tok got) {
+	u64 lineno, colno;
+	gh_token_pos(toks, got, &lineno, &colno);
+	(void) fprintf(stderr, "line: %" PRIu64 ", col: %" PRIu64 ": ",
+				lineno, colno);
 }
 
-static void gh_ast_erreof(gh_token *got) {
+static void gh_ast_erreof(gh_tok got) {
+	gh_token token = gh_token_get(toks, got);
 	gh_ast_errtoken(got);
 	(void) fprintf(stderr, "expected EOF, got '");
-	gh_token_print(stderr, got);
+	gh_token_print(stderr, &token);
 	(void) fprintf(stderr, "'\n");
 }
 
-static void gh_ast_errtokens(gh_token *got, gh_token *expected) {
+static void gh_ast_errtokens(gh_tok got, gh_token *expected) {
+	gh_token token = gh_token_get(toks, got);
 	gh_ast_errtoken(got);
 	(void) fprintf(stderr, "expected token '");
 	gh_token_print(stderr, expected);
 	(void) fprintf(stderr, "', got token '");
-	gh_token_print(stderr, got);
+	gh_token_print(stderr, &token);
 	(void) fprintf(stderr, "'\n");
 }
 
-static void gh_ast_errtype(gh_token *token) {
+static void gh_ast_errtype(gh_tok token) {
 	gh_ast_errtoken(token);
 	(void) fprintf(stderr, "expected type\n");
 }
 
-static void gh_ast_errexpr(gh_token *token) {
+static void gh_ast_errexpr(gh_tok token) {
 	gh_ast_errtoken(token);
 	(void) fprintf(stderr, "expected expression\n");
 }
 
-static gh_ast *gh_ast_parse_block(gh_token **tidx);
-static gh_ast *gh_ast_parse_statement(gh_token **tidx);
-static gh_ast *gh_ast_parse_if(gh_token **tidx);
-static gh_ast *gh_ast_parse_expr(gh_token **tidx);
-
-#define PARSE_BRANCH(name, token, type, succ) \
-static gh_ast *gh_ast_parse_ ## name (gh_token **tidx) { \
-	gh_token *start = *tidx; \
-	gh_ast *child = NULL; \
-	TRY(child, gh_ast_parse_ ## succ (tidx), e0); \
-	if ((*tidx)->id == token) { \
-		gh_ast *tmp = NULL; \
-		TRY(tmp, ALLOC_NODE(type), e0); \
-		tmp->branch.first = child; \
-		child = tmp; \
-		(*tidx)++; \
-		TRY(child->branch.second, gh_ast_parse_ ## name (tidx), e0); \
-	} \
-	return child; \
-e0: \
-	if (is_optional) \
-		*tidx = start; \
-	gh_ast_deinit(child); \
-	return NULL; \
-}
-
-#define PARSE_BRANCH_OP(name, tokens, type, succ) \
-static gh_ast *gh_ast_parse_ ## name (gh_token **tidx) { \
-	gh_token *start = *tidx; \
-	gh_ast *child = NULL; \
-	TRY(child, gh_ast_parse_ ## succ (tidx), e0); \
-	switch ((*tidx)->id) { \
-		tokens { \
-			gh_ast *tmp = NULL; \
-			TRY(tmp, ALLOC_NODE(type), e0); \
-			tmp->branch_op.op = (*tidx)++; \
-			tmp->branch_op.first = child; \
-			child = tmp; \
-			TRY(child->branch_op.second, gh_ast_parse_ ## name (tidx), e0); \
-			break; \
-		} \
-		default: break; \
-	} \
-	return child; \
-e0: \
-	if (is_optional) \
-		*tidx = start; \
-	gh_ast_deinit(child); \
-	return NULL; \
-}
-
-static gh_ast *gh_ast_parse_clist(gh_token **tidx) {
-	gh_ast *root = NULL;
-	gh_ast **idx = &root;
-	for (;; (*tidx)++) {
-		TRY(*idx, ALLOC_NODE(GH_AST_CLIST), e0);
-		if ((*tidx)->id == GH_TOK_RPAREN)
-			break;
-		TRY((*idx)->clist.expr, gh_ast_parse_expr(tidx), e0);
-		if ((*tidx)->id == GH_TOK_COMMA)
-			idx = &(*idx)->clist.clist;
-		else
+static gh_node gh_ast_parse_statement(gh_lexer *lx);
+static gh_node gh_ast_parse_expr(gh_lexer *lx);
+
+// Call arguments, after the opening parenthesis
+static int gh_ast_parse_clist(gh_lexer *lx, gh_list *list) {
+	u64 top = gh_list_begin();
+	while (PEEK() != GH_TOK_RPAREN) {
+		gh_node expr;
+		TRY(expr, gh_ast_parse_expr(lx), e0);
+		gh_list_push(expr);
+		if (PEEK() != GH_TOK_COMMA)
 			break;
+		(void) NEXT();
 	}
-	EXPECT((*tidx)++, GH_TOK_RPAREN, e0);
-	return root;
+	EXPECT(NEXT(), GH_TOK_RPAREN, e0);
+	*list = gh_list_end(top);
+	return 0;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
+	return -1;
 }
 
-static gh_ast *gh_ast_parse_primary(gh_token **tidx) {
-	gh_token *start = *tidx;
-	gh_ast *root = NULL;
-	switch ((*tidx)->id) {
+static int gh_ast_starts_expr(enum gh_token_id id) {
+	switch (id) {
+		case GH_TOK_IDENT:
+		case GH_TOK_LIT_INT: case GH_TOK_LIT_FLOAT:
+		case GH_TOK_LIT_STRING: case GH_TOK_LPAREN:
+		case GH_TOK_NEG: case GH_TOK_BNEG:
+		case GH_TOK_MINUS: return 1;
+		default: return 0;
+	}
+}
+
+static int gh_ast_is_assgn(enum gh_token_id id) {
+	switch (id) {
+		case GH_TOK_ASSIGN: case GH_TOK_PLUS_ASSIGN:
+		case GH_TOK_MINUS_ASSIGN: case GH_TOK_MULT_ASSIGN:
+		case GH_TOK_DIV_ASSIGN: case GH_TOK_MODULO_ASSIGN: return 1;
+		default: return 0;
+	}
+}
+
+static gh_node gh_ast_parse_primary(gh_lexer *lx) {
+	gh_node root = 0;
+	switch (PEEK()) {
 		case GH_TOK_IDENT:
 		case GH_TOK_LIT_INT:
 		case GH_TOK_LIT_FLOAT: case GH_TOK_LIT_STRING: {
-			gh_token *literal = (*tidx)++;
-			TRY(root, ALLOC_NODE(GH_AST_PRIMARY), e0);
-			root->primary.literal = literal;
-			if (literal->id == GH_TOK_IDENT && (*tidx)->id == GH_TOK_LPAREN) {
-				(*tidx)++;
-				root->primary.clist = gh_ast_parse_clist(tidx);
+			gh_tok literal = NEXT();
+			gh_list args = {};
+			gh_node index = 0;
+			u8 call = 0;
+			if (KIND(literal) == GH_TOK_IDENT && PEEK() == GH_TOK_LPAREN) {
+				(void) NEXT();
+				if (gh_ast_parse_clist(lx, &args))
+					goto e0;
+				call = 1;
+			} else if (KIND(literal) == GH_TOK_IDENT && PEEK() == GH_TOK_LBRACKET) {
+				(void) NEXT();
+				TRY(index, gh_ast_parse_expr(lx), e0);
+				EXPECT(NEXT(), GH_TOK_RBRACKET, e0);
 			}
+			root = ALLOC_NODE(GH_AST_PRIMARY, literal);
+			NODE(root)->primary.args = args;
+			NODE(root)->primary.index = index;
+			NODE(root)->primary.call = call;
 			break;
 		}
-		default: {
-			EXPECT((*tidx)++, GH_TOK_LPAREN, e0);
-			TRY(root, gh_ast_parse_expr(tidx), e0);
-			EXPECT((*tidx)++, GH_TOK_RPAREN, e0);
+		case GH_TOK_LPAREN: {
+			(void) NEXT();
+			TRY(root, gh_ast_parse_expr(lx), e0);
+			EXPECT(NEXT(), GH_TOK_RPAREN, e0);
 			break;
 		}
+		default:
+			gh_ast_errexpr(CUR());
+			goto e0;
 	}
 
 	return root;
 e0:
-	if (is_optional)
-		*tidx = start;
-	gh_ast_deinit(root);
-	return NULL;
+	return 0;
 }
 
-static gh_ast *gh_ast_parse_unary(gh_token **tidx) {
-	gh_token *start = *tidx;
-	gh_ast *child = NULL;
-	switch ((*tidx)->id) {
-		case GH_TOK_NEG: case GH_TOK_BNEG:
-		case GH_TOK_MINUS: {
-			TRY(child, ALLOC_NODE(GH_AST_UNARY), e0);
-			child->unary.op = (*tidx)++;
-			child->unary.child = gh_ast_parse_unary(tidx);
-			break;
+// Prefix operators are stacked up and wrapped around the operand
+// afterwards, so a long run of them does not recurse.
+static gh_node gh_ast_parse_unary(gh_lexer *lx) {
+	u64 top = prefix.used;
+	gh_node child;
+	for (;;) {
+		switch (PEEK()) {
+			case GH_TOK_NEG: case GH_TOK_BNEG:
+			case GH_TOK_MINUS:
+				APPEND_VEC(prefix, NEXT());
+				continue;
+			default: break;
 		}
-		default: child = gh_ast_parse_primary(tidx); break;
+		break;
+	}
+	TRY(child, gh_ast_parse_primary(lx), e0);
+	while (prefix.used > top) {
+		gh_node op = ALLOC_NODE(GH_AST_UNARY, prefix.data[--prefix.used]);
+		NODE(op)->unary.child = child;
+		child = op;
 	}
 	return child;
 e0:
-	if (is_optional)
-		*tidx = start;
-	gh_ast_deinit(child);
-	return NULL;
-}
-
-PARSE_BRANCH_OP(factor,
-				case GH_TOK_MULT: case GH_TOK_DIV: case GH_TOK_MODULO:,
-				GH_AST_FACTOR, unary)
-PARSE_BRANCH_OP(adder, case GH_TOK_PLUS: case GH_TOK_MINUS:, GH_AST_ADDER, factor)
-PARSE_BRANCH_OP(shifter, case GH_TOK_LSHIFT: case GH_TOK_RSHIFT:, GH_AST_SHIFTER, adder)
-PARSE_BRANCH_OP(relation,
-				case GH_TOK_GT: case GH_TOK_LT:
-				case GH_TOK_GEQ: case GH_TOK_LEQ:,
-				GH_AST_RELATION, shifter)
-PARSE_BRANCH_OP(compare, case GH_TOK_EQ: case GH_TOK_NEQ:, GH_AST_COMPARE, relation)
-PARSE_BRANCH(band, GH_TOK_BAND, GH_AST_BAND, compare)
-PARSE_BRANCH(bxor, GH_TOK_BXOR, GH_AST_BXOR, band)
-PARSE_BRANCH(bor,  GH_TOK_BOR,  GH_AST_BOR,  bxor)
-PARSE_BRANCH(and,  GH_TOK_AND,  GH_AST_AND,  bor)
-PARSE_BRANCH(or,   GH_TOK_OR,   GH_AST_OR,   and)
-
-static gh_ast *gh_ast_parse_assgn(gh_token **tidx) {
-	gh_token *start = *tidx;
-	gh_ast *root = NULL;
-	gh_token *ident = NULL;
-	EXPECT(*tidx, GH_TOK_IDENT, e0);
-	ident = *tidx;
-	switch ((*tidx + 1)->id) {
-		case GH_TOK_ASSIGN: case GH_TOK_PLUS_ASSIGN:
-		case GH_TOK_MINUS_ASSIGN: case GH_TOK_MULT_ASSIGN:
-		case GH_TOK_DIV_ASSIGN: case GH_TOK_MODULO_ASSIGN: {
-			(*tidx)++;
-			TRY(root, ALLOC_NODE(GH_AST_ASSGN), e0);
-			root->assgn.ident = ident;
-			root->assgn.op    = (*tidx)++;
-			TRY(root->assgn.expr, gh_ast_parse_expr(tidx), e0);
+	prefix.used = top;
+	return 0;
+}
+
+// Binding power of the binary operators, 0 for every other token.
+// A higher number binds tighter, and all of them are left associative.
+static const struct {
+	u8 prec;
+	u8 type; // enum gh_ast_type
+} binops[GH_TOK_EOF + 1] = {
+	[GH_TOK_OR]     = { 1, GH_AST_OR},
+	[GH_TOK_AND]    = { 2, GH_AST_AND},
+	[GH_TOK_BOR]    = { 3, GH_AST_BOR},
+	[GH_TOK_BXOR]   = { 4, GH_AST_BXOR},
+	[GH_TOK_BAND]   = { 5, GH_AST_BAND},
+	[GH_TOK_EQ]     = { 6, GH_AST_COMPARE},
+	[GH_TOK_NEQ]    = { 6, GH_AST_COMPARE},
+	[GH_TOK_GT]     = { 7, GH_AST_RELATION},
+	[GH_TOK_LT]     = { 7, GH_AST_RELATION},
+	[GH_TOK_GEQ]    = { 7, GH_AST_RELATION},
+	[GH_TOK_LEQ]    = { 7, GH_AST_RELATION},
+	[GH_TOK_LSHIFT] = { 8, GH_AST_SHIFTER},
+	[GH_TOK_RSHIFT] = { 8, GH_AST_SHIFTER},
+	[GH_TOK_PLUS]   = { 9, GH_AST_ADDER},
+	[GH_TOK_MINUS]  = { 9, GH_AST_ADDER},
+	[GH_TOK_MULT]   = {10, GH_AST_FACTOR},
+	[GH_TOK_DIV]    = {10, GH_AST_FACTOR},
+	[GH_TOK_MODULO] = {10, GH_AST_FACTOR},
+};
+
+// Operators that bind tighter than prec are folded into the left operand
+// as they come. The right operand only recurses for a tighter operator,
+// so the depth is bounded by the number of precedence levels.
+static gh_node gh_ast_parse_binary(gh_lexer *lx, u8 prec) {
+	gh_node first, second;
+	TRY(first, gh_ast_parse_unary(lx), e0);
+	for (;;) {
+		enum gh_token_id id = PEEK();
+		u8 op_prec = binops[id].prec;
+		if (op_prec <= prec)
 			break;
-		}
-		default: goto e0;
+
+		gh_tok op = NEXT();
+		TRY(second, gh_ast_parse_binary(lx, op_prec), e0);
+		gh_node root = ALLOC_NODE(binops[id].type, op);
+		NODE(root)->branch.first = first;
+		NODE(root)->branch.second = second;
+		first = root;
 	}
-	return root;
+	return first;
 e0:
-	if (is_optional)
-		*tidx = start;
-	gh_ast_deinit(root);
-	return NULL;
-}
-
-static gh_ast *gh_ast_parse_expr(gh_token **tidx) {
-	int was_optional = is_optional;
-	gh_ast *child;
-	is_optional = 1;
-	if ((child = gh_ast_parse_assgn(tidx)))
-		return child;
-
-	is_optional = was_optional;
-
-	if ((child = gh_ast_parse_or(tidx)))
-		return child;
-
-	if (!is_optional)
-		gh_ast_errexpr(*tidx);
-	return NULL;
-}
-
-static gh_ast *gh_ast_parse_var(gh_token **tidx) {
-	gh_ast *root = NULL;
-	TRY(root, ALLOC_NODE(GH_AST_VAR), e0);
-	EXPECT((*tidx)++, GH_TOK_KW_VAR, e0);
-	EXPECT(*tidx, GH_TOK_IDENT, e0);
-	root->var.ident = (*tidx)++;
-	EXPECT((*tidx)++, GH_TOK_COLON, e0);
-	EXPECT_TYPE(*tidx, e0);
-	root->var.type = (*tidx)++;
-	if ((*tidx)->id == GH_TOK_ASSIGN) {
-		(*tidx)++;
-		TRY(root->var.expr, gh_ast_parse_expr(tidx), e0);
+	return 0;
+}
+
+static gh_node gh_ast_parse_assgn(gh_lexer *lx) {
+	gh_node root, expr, index = 0;
+	gh_tok ident = NEXT();
+	if (PEEK() == GH_TOK_LBRACKET) {
+		(void) NEXT();
+		TRY(index, gh_ast_parse_expr(lx), e0);
+		EXPECT(NEXT(), GH_TOK_RBRACKET, e0);
 	}
+	gh_tok op = NEXT();
+	TRY(expr, gh_ast_parse_expr(lx), e0);
+	root = ALLOC_NODE(GH_AST_ASSGN, ident);
+	NODE(root)->assgn.op = op.kind;
+	NODE(root)->assgn.expr = expr;
+	NODE(root)->assgn.index = index;
 	return root;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
-}
-
-static gh_ast *gh_ast_parse_if(gh_token **tidx) {
-	gh_ast *root = NULL;
-	EXPECT((*tidx)++, GH_TOK_KW_IF, e0);
-	TRY(root, ALLOC_NODE(GH_AST_IF), e0);
-	TRY(root->ifexpr.expr, gh_ast_parse_expr(tidx), e0);
-	EXPECT((*tidx)++, GH_TOK_KW_THEN, e0);
-	TRY(root->ifexpr.statement, gh_ast_parse_statement(tidx), e0);
-
-	gh_ast **endif = &root->ifexpr.endif;
-	while ((*tidx)->id == GH_TOK_KW_ELSE) {
-		(*tidx)++;
-		TRY(*endif, ALLOC_NODE(GH_AST_IF), e0);
-		if ((*tidx)->id == GH_TOK_KW_IF) {
-			(*tidx)++;
-			TRY((*endif)->ifexpr.expr, gh_ast_parse_expr(tidx), e0);
-			EXPECT((*tidx)++, GH_TOK_KW_THEN, e0);
+	return 0;
+}
+
+// Whether an element of an array is assigned, which takes looking past
+// the brackets. The tokens are only skipped, and read again after.
+static int gh_ast_is_index_assgn(gh_lexer *lx) {
+	u64 mark = gh_lex_mark(lx);
+	u64 depth = 0;
+	(void) NEXT();
+	do {
+		switch (KIND(NEXT())) {
+			case GH_TOK_LBRACKET: depth++; break;
+			case GH_TOK_RBRACKET: depth--; break;
+			case GH_TOK_EOF: depth = 0; break;
+			default: break;
 		}
-		TRY((*endif)->ifexpr.statement, gh_ast_parse_statement(tidx), e0);
-		endif = &(*endif)->ifexpr.endif;
+	} while (depth);
+	int assgn = gh_ast_is_assgn(PEEK());
+	gh_lex_reset(lx, mark);
+	return assgn;
+}
+
+// An identifier followed by an assignment operator starts an assignment,
+// which is decided on the two tokens of lookahead alone, unless the
+// identifier is indexed.
+static gh_node gh_ast_parse_expr(gh_lexer *lx) {
+	if (PEEK() == GH_TOK_IDENT) {
+		enum gh_token_id next = KIND(gh_lex_peek(lx, 1));
+		if (gh_ast_is_assgn(next)
+				|| (next == GH_TOK_LBRACKET && gh_ast_is_index_assgn(lx)))
+			return gh_ast_parse_assgn(lx);
 	}
-	EXPECT((*tidx)++, GH_TOK_KW_END, e0);
+	return gh_ast_parse_binary(lx, 0);
+}
+
+static gh_node gh_ast_parse_var(gh_lexer *lx) {
+	gh_node root, expr = 0;
+	gh_tok ident;
+	u32 len = 0;
+	u8 type;
+	EXPECT(NEXT(), GH_TOK_KW_VAR, e0);
+	EXPECT(CUR(), GH_TOK_IDENT, e0);
+	ident = NEXT();
+	EXPECT(NEXT(), GH_TOK_COLON, e0);
+	if (PEEK() == GH_TOK_LBRACKET) {
+		// [type; len], which is never initialized
+		(void) NEXT();
+		EXPECT_TYPE(CUR(), e0);
+		type = NEXT().kind;
+		EXPECT(NEXT(), GH_TOK_SEMICOLON, e0);
+		EXPECT(CUR(), GH_TOK_LIT_INT, e0);
+		gh_tok lit = NEXT();
+		u64 n = gh_token_int(toks, lit);
+		if (!n || n > UINT32_MAX) {
+			gh_ast_errtoken(lit);
+			(void) fprintf(stderr, "bad array length %" PRIu64 "\n", n);
+			goto e0;
+		}
+		len = (u32) n;
+		EXPECT(NEXT(), GH_TOK_RBRACKET, e0);
+	} else {
+		EXPECT_TYPE(CUR(), e0);
+		type = NEXT().kind;
+	}
+	if (!len && PEEK() == GH_TOK_ASSIGN) {
+		(void) NEXT();
+		TRY(expr, gh_ast_parse_expr(lx), e0);
+	}
+	root = ALLOC_NODE(GH_AST_VAR, ident);
+	NODE(root)->var.type = type;
+	NODE(root)->var.len = len;
+	NODE(root)->var.expr = expr;
 	return root;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
+	return 0;
 }
 
-static gh_ast *gh_ast_parse_mselect(gh_token **tidx) {
-	gh_ast *root = NULL;
-	gh_ast **idx = &root;
+static int gh_ast_is_end(gh_tok tok) {
+	return KIND(tok) == GH_TOK_KW_END || KIND(tok) == GH_TOK_KW_ELSE;
+}
 
-	for (;;) {
-		TRY(*idx, ALLOC_NODE(GH_AST_MSELECT), e0);
-		TRY((*idx)->mselect.expr, gh_ast_parse_expr(tidx), e0);
-		EXPECT((*tidx)++, GH_TOK_KW_THEN, e0);
-		TRY((*idx)->mselect.statement, gh_ast_parse_statement(tidx), e0);
-		EXPECT((*tidx)++, GH_TOK_KW_END, e0);
-		if ((*tidx)->id == GH_TOK_KW_END)
-			break;
-		idx = &(*idx)->mselect.mselect;
+// Statements up to (not including) the end or else that closes them
+static int gh_ast_parse_statements(gh_lexer *lx, gh_list *list) {
+	u64 top = gh_list_begin();
+	while (!gh_ast_is_end(CUR())) {
+		gh_node child;
+		TRY(child, gh_ast_parse_statement(lx), e0);
+		gh_list_push(child);
 	}
-	return root;
+	*list = gh_list_end(top);
+	return 0;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
-}
-
-static gh_ast *gh_ast_parse_match(gh_token **tidx) {
-	gh_ast *root = NULL;
-	EXPECT((*tidx)++, GH_TOK_KW_MATCH, e0);
-	TRY(root, ALLOC_NODE(GH_AST_MATCH), e0);
-	if ((*tidx)->id != GH_TOK_KW_BEGIN)
-		root->match.expr = gh_ast_parse_expr(tidx);
-	EXPECT((*tidx)++, GH_TOK_KW_BEGIN, e0);
-	TRY(root->match.mselect, gh_ast_parse_mselect(tidx), e0);
-	EXPECT((*tidx)++, GH_TOK_KW_END, e0);
-	return root;
+	return -1;
+}
+
+// begin ... end
+static int gh_ast_parse_body(gh_lexer *lx, gh_list *list) {
+	EXPECT(NEXT(), GH_TOK_KW_BEGIN, e0);
+	if (gh_ast_parse_statements(lx, list))
+		goto e0;
+	EXPECT(NEXT(), GH_TOK_KW_END, e0);
+	return 0;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
+	return -1;
 }
 
-static gh_ast *gh_ast_parse_while(gh_token **tidx) {
-	gh_ast *root = NULL;
-	EXPECT((*tidx)++, GH_TOK_KW_WHILE, e0);
-	TRY(root, ALLOC_NODE(GH_AST_WHILE), e0);
-	TRY(root->whileexpr.expr, gh_ast_parse_expr(tidx), e0);
-	TRY(root->whileexpr.block, gh_ast_parse_block(tidx), e0);
+static gh_node gh_ast_parse_if(gh_lexer *lx) {
+	gh_node root, last, expr;
+	gh_list block;
+	gh_tok tok;
+	EXPECT(CUR(), GH_TOK_KW_IF, e0);
+	tok = NEXT();
+	TRY(expr, gh_ast_parse_expr(lx), e0);
+	EXPECT(NEXT(), GH_TOK_KW_THEN, e0);
+	if (gh_ast_parse_statements(lx, &block))
+		goto e0;
+	root = last = ALLOC_NODE(GH_AST_IF, tok);
+	NODE(root)->ifexpr.expr = expr;
+	NODE(root)->ifexpr.block = block;
+
+	while (PEEK() == GH_TOK_KW_ELSE) {
+		gh_node endif;
+		tok = NEXT();
+		expr = 0;
+		if (PEEK() == GH_TOK_KW_IF) {
+			(void) NEXT();
+			TRY(expr, gh_ast_parse_expr(lx), e0);
+			EXPECT(NEXT(), GH_TOK_KW_THEN, e0);
+		}
+		if (gh_ast_parse_statements(lx, &block))
+			goto e0;
+		endif = ALLOC_NODE(GH_AST_IF, tok);
+		NODE(endif)->ifexpr.expr = expr;
+		NODE(endif)->ifexpr.block = block;
+		NODE(last)->ifexpr.endif = endif;
+		last = endif;
+	}
+	EXPECT(NEXT(), GH_TOK_KW_END, e0);
 	return root;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
+	return 0;
 }
 
-static gh_ast *gh_ast_parse_return(gh_token **tidx) {
-	gh_ast *root = NULL;
-	EXPECT((*tidx)++, GH_TOK_KW_RETURN, e0);
-	TRY(root, ALLOC_NODE(GH_AST_RETURN), e0);
+// expr then ... end, or else ... end for the default arm, which has no
+// expression and comes last
+static int gh_ast_parse_mselect(gh_lexer *lx, gh_list *list) {
+	u64 top = gh_list_begin();
+	for (;;) {
+		gh_node arm, expr = 0;
+		gh_list block;
+		gh_tok tok = CUR();
+		if (PEEK() == GH_TOK_KW_ELSE) {
+			(void) NEXT();
+		} else {
+			TRY(expr, gh_ast_parse_expr(lx), e0);
+			EXPECT(NEXT(), GH_TOK_KW_THEN, e0);
+		}
+		if (gh_ast_parse_statements(lx, &block))
+			goto e0;
+		EXPECT(NEXT(), GH_TOK_KW_END, e0);
+		arm = ALLOC_NODE(GH_AST_MSELECT, tok);
+		NODE(arm)->mselect.expr = expr;
+		NODE(arm)->mselect.block = block;
+		gh_list_push(arm);
+		if (!expr || PEEK() == GH_TOK_KW_END)
+			break;
+	}
+	*list = gh_list_end(top);
+	return 0;
+e0:
+	return -1;
+}
 
-	is_optional = 1;
-	root->returnexpr.expr = gh_ast_parse_expr(tidx);
-	is_optional = 0;
+static gh_node gh_ast_parse_match(gh_lexer *lx) {
+	gh_node root, expr = 0;
+	gh_list arms;
+	gh_tok tok;
+	EXPECT(CUR(), GH_TOK_KW_MATCH, e0);
+	tok = NEXT();
+	if (PEEK() != GH_TOK_KW_BEGIN)
+		TRY(expr, gh_ast_parse_expr(lx), e0);
+	EXPECT(NEXT(), GH_TOK_KW_BEGIN, e0);
+	if (gh_ast_parse_mselect(lx, &arms))
+		goto e0;
+	EXPECT(NEXT(), GH_TOK_KW_END, e0);
+	root = ALLOC_NODE(GH_AST_MATCH, tok);
+	NODE(root)->match.expr = expr;
+	NODE(root)->match.arms = arms;
 	return root;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
+	return 0;
 }
 
-static int gh_ast_is_end(gh_token *tidx) {
-	return tidx->id == GH_TOK_KW_END || tidx->id == GH_TOK_KW_ELSE;
+static gh_node gh_ast_parse_while(gh_lexer *lx) {
+	gh_node root, expr;
+	gh_list block;
+	gh_tok tok;
+	EXPECT(CUR(), GH_TOK_KW_WHILE, e0);
+	tok = NEXT();
+	TRY(expr, gh_ast_parse_expr(lx), e0);
+	if (gh_ast_parse_body(lx, &block))
+		goto e0;
+	root = ALLOC_NODE(GH_AST_WHILE, tok);
+	NODE(root)->whileexpr.expr = expr;
+	NODE(root)->whileexpr.block = block;
+	return root;
+e0:
+	return 0;
 }
 
-static gh_ast *gh_ast_parse_statement(gh_token **tidx) {
-	gh_ast *root = NULL;
-	gh_ast **idx = &root;
-	for (;;) {
-		if (gh_ast_is_end(*tidx))
-			break;
+static gh_node gh_ast_parse_return(gh_lexer *lx) {
+	gh_node root, expr = 0;
+	gh_tok tok;
+	EXPECT(CUR(), GH_TOK_KW_RETURN, e0);
+	tok = NEXT();
+	if (gh_ast_starts_expr(PEEK()))
+		TRY(expr, gh_ast_parse_expr(lx), e0);
 
-		TRY(*idx, ALLOC_NODE(GH_AST_STATEMENT), e0);
-		gh_ast **child = &(*idx)->statement.child;
-		switch ((*tidx)->id) {
-			case GH_TOK_KW_VAR: TRY(*child, gh_ast_parse_var(tidx), e0); break;
-			case GH_TOK_KW_IF: TRY(*child, gh_ast_parse_if(tidx), e0); break;
-			case GH_TOK_KW_MATCH: TRY(*child, gh_ast_parse_match(tidx), e0); break;
-			case GH_TOK_KW_WHILE: TRY(*child, gh_ast_parse_while(tidx), e0); break;
-			case GH_TOK_KW_RETURN: TRY(*child, gh_ast_parse_return(tidx), e0); break;
-			case GH_TOK_KW_BEGIN: TRY(*child, gh_ast_parse_block(tidx), e0); break;
-			default:
-				TRY(*child, gh_ast_parse_expr(tidx), e0);
-		}
-		idx = &(*idx)->statement.statement;
-	}
+	root = ALLOC_NODE(GH_AST_RETURN, tok);
+	NODE(root)->returnexpr.expr = expr;
 	return root;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
+	return 0;
 }
 
-static gh_ast *gh_ast_parse_block(gh_token **tidx) {
-	gh_ast *root = NULL;
-	EXPECT((*tidx)++, GH_TOK_KW_BEGIN, e0);
-	root = gh_ast_parse_statement(tidx);
-	EXPECT((*tidx)++, GH_TOK_KW_END, e0);
+static gh_node gh_ast_parse_block(gh_lexer *lx) {
+	gh_node root;
+	gh_list block;
+	gh_tok tok = CUR();
+	if (gh_ast_parse_body(lx, &block))
+		return 0;
+	root = ALLOC_NODE(GH_AST_BLOCK, tok);
+	NODE(root)->block.block = block;
 	return root;
-e0:
-	return NULL;
-}
-
-static gh_ast *gh_ast_parse_flist(gh_token **tidx) {
-	gh_ast *root = NULL;
-	gh_ast **idx = &root;
-	if ((*tidx)->id == GH_TOK_RPAREN) return NULL;
-	for (;; (*tidx)++) {
-		TRY(*idx, ALLOC_NODE(GH_AST_FLIST), e0);
-		EXPECT_TYPE(*tidx, e0);
-		(*idx)->flist.type = (*tidx)++;
-		EXPECT(*tidx, GH_TOK_IDENT, e0);
-		(*idx)->flist.ident = (*tidx)++;
-		if ((*tidx)->id == GH_TOK_COMMA)
-			idx = &(*idx)->flist.flist;
-		else
+}
+
+static gh_node gh_ast_parse_statement(gh_lexer *lx) {
+	switch (PEEK()) {
+		case GH_TOK_KW_VAR: return gh_ast_parse_var(lx);
+		case GH_TOK_KW_IF: return gh_ast_parse_if(lx);
+		case GH_TOK_KW_MATCH: return gh_ast_parse_match(lx);
+		case GH_TOK_KW_WHILE: return gh_ast_parse_while(lx);
+		case GH_TOK_KW_RETURN: return gh_ast_parse_return(lx);
+		case GH_TOK_KW_BEGIN: return gh_ast_parse_block(lx);
+		default: return gh_ast_parse_expr(lx);
+	}
+}
+
+static int gh_ast_parse_flist(gh_lexer *lx, gh_list *list) {
+	u64 top = gh_list_begin();
+	while (PEEK() != GH_TOK_RPAREN) {
+		gh_node param;
+		u8 type;
+		EXPECT_TYPE(CUR(), e0);
+		type = NEXT().kind;
+		EXPECT(CUR(), GH_TOK_IDENT, e0);
+		param = ALLOC_NODE(GH_AST_PARAM, NEXT());
+		NODE(param)->param.type = type;
+		gh_list_push(param);
+		if (PEEK() != GH_TOK_COMMA)
 			break;
+		(void) NEXT();
 	}
-	return root;
+	*list = gh_list_end(top);
+	return 0;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
-}
-
-static gh_ast *gh_ast_parse_fun(gh_token **tidx) {
-	gh_ast *root = NULL;
-	EXPECT((*tidx)++, GH_TOK_KW_FUN, e0);
-	EXPECT(*tidx, GH_TOK_IDENT, e0);
-	TRY(root, ALLOC_NODE(GH_AST_FUN), e0);
-	root->fun.ident = (*tidx)++;
-	EXPECT((*tidx)++, GH_TOK_LPAREN, e0);
-	root->fun.flist = gh_ast_parse_flist(tidx);
-	EXPECT((*tidx)++, GH_TOK_RPAREN, e0);
-	EXPECT((*tidx)++, GH_TOK_RARROW, e0);
-	EXPECT_TYPE(*tidx, e0);
-	root->fun.type = (*tidx)++;
-	root->fun.block = gh_ast_parse_block(tidx);
+	return -1;
+}
+
+static gh_node gh_ast_parse_fun(gh_lexer *lx) {
+	gh_node root;
+	gh_list params, block;
+	gh_tok ident;
+	u8 type;
+	EXPECT(NEXT(), GH_TOK_KW_FUN, e0);
+	EXPECT(CUR(), GH_TOK_IDENT, e0);
+	ident = NEXT();
+	EXPECT(NEXT(), GH_TOK_LPAREN, e0);
+	if (gh_ast_parse_flist(lx, &params))
+		goto e0;
+	EXPECT(NEXT(), GH_TOK_RPAREN, e0);
+	EXPECT(NEXT(), GH_TOK_RARROW, e0);
+	EXPECT_TYPE(CUR(), e0);
+	type = NEXT().kind;
+	if (gh_ast_parse_body(lx, &block))
+		goto e0;
+	root = ALLOC_NODE(GH_AST_FUN, ident);
+	NODE(root)->fun.params = params;
+	NODE(root)->fun.block = block;
+	NODE(root)->fun.type = type;
 	return root;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
+	return 0;
 }
 
-static gh_ast *gh_ast_parse_decl(gh_token **tidx) {
-	gh_ast *root = NULL;
-	gh_ast **idx = &root;
-	for (;;) {
-		if ((*tidx)->id == GH_TOK_EOF)
-			goto end;
-
-		TRY(*idx, ALLOC_NODE(GH_AST_DECL), e0);
-		switch ((*tidx)->id) {
-			case GH_TOK_KW_FUN: TRY((*idx)->decl.child, gh_ast_parse_fun(tidx), e0); break;
-			case GH_TOK_KW_VAR: TRY((*idx)->decl.child, gh_ast_parse_var(tidx), e0); break;
-			default: gh_ast_erreof(*tidx); goto e0;
+static gh_node gh_ast_parse_prgm(gh_lexer *lx) {
+	gh_node root;
+	gh_list decls;
+	u64 top = gh_list_begin();
+	while (PEEK() != GH_TOK_EOF) {
+		gh_node decl;
+		switch (PEEK()) {
+			case GH_TOK_KW_FUN: TRY(decl, gh_ast_parse_fun(lx), e0); break;
+			case GH_TOK_KW_VAR: TRY(decl, gh_ast_parse_var(lx), e0); break;
+			default: gh_ast_erreof(CUR()); goto e0;
 		}
-		idx = &(*idx)->decl.decl;
+		gh_list_push(decl);
 	}
-end:
+	decls = gh_list_end(top);
+	root = ALLOC_NODE(GH_AST_PRGM, CUR());
+	NODE(root)->prgm.decls = decls;
 	return root;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
+	return 0;
 }
 
-gh_ast *gh_ast_init(token_v tokens) {
-	gh_token **tidx = &tokens.data;
-	gh_ast *root = NULL;
-
-	TRY(root, ALLOC_NODE(GH_AST_PRGM), e0);
-	TRY(root->prgm.decl, gh_ast_parse_decl(tidx), e0);
-
-	return root;
+int gh_ast_init(gh_ast_tree *t, gh_lexer *lx) {
+	toks = lx;
+	tree = t;
+	tree->nodes = INIT_VEC(gh_ast);
+	tree->extra = INIT_VEC(u32);
+	scratch = INIT_VEC(u32);
+	prefix = INIT_VEC(gh_tok);
+
+	(void) ALLOC_NODE(GH_AST_NONE, (gh_tok) {}); // so that 0 is no node
+	TRY(tree->root, gh_ast_parse_prgm(lx), e0);
+	if (lx->failed)
+		goto e0;
+
+	FREE_VEC(scratch);
+	FREE_VEC(prefix);
+	return 0;
 e0:
-	gh_ast_deinit(root);
-	return NULL;
+	FREE_VEC(scratch);
+	FREE_VEC(prefix);
+	gh_ast_deinit(t);
+	return -1;
 }
 
-void gh_ast_deinit(gh_ast *root) {
-	if (!root) return ;
-	switch (root->type) {
-		case GH_AST_PRGM: gh_ast_deinit(root->prgm.decl); break;
-		case GH_AST_DECL:
-			gh_ast_deinit(root->decl.child);
-			gh_ast_deinit(root->decl.decl);
-			break;
-		case GH_AST_FUN:
-			gh_ast_deinit(root->fun.flist);
-			gh_ast_deinit(root->fun.block);
-			break;
-		case GH_AST_FLIST: gh_ast_deinit(root->flist.flist); break;
-		case GH_AST_VAR: gh_ast_deinit(root->var.expr); break;
-		case GH_AST_STATEMENT:
-			gh_ast_deinit(root->statement.child);
-			gh_ast_deinit(root->statement.statement);
-			break;
-		case GH_AST_IF:
-			gh_ast_deinit(root->ifexpr.expr);
-			gh_ast_deinit(root->ifexpr.statement);
-			gh_ast_deinit(root->ifexpr.endif);
-			break;
-		case GH_AST_MATCH:
-			gh_ast_deinit(root->match.expr);
-			gh_ast_deinit(root->match.mselect); break;
-		case GH_AST_MSELECT:
-			gh_ast_deinit(root->mselect.expr);
-			gh_ast_deinit(root->mselect.statement);
-			gh_ast_deinit(root->mselect.mselect);
-			break;
-		case GH_AST_WHILE:
-			gh_ast_deinit(root->whileexpr.expr);
-			gh_ast_deinit(root->whileexpr.block);
-			break;
-		case GH_AST_RETURN:
-			gh_ast_deinit(root->returnexpr.expr);
-			break;
-		case GH_AST_OR: case GH_AST_AND:
-		case GH_AST_BOR: case GH_AST_BXOR:
-		case GH_AST_BAND:
-			gh_ast_deinit(root->branch.first);
-			gh_ast_deinit(root->branch.second);
-			break;
-		case GH_AST_COMPARE: case GH_AST_RELATION:
-		case GH_AST_SHIFTER: case GH_AST_ADDER:
-		case GH_AST_FACTOR:
-			gh_ast_deinit(root->branch_op.first);
-			gh_ast_deinit(root->branch_op.second);
-			break;
-		case GH_AST_ASSGN:
-			gh_ast_deinit(root->assgn.expr);
-			break;
-		case GH_AST_UNARY: gh_ast_deinit(root->unary.child); break;
-		case GH_AST_PRIMARY: gh_ast_deinit(root->primary.clist); break;
-		case GH_AST_CLIST:
-			gh_ast_deinit(root->clist.expr);
-			gh_ast_deinit(root->clist.clist);
-			break;
-		default: break;
-	}
-	DEALLOC_NODE(root);
+void gh_ast_deinit(gh_ast_tree *t) {
+	FREE_VEC(t->nodes);
+	FREE_VEC(t->extra);
+	t->root = 0;
 }
@@ -5,110 +5,117 @@
 #include "types.h"
 
 /*
- * Things to do in order of priority:
- * - Remove unnecessary layers of indirection
- *   - These are AST nodes that point to only one other node and can be inferred.
- * - Flatten the AST (profile first)
- *   - This is doing a crazy amount of allocations
- *   - Maybe cache friendly? for our purposes that's not really important yet tho
+ * The tree is flat: every node lives in one array and refers to its children
+ * by index. Lists of children (declarations, statements, parameters, call
+ * arguments, match arms) are contiguous ranges of node indices in a second
+ * array, so walking a block is a linear scan instead of chasing a chain.
+ *
+ * Index 0 is never a valid node and stands for a missing optional child.
+ * Expression nodes are allocated after all of their operands, so passes
+ * over expressions can run as one forward sweep over the array.
  */
 
-typedef struct gh_ast {
-	enum gh_ast_type {
-		GH_AST_PRGM,      GH_AST_DECL,
-		GH_AST_FUN,       GH_AST_FLIST,
-		GH_AST_VAR,
-		GH_AST_STATEMENT, GH_AST_CLIST,
-		GH_AST_IF,        GH_AST_MATCH,
-		GH_AST_MSELECT,   GH_AST_WHILE,
-		GH_AST_ASSGN,     GH_AST_RETURN,
-		GH_AST_OR,        GH_AST_AND,
-		GH_AST_BOR,       GH_AST_BXOR,
-		GH_AST_BAND,      GH_AST_COMPARE,
-		GH_AST_RELATION,  GH_AST_SHIFTER,
-		GH_AST_ADDER,     GH_AST_FACTOR,
-		GH_AST_UNARY,     GH_AST_PRIMARY,
-	} type;
+typedef u32 gh_node;
 
+typedef struct {
+	u32 start; // index into gh_ast_tree.extra
+	u32 len;
+} gh_list;
+
+enum gh_ast_type {
+	GH_AST_NONE,
+	GH_AST_PRGM,
+	GH_AST_FUN,       GH_AST_PARAM,
+	GH_AST_VAR,       GH_AST_BLOCK,
+	GH_AST_IF,        GH_AST_MATCH,
+	GH_AST_MSELECT,   GH_AST_WHILE,
+	GH_AST_ASSGN,     GH_AST_RETURN,
+	GH_AST_OR,        GH_AST_AND,
+	GH_AST_BOR,       GH_AST_BXOR,
+	GH_AST_BAND,      GH_AST_COMPARE,
+	GH_AST_RELATION,  GH_AST_SHIFTER,
+	GH_AST_ADDER,     GH_AST_FACTOR,
+	GH_AST_UNARY,     GH_AST_PRIMARY,
+};
+
+typedef struct {
+	// The identifier of a fun, param, var or assignment, the operator of
+	// a unary or binary node, or the literal of a primary
+	gh_tok tok;
+	u8 type; // enum gh_ast_type
+
+	// Types are keywords, so only their kind is kept
 	union {
-		struct { struct gh_ast *decl;  } prgm;
-		struct {
-			struct gh_ast *child;
-			struct gh_ast *decl; // optional
-		} decl;
+		struct { gh_list decls; } prgm;
 		struct {
-			gh_token *ident;
-			struct gh_ast *flist;
-			gh_token *type;
-			struct gh_ast *block;
+			gh_list params;
+			gh_list block;
+			u8 type;
 		} fun;
+		struct { u8 type; } param;
 		struct {
-			gh_token *type;
-			gh_token *ident;
-			struct gh_ast *flist; // optional
-		} flist;
-		struct {
-			gh_token *ident;
-			gh_token *type;
-			struct gh_ast *expr; // optional
+			gh_node expr; // optional
+			u32 len;      // elements of an array, 0 for a scalar
+			u8 type;      // of the elements, for an array
 		} var;
+		struct { gh_list block; } block;
 		struct {
-			struct gh_ast *child;
-			struct gh_ast *statement;
-		} statement;
-		struct {
-			struct gh_ast *expr;
-			struct gh_ast *statement;
-			struct gh_ast *endif;
+			gh_node expr; // missing for the final else
+			gh_list block;
+			gh_node endif; // optional
 		} ifexpr;
 		struct {
-			struct gh_ast *expr;
-			struct gh_ast *mselect; // optional
+			gh_node expr; // optional
+			gh_list arms;
 		} match;
 		struct {
-			struct gh_ast *expr;
-			struct gh_ast *statement;
-			struct gh_ast *mselect; // optional
+			gh_node expr;
+			gh_list block;
 		} mselect;
 		struct {
-			struct gh_ast *expr;
-			struct gh_ast *block;
+			gh_node expr;
+			gh_list block;
 		} whileexpr;
-		struct {
-			struct gh_ast *expr;
-		} returnexpr;
+		struct { gh_node expr; } returnexpr; // optional
 
 		struct {
-			struct gh_ast *first;
-			struct gh_ast *second;
+			gh_node first;
+			gh_node second;
 		} branch;
 		struct {
-			gh_token *op;
-			struct gh_ast *first;
-			struct gh_ast *second;
-		} branch_op;
-		struct {
-			gh_token *ident;
-			gh_token *op;
-			struct gh_ast *expr;
+			gh_node expr;
+			gh_node index; // optional, the element of an array assigned
+			u8 op;
 		} assgn;
+		struct { gh_node child; } unary;
 		struct {
-			gh_token *op;
-			struct gh_ast *child;
-		} unary;
-		struct {
-			gh_token *literal;
-			struct gh_ast *clist; // for function calls
+			gh_list args;
+			gh_node index; // optional, the element of an array read
+			u8 call; // the identifier is called, even with no args
 		} primary;
-		struct {
-			struct gh_ast *expr;
-			struct gh_ast *clist;
-		} clist;
 	};
 } gh_ast;
 
-gh_ast *gh_ast_init(token_v tokens);
-void gh_ast_debug(gh_ast *root);
-void gh_ast_deinit(gh_ast *root);
+DEFINE_VEC(gh_ast);
+
+// A parse session. The whole tree is two arrays, so it is released at once
+// by gh_ast_deinit.
+typedef struct {
+	VEC(gh_ast) nodes;
+	VEC(u32) extra; // the contents of every gh_list
+	gh_node root;
+} gh_ast_tree;
+
+static inline gh_ast *gh_ast_get(const gh_ast_tree *tree, gh_node node) {
+	return &tree->nodes.data[node];
+}
+
+static inline gh_node gh_ast_nth(const gh_ast_tree *tree, gh_list list, u32 i) {
+	return tree->extra.data[list.start + i];
+}
+
+int gh_ast_init(gh_ast_tree *tree, gh_lexer *lx);
+void gh_ast_debug(const gh_lexer *lx, const gh_ast_tree *tree);
+void gh_ast_deinit(gh_ast_tree *tree);
 
 #endif // _GALACH_AST_H
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Compares parse time and peak RSS of the working tree against a git
+# revision (HEAD by default), on a large generated source file. The
+# revision has to know the -s flag.
+#
+# usage: bench/parse.sh [number of statements] [revision]
+set -e
+
+N=${1:-200000}
+BASE=${2:-HEAD}
+CC=${CC:-gcc}
+CFLAGS="-std=gnu99 -O3"
+
+cd "$(dirname "$0")/.."
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/base"
+git archive "$BASE" | tar -x -C "$DIR/base"
+(cd "$DIR/base" && $CC $CFLAGS *.c -o "$DIR/galach-base")
+$CC $CFLAGS *.c -o "$DIR/galach-tree"
+
+awk -v n="$N" 'BEGIN {
+	print "fun main() -> unit begin"
+	print "\tvar x : i64 = 0"
+	for (i = 0; i < n; i++)
+		printf "\tx += (%d * 3 + x) & (%d - 1 << 2)\n", i, i % 97
+	print "\tprint64(x)"
+	print "end"
+}' > "$DIR/big.glc"
+
+for v in base tree; do
+	printf "%-6s" "$v"
+	"$DIR/galach-$v" -s "$DIR/big.glc" 2>&1 >/dev/null | sed 's/^\[info\]: [^:]*: //'
+done
@@ -3,13 +3,18 @@
 #include <string.h>
 #include <errno.h>
 #include <setjmp.h>
+#include <time.h>
 
 #include "bytecode.h"
 #include "token.h"
 #include "log.h"
 #include "vm.h"
+#include "opt.h"
+#include "ir.h"
+#include "debug.h"
+#include "native.h"
 
-static char *gh_slurp_src(char *file) {
+static char *gh_slurp_src(const char *file) {
 	FILE *fp = fopen(file, "r");
 	if (!fp) {
 		gh_log(GH_LOG_WARN, "fopen: %s: %s", file, strerror(errno));
@@ -48,45 +53,54 @@ void gh_bytecode_init(gh_bytecode *bytecode) {
 	*bytecode = (gh_bytecode){};
 }
 
-typedef union {
-	f32 f;
-	u32 u;
-} f32_u32;
-
-typedef union {
-	f64 f;
-	u64 u;
-} f64_u64;
-
-typedef enum gh_token_id gh_type;
-
 DEFINE_VEC(gh_type);
 typedef struct {
 	enum gh_local_id {
 		GH_LOCAL_VAR,
 		GH_LOCAL_FUN,
 		GH_LOCAL_SYSFUN,
+		GH_LOCAL_BUILTIN, // compiled inline to the op in offset
 	} id;
 
 	char *name;
+	u32 key;    // interned name, see gh_sym_key
+	u32 shadow; // binding of the same name this one hides, + 1
 	gh_type type;
 	VEC(gh_type) param_types;
+	u32 len; // arrays only: the number of elements, whose type is type
 
 	int emitted;
 	// The offset from the base pointer
 	// If this is positive, then it's an argument to the function
 	// If it's negative, then it's a local variable
 	i64 offset;
+
+	// Functions only: the declaration, and the size in nodes of the body
+	// with the inlined calls in it expanded, 0 if it is never inlined
+	gh_node node;
+	u32 inline_size;
 } gh_local;
 
 DEFINE_VEC(gh_local);
-typedef struct gh_local_list {
+
+// Every binding in scope lives on one stack, innermost last. Names are
+// interned by the lexer, so the interned index doubles as a perfect hash:
+// heads maps it straight to the innermost binding, and each binding links
+// to the one it shadows. Leaving a scope pops the stack back to where the
+// scope started and restores the shadowed heads, so neither lookups nor
+// scope changes allocate. It also gives back the stack slots of the
+// scope's variables, which later scopes reuse, so the frame only has to
+// hold the deepest nesting of live variables.
+typedef struct {
 	VEC(gh_local) locals;
-	struct gh_local_list *prev;
-} gh_local_list;
+	VEC(u64) scopes;  // locals.used when each open scope was entered
+	VEC(u64) offsets; // offset_counter when each open scope was entered
+	u32 *heads;      // innermost binding of each name + 1, 0 if unbound
+	u64 nnames;
+} gh_symtab;
 
 static i64 offset_counter = 0;
-static int compile_success = 0;
+static i64 offset_min = 0; // lowest offset_counter in the function, its frame size
 static jmp_buf compile_end;
 #define COMPILE_FAIL() do { \
 	gh_log(GH_LOG_ERR, "compilation failed from %s, line %d", __FUNCTION__, __LINE__); \
@@ -94,6 +108,10 @@ static jmp_buf compile_end;
 } while (0)
 
 static gh_bytecode *bc;
+static gh_symtab syms;
+static const gh_lexer *toks;
+static const gh_ast_tree *tree;
+#define NODE(n) gh_ast_get(tree, (n))
 
 static i64 gh_get_type_size(gh_type type) {
 	switch (type) {
@@ -108,68 +126,113 @@ static i64 gh_get_type_size(gh_type type) {
 		case GH_TOK_KW_I64:
 		case GH_TOK_KW_F64:
 		case GH_TOK_KW_U64: return 8;
+		case GH_TOK_KW_V4I32:
+		case GH_TOK_KW_V2I64: return 16;
+		case GH_TOK_KW_STR: return 8;
 		default:
 			gh_log(GH_LOG_ERR, "cannot get size of type: it's not a type");
 			COMPILE_FAIL();
 	}
 }
 
-static void gh_init_local_list(gh_local_list *list, gh_local_list *prev) {
-	list->locals = INIT_VEC(gh_local);
-	list->prev = prev;
+static void gh_sym_init(void) {
+	syms.locals = INIT_VEC(gh_local);
+	syms.scopes = INIT_VEC(u64);
+	syms.offsets = INIT_VEC(u64);
+	syms.nnames = toks->strs.used;
+	syms.heads = gh_malloc((syms.nnames + 1) * sizeof(u32)); // never empty
+	memset(syms.heads, 0, (syms.nnames + 1) * sizeof(u32));
+}
+
+static void gh_enter_scope(void) {
+	APPEND_VEC(syms.scopes, syms.locals.used);
+	APPEND_VEC(syms.offsets, (u64) offset_counter);
 }
 
-static void gh_deinit_local_list(gh_local_list *list) {
-	FREE_VEC(list->locals);
-	if (list->prev)
-		gh_deinit_local_list(list->prev);
+static void gh_leave_scope(void) {
+	u64 start = syms.scopes.data[--syms.scopes.used];
+	offset_counter = (i64) syms.offsets.data[--syms.offsets.used];
+	while (syms.locals.used > start) {
+		gh_local *local = &syms.locals.data[--syms.locals.used];
+		syms.heads[local->key] = local->shadow;
+		if (!VEC_IS_NULL(local->param_types))
+			FREE_VEC(local->param_types);
+	}
+}
+
+static void gh_sym_deinit(void) {
+	while (syms.scopes.used)
+		gh_leave_scope();
+	FREE_VEC(syms.locals);
+	FREE_VEC(syms.scopes);
+	FREE_VEC(syms.offsets);
+	gh_free(syms.heads);
+	syms.heads = NULL;
 }
 
 static i64 gh_calc_offset(i64 typesize) {
 	offset_counter -= typesize;
+	if (offset_counter < offset_min)
+		offset_min = offset_counter;
 	return offset_counter;
 }
 
-// Adds a local to the local list
+// Adds a local to the innermost scope. The returned index stays valid
+// until the scope is left, unlike a pointer into the stack.
 // var x : u32 = 5
 // ^ adds local
-static gh_local *gh_add_local(gh_local_list *list, const gh_local *local) {
-	APPEND_VEC(list->locals, *local);
-	return LAST_VEC(list->locals);
-}
-
-static gh_local *gh_find_local_depth1(gh_local_list *list, char *name) {
-	LOOP_VEC(list->locals, local, {
-		if (strcmp(local->name, name) == 0)
-			return local;
-	});
-	return NULL;
+static u64 gh_add_local(const gh_local *local) {
+	u64 idx = syms.locals.used;
+	APPEND_VEC(syms.locals, *local);
+	gh_local *new = LAST_VEC(syms.locals);
+	new->shadow = syms.heads[new->key];
+	syms.heads[new->key] = (u32) idx + 1;
+	return idx;
 }
 
-// Finds a local in the local list (and previous lists)
+// Finds the innermost binding of a name
 // x += 5
 // ^ finds local
-static gh_local *gh_find_local(gh_local_list *list, char *name) {
-	while (list) {
-		gh_local *local = gh_find_local_depth1(list, name);
-		if (local) return local;
-		list = list->prev;
-	}
-	return NULL;
+static gh_local *gh_find_local(u32 key) {
+	u32 head = syms.heads[key];
+	return head ? &syms.locals.data[head - 1] : NULL;
 }
 
-static gh_local *gh_get_req_local(gh_local_list *pl, gh_token *ident) {
-	gh_local *local = gh_find_local(pl, ident->info.str);
+static gh_local *gh_get_req_local(gh_tok ident) {
+	gh_local *local = gh_find_local(ident.payload);
 	if (!local) {
-		gh_log(GH_LOG_ERR, "undeclared identifier \"%s\"", ident->info.str);
+		gh_log(GH_LOG_ERR, "undeclared identifier \"%s\"", gh_token_str(toks, ident));
 		COMPILE_FAIL();
 	}
 	return local;
 }
 
+// What a compile produces. Compiling again into the same bytecode starts
+// over, so nothing of the last program is left to be run.
+static void gh_free_code(gh_bytecode *bytecode) {
+	if (!VEC_IS_NULL(bytecode->bytes))
+		FREE_VEC(bytecode->bytes);
+	if (!VEC_IS_NULL(bytecode->funs)) {
+		LOOP_VEC(bytecode->funs, fun, {
+			gh_free(fun->name);
+			gh_free(fun->params);
+		});
+		FREE_VEC(bytecode->funs);
+	}
+	if (!VEC_IS_NULL(bytecode->rodata))
+		FREE_VEC(bytecode->rodata);
+	bytecode->main_idx = 0;
+	bytecode->main_defined = 0;
+	bytecode->nrewrites = 0;
+	bytecode->ninlined = 0;
+	bytecode->ntail = 0;
+}
+
 static void gh_init_code(void) {
+	gh_free_code(bc);
 	bc->bytes = INIT_VEC(u8);
 	bc->funs = INIT_VEC(gh_fun);
+	bc->rodata = INIT_VEC(u8);
 }
 
 static void emitb(u8 b) {
@@ -188,134 +251,430 @@ static void emitqw(u64 qw) {
 	emitqw_vec(bc->bytes, qw);
 }
 
-static void gh_emit_expr(gh_local_list *pl, gh_ast *ast, gh_type *type);
+static void gh_emit_expr(gh_node node, gh_type *type);
+static void gh_emit_inline(gh_ast *call, u64 callee);
+static void gh_emit_store(gh_type type, i64 offset);
 
 #define BIT_CASE8  case GH_TOK_KW_I8:  case GH_TOK_KW_U8
 #define BIT_CASE16 case GH_TOK_KW_I16: case GH_TOK_KW_U16
 #define BIT_CASE32 case GH_TOK_KW_I32: case GH_TOK_KW_U32
 #define BIT_CASE64 case GH_TOK_KW_I64: case GH_TOK_KW_U64
-#define MULTI_CASE(inst) \
+#define INT_CASE(inst) \
 	BIT_CASE8: emitb((inst)); break; \
 	BIT_CASE16: emitb((inst)+1); break; \
-	case GH_TOK_KW_F32: \
 	BIT_CASE32: emitb((inst)+2); break; \
-	case GH_TOK_KW_F64: \
 	BIT_CASE64: emitb((inst)+3); break;
+#define MULTI_CASE(inst) \
+	INT_CASE(inst) \
+	case GH_TOK_KW_F32: emitb((inst)+2); break; \
+	case GH_TOK_KW_F64: emitb((inst)+3); break;
+#define FLOAT_CASE(finst) \
+	case GH_TOK_KW_F32: emitb((finst)); break; \
+	case GH_TOK_KW_F64: emitb((finst)+1); break;
+#define VEC_CASE(vinst) \
+	case GH_TOK_KW_V4I32: emitb((vinst)); break; \
+	case GH_TOK_KW_V2I64: emitb((vinst)+1); break;
+// Values that are moved around but not computed with, which a str is too
+#define MOV_CASE(inst) \
+	MULTI_CASE(inst) \
+	case GH_TOK_KW_STR: emitb((inst)+3); break;
+
+
+static int gh_is_signed(gh_type type) {
+	switch (type) {
+		case GH_TOK_KW_I8: case GH_TOK_KW_I16:
+		case GH_TOK_KW_I32: case GH_TOK_KW_I64: return 1;
+		default: return 0;
+	}
+}
 
+static int gh_is_float(gh_type type) {
+	return type == GH_TOK_KW_F32 || type == GH_TOK_KW_F64;
+}
 
-// Emit code to cast the a register to another "type"
-// TODO: floating point
-static void gh_emit_cast(gh_type from, gh_type to) {
-	switch (from) {
-		BIT_CASE8: {
-			switch (to) {
-				BIT_CASE8: break;
-				case GH_TOK_KW_I16:
-					emitb(from == GH_TOK_KW_I8 ? GH_VM_SEXT_A8_16
-						: GH_VM_ZEXT_A8_16);
-					break;
-				case GH_TOK_KW_U16: emitb(GH_VM_ZEXT_A8_16); break;
-				case GH_TOK_KW_I32:
-					gh_emit_cast(from, GH_TOK_KW_I16);
-					gh_emit_cast(GH_TOK_KW_I16, GH_TOK_KW_I32);
-					break;
-				case GH_TOK_KW_U32:
-					gh_emit_cast(from, GH_TOK_KW_U16);
-					gh_emit_cast(GH_TOK_KW_U16, GH_TOK_KW_U32);
-					break;
-				case GH_TOK_KW_I64:
-					gh_emit_cast(from, GH_TOK_KW_I32);
-					gh_emit_cast(GH_TOK_KW_I32, GH_TOK_KW_I64);
-					break;
-				default: COMPILE_FAIL();
-			}
-			break;
+// Vectors live in the v register and in 16 byte slots of the frame. They
+// are only ever locals, never parameters, results or array elements.
+static int gh_is_vector(gh_type type) {
+	return type == GH_TOK_KW_V4I32 || type == GH_TOK_KW_V2I64;
+}
+
+static gh_type gh_lane_type(gh_type type) {
+	return type == GH_TOK_KW_V2I64 ? GH_TOK_KW_I64 : GH_TOK_KW_I32;
+}
+
+// The ops that convert register a from one type to another, either of
+// which may be 0. The first extends the integer bits, which a load can do
+// instead, and the second converts those to a float.
+//
+// Integer extensions fill all 64 bits of the register, so a single op from
+// the source width reaches any wider type. The value is sign-extended
+// only if both types are signed. An integer becomes a float from all 64
+// bits, signed or not as its type is, and a float becomes an integer of any
+// width the same way. A vector is made by casting to the lane type and
+// copying that to every lane.
+static void gh_cast_ops(gh_type from, gh_type to, u8 *ext, u8 *conv) {
+	i64 fsize = gh_get_type_size(from), tsize = gh_get_type_size(to);
+	u8 wi = fsize == 1 ? 0 : fsize == 2 ? 1 : 2;
+	*ext = *conv = 0;
+	if (!fsize || !tsize)
+		COMPILE_FAIL();
+	if (from == GH_TOK_KW_STR || to == GH_TOK_KW_STR) {
+		if (from != to) {
+			gh_log(GH_LOG_ERR, "a str can only be used as a str");
+			COMPILE_FAIL();
 		}
-		BIT_CASE16: {
-			switch (to) {
-				BIT_CASE16: break;
-				case GH_TOK_KW_I32:
-					emitb(from == GH_TOK_KW_I16 ? GH_VM_SEXT_A16_32
-						: GH_VM_ZEXT_A16_32);
-					break;
-				case GH_TOK_KW_U32: emitb(GH_VM_ZEXT_A16_32); break;
-				case GH_TOK_KW_I64:
-					gh_emit_cast(from, GH_TOK_KW_I32);
-					gh_emit_cast(GH_TOK_KW_I32, GH_TOK_KW_I64);
-					break;
-				case GH_TOK_KW_U64:
-					gh_emit_cast(from, GH_TOK_KW_U32);
-					gh_emit_cast(GH_TOK_KW_U32, GH_TOK_KW_U64);
-					break;
-				default: COMPILE_FAIL();
-			}
-			break;
+		return ;
+	}
+	if (gh_is_vector(from) || gh_is_vector(to)) {
+		if (from == to)
+			return ;
+		if (gh_is_vector(from) || gh_is_float(from)) {
+			gh_log(GH_LOG_ERR, "a vector can only be made from an integer");
+			COMPILE_FAIL();
 		}
-		BIT_CASE32: {
-			switch (to) {
-				BIT_CASE32: break;
-				case GH_TOK_KW_I64:
-					emitb(from == GH_TOK_KW_I32 ? GH_VM_SEXT_A32_64
-						: GH_VM_ZEXT_A32_64);
-					break;
-				case GH_TOK_KW_U64: emitb(GH_VM_ZEXT_A32_64); break;
-				default: COMPILE_FAIL();
-			}
-			break;
+		gh_cast_ops(from, gh_lane_type(to), ext, conv);
+		*conv = to == GH_TOK_KW_V2I64 ? GH_VM_VSPLAT64 : GH_VM_VSPLAT32;
+		return ;
+	}
+	if (gh_is_float(from)) {
+		if (!gh_is_float(to)) {
+			*conv = (gh_is_signed(to) ? GH_VM_FTOI32 : GH_VM_FTOU32) + (fsize == 8);
+		} else if (tsize < fsize) {
+			gh_log(GH_LOG_ERR, "an f64 can't be narrowed to an f32");
+			COMPILE_FAIL();
+		} else if (tsize > fsize) {
+			*conv = GH_VM_FEXT;
 		}
-		BIT_CASE64: {
-			switch (to) {
-				BIT_CASE64: break;
-				default: COMPILE_FAIL();
-			}
-			break;
+	} else if (gh_is_float(to)) {
+		if (fsize < 8)
+			*ext = (gh_is_signed(from) ? GH_VM_SEXT_A8 : GH_VM_ZEXT_A8) + wi;
+		*conv = (gh_is_signed(from) ? GH_VM_ITOF32 : GH_VM_UTOF32) + (tsize == 8);
+	} else {
+		if (tsize < fsize || (fsize == 1 && to == GH_TOK_KW_U64)) {
+			gh_log(GH_LOG_ERR, "an integer can't be narrowed");
+			COMPILE_FAIL();
 		}
-		default: COMPILE_FAIL();
+		if (tsize > fsize)
+			*ext = (gh_is_signed(from) && gh_is_signed(to) ? GH_VM_SEXT_A8 : GH_VM_ZEXT_A8) + wi;
 	}
 }
 
+// Emit code to cast the a register to another "type"
+static void gh_emit_cast(gh_type from, gh_type to) {
+	u8 ext, conv;
+	gh_cast_ops(from, to, &ext, &conv);
+	if (ext)
+		emitb(ext);
+	if (conv)
+		emitb(conv);
+}
+
 #define OP_MULTI(inst) switch (*type) { \
 	MULTI_CASE(inst); \
 	default: COMPILE_FAIL(); \
 }
 
+// For ops on numbers, rather than on bits: finst and finst + 1 are the
+// f32 and f64 versions
+#define OP_ARITH(inst, finst) switch (*type) { \
+	INT_CASE(inst); \
+	FLOAT_CASE(finst); \
+	default: COMPILE_FAIL(); \
+}
+
+#define OP_INT(inst) switch (*type) { \
+	INT_CASE(inst); \
+	default: COMPILE_FAIL(); \
+}
+
+// For moves, which vectors do with the vinst pair
+#define OP_MOV(inst, vinst) switch (*type) { \
+	MOV_CASE(inst); \
+	VEC_CASE(vinst); \
+	default: COMPILE_FAIL(); \
+}
+
 static void gh_emit_op_push(gh_type *type) {
-	if (*type == GH_TOK_KW_F32 || *type == GH_TOK_KW_F64) COMPILE_FAIL(); // fow now
-	OP_MULTI(GH_VM_PUSH8);
+	switch (*type) {
+		MOV_CASE(GH_VM_PUSH8);
+		case GH_TOK_KW_V4I32:
+		case GH_TOK_KW_V2I64: emitb(GH_VM_VPUSH); break;
+		default: COMPILE_FAIL();
+	}
+}
+
+// A sysfun can take an array by reference, see GH_ARRAY_OF
+static int gh_is_array_ref(gh_type type) {
+	return type & GH_ARRAY_REF;
+}
+
+static void gh_add_callable(enum gh_local_id id, i64 op, char *name, gh_type type,
+		const gh_type *params, u64 nparams) {
+	u32 key;
+	if (gh_lex_find(toks, name, &key))
+		return ;
+	gh_local *tmp = &syms.locals.data[gh_add_local(&(const gh_local) {
+		.id = id,
+		.name = name,
+		.key = key,
+		.type = type,
+		.offset = op,
+	})];
+	GROW_VEC(tmp->param_types, nparams);
+	for (u64 i = 0; i < nparams; i++)
+		APPEND_VEC_RAW(tmp->param_types, params[i]);
 }
 
-static void gh_register_sysfuns(gh_local_list *list) {
-	#define ADD_SF(_name, _type, ...) do { \
-		gh_local *tmp = gh_add_local(list, &(const gh_local) { \
-			.id = GH_LOCAL_SYSFUN, \
-			.name = _name, \
-			.type = _type, \
-		}); \
+// Natives and builtins whose name never appears in the source cannot be
+// referenced, so they are not bound at all. A native's offset is its
+// index, which is what SYSFUN takes.
+static void gh_register_sysfuns(void) {
+	#define ADD_BUILTIN(_op, _name, _type, ...) do { \
 		const gh_type arr[] = {__VA_ARGS__}; \
-		const u64 narr = sizeof(arr) / sizeof(gh_type); \
-		GROW_VEC(tmp->param_types, narr); \
-		for (u64 i = 0; i < narr; i++) \
-			APPEND_VEC_RAW(tmp->param_types, arr[i]); \
+		gh_add_callable(GH_LOCAL_BUILTIN, _op, _name, _type, \
+			arr, sizeof(arr) / sizeof(gh_type)); \
 	} while (0)
-	ADD_SF("print8", GH_TOK_KW_UNIT, GH_TOK_KW_I8);
-	ADD_SF("print16", GH_TOK_KW_UNIT, GH_TOK_KW_I16);
-	ADD_SF("print32", GH_TOK_KW_UNIT, GH_TOK_KW_I32);
-	ADD_SF("print64", GH_TOK_KW_UNIT, GH_TOK_KW_I64);
+	for (u64 i = 0, n = gh_native_count(); i < n; i++) {
+		const gh_native *nf = gh_native_get(i);
+		gh_add_callable(GH_LOCAL_SYSFUN, (i64) i, nf->name, nf->ret,
+			nf->params, nf->nparams);
+	}
+	ADD_BUILTIN(GH_VM_VSUM32, "hsum32", GH_TOK_KW_I32, GH_TOK_KW_V4I32);
+	ADD_BUILTIN(GH_VM_VSUM64, "hsum64", GH_TOK_KW_I64, GH_TOK_KW_V2I64);
+	ADD_BUILTIN(GH_VM_VLOAD_INDEX32, "vload32", GH_TOK_KW_V4I32,
+		GH_ARRAY_OF(GH_TOK_KW_I32), GH_TOK_KW_I64);
+	ADD_BUILTIN(GH_VM_VLOAD_INDEX64, "vload64", GH_TOK_KW_V2I64,
+		GH_ARRAY_OF(GH_TOK_KW_I64), GH_TOK_KW_I64);
+	ADD_BUILTIN(GH_VM_VSTORE_INDEX32, "vstore32", GH_TOK_KW_UNIT,
+		GH_ARRAY_OF(GH_TOK_KW_I32), GH_TOK_KW_I64, GH_TOK_KW_V4I32);
+	ADD_BUILTIN(GH_VM_VSTORE_INDEX64, "vstore64", GH_TOK_KW_UNIT,
+		GH_ARRAY_OF(GH_TOK_KW_I64), GH_TOK_KW_I64, GH_TOK_KW_V2I64);
+}
+
+// Loads a variable at an offset, converted to type. The load does the
+// extension, if any, so it is the only thing clearing bits a held above
+// the variable's width (see gh_peep_store_load).
+static void gh_emit_var_load(gh_type vtype, i64 offset, gh_type type) {
+	u8 ext, conv;
+	gh_cast_ops(vtype, type, &ext, &conv);
+	if (ext >= GH_VM_SEXT_A8 && ext <= GH_VM_SEXT_A32) {
+		emitb(GH_VM_MOV_OFFSET_SX_A8 + ext - GH_VM_SEXT_A8);
+	} else {
+		switch (vtype) {
+			MOV_CASE(GH_VM_MOV_OFFSET_A8);
+			VEC_CASE(GH_VM_VLOAD32);
+			default: COMPILE_FAIL();
+		}
+	}
+	emitqw((u64) offset);
+	if (conv)
+		emitb(conv);
+}
+
+// Arrays are laid out in the frame like one variable of all their bytes,
+// element 0 at the array's offset. An element is read or written by one op
+// that scales the index in register a by the width, after a BOUND unless
+// the index is known to be in range, and a constant index is an offset.
+// A vector is laid out the same way, so its lanes are indexed like this
+// too.
+
+// The elements of an array or the lanes of a vector, and their type
+static u32 gh_var_elems(const gh_local *local, gh_type *etype) {
+	if (gh_is_vector(local->type)) {
+		*etype = gh_lane_type(local->type);
+		return (u32) (16 / gh_get_type_size(*etype));
+	}
+	*etype = local->type;
+	return local->len;
+}
+
+// An exclusive bound on an operand of an index, as emitted at i64
+static u64 gh_index_leaf_bound(gh_ast *ast) {
+	if (ast->type != GH_AST_PRIMARY)
+		return UINT64_MAX;
+	if (ast->tok.kind == GH_TOK_LIT_INT) {
+		u64 k = gh_token_int(toks, ast->tok);
+		return k == UINT64_MAX ? k : k + 1;
+	}
+	if (ast->tok.kind != GH_TOK_IDENT || ast->primary.call)
+		return UINT64_MAX;
+	// Unsigned variables are zero-extended, array elements included
+	gh_local *local = gh_find_local(ast->tok.payload);
+	i64 size = local && local->id == GH_LOCAL_VAR ? gh_get_type_size(local->type) : 8;
+	if (size >= 8 || gh_is_signed(local->type) || gh_is_float(local->type))
+		return UINT64_MAX;
+	return (u64) 1 << (8 * size);
+}
+
+// An exclusive bound on an index, UINT64_MAX if none is known. DIV, MOD
+// and BAND are unsigned at any width, so x % k and x & k are bounded by k.
+static u64 gh_index_bound(gh_node node) {
+	gh_ast *ast = NODE(node);
+	switch (ast->type) {
+		case GH_AST_FACTOR: {
+			gh_ast *k = NODE(ast->branch.second);
+			if (ast->tok.kind != GH_TOK_MODULO || k->type != GH_AST_PRIMARY
+					|| k->tok.kind != GH_TOK_LIT_INT || !gh_token_int(toks, k->tok))
+				return UINT64_MAX;
+			return gh_token_int(toks, k->tok);
+		}
+		case GH_AST_BAND: {
+			u64 a = gh_index_leaf_bound(NODE(ast->branch.first));
+			u64 b = gh_index_leaf_bound(NODE(ast->branch.second));
+			return a < b ? a : b;
+		}
+		default: return gh_index_leaf_bound(ast);
+	}
+}
+
+// Returns 1 and the element's offset if the index is a constant
+static int gh_const_index(gh_node index, gh_type etype, i64 base, u32 len, i64 *offset) {
+	gh_ast *ast = NODE(index);
+	if (ast->type != GH_AST_PRIMARY || ast->tok.kind != GH_TOK_LIT_INT)
+		return 0;
+	u64 k = gh_token_int(toks, ast->tok);
+	if (k >= len) {
+		gh_log(GH_LOG_ERR, "index %llu is out of range for an array of %u",
+			(unsigned long long) k, len);
+		COMPILE_FAIL();
+	}
+	*offset = base + (i64) k * gh_get_type_size(etype);
+	return 1;
+}
+
+static void gh_emit_index(gh_node index, u32 len) {
+	gh_type type = GH_TOK_KW_I64;
+	gh_emit_expr(index, &type);
+	if (gh_index_bound(index) > len) {
+		emitb(GH_VM_BOUND);
+		emitqw(len);
+	}
+}
+
+// A variable, which has to be an array if and only if it is indexed.
+// Vectors may be either.
+static gh_local *gh_get_var(gh_tok ident, u8 indexed) {
+	gh_local *local = gh_get_req_local(ident);
+	if (local->id != GH_LOCAL_VAR) {
+		gh_log(GH_LOG_ERR, "\"%s\" is not a variable", local->name);
+		COMPILE_FAIL();
+	}
+	if (indexed && !local->len && !gh_is_vector(local->type)) {
+		gh_log(GH_LOG_ERR, "can only index an array or a vector");
+		COMPILE_FAIL();
+	}
+	if (!indexed && local->len) {
+		gh_log(GH_LOG_ERR, "an array can only be used an element at a time");
+		COMPILE_FAIL();
+	}
+	return local;
+}
+
+static void gh_emit_element(gh_ast *ast, gh_type *type) {
+	gh_local *local = gh_get_var(ast->tok, 1);
+	gh_type etype;
+	u32 len = gh_var_elems(local, &etype);
+	i64 base = local->offset, offset;
+	if (*type == GH_TOK_KW_UNIT)
+		*type = etype;
+	if (gh_const_index(ast->primary.index, etype, base, len, &offset)) {
+		gh_emit_var_load(etype, offset, *type);
+		return ;
+	}
+	gh_emit_index(ast->primary.index, len);
+	switch (etype) {
+		MOV_CASE(GH_VM_MOV_INDEX_A8);
+		default: COMPILE_FAIL();
+	}
+	emitqw((u64) base);
+	gh_emit_cast(etype, *type);
+}
+
+// Where each string literal went in the rodata pool + 1, by its interned
+// payload. The lexer has already merged equal literals, so each one is
+// copied into the pool only the first time it is used.
+static u32 *str_offsets;
+
+static void gh_emit_str(gh_tok tok) {
+	char *str = gh_token_str(toks, tok);
+	u64 len = strlen(str);
+	u32 *at = &str_offsets[tok.payload];
+	if (!*at) {
+		if (bc->rodata.used + len >= UINT32_MAX) {
+			gh_log(GH_LOG_ERR, "too many string constants");
+			COMPILE_FAIL();
+		}
+		*at = (u32) bc->rodata.used + 1;
+		GROW_VEC(bc->rodata, len);
+		memcpy(bc->rodata.data + bc->rodata.used, str, len);
+		bc->rodata.used += len;
+	}
+	emitb(GH_VM_MOV_STR_A);
+	emitqw(((u64) (*at - 1) << 32) | len);
+}
+
+// The array an argument of type GH_ARRAY_OF(...) names
+static gh_local *gh_get_array_arg(gh_node node, gh_type type) {
+	gh_ast *ast = NODE(node);
+	gh_type etype = (gh_type) (type & ~GH_ARRAY_REF);
+	if (ast->type != GH_AST_PRIMARY || ast->tok.kind != GH_TOK_IDENT
+			|| ast->primary.call || ast->primary.index) {
+		gh_log(GH_LOG_ERR, "expected the name of an array");
+		COMPILE_FAIL();
+	}
+	gh_local *local = gh_get_req_local(ast->tok);
+	if (local->id != GH_LOCAL_VAR || !local->len) {
+		gh_log(GH_LOG_ERR, "\"%s\" is not an array", local->name);
+		COMPILE_FAIL();
+	}
+	if (gh_is_float(local->type) || local->type == GH_TOK_KW_STR
+			|| gh_get_type_size(local->type) != gh_get_type_size(etype)) {
+		gh_log(GH_LOG_ERR, "expected an array of %lld-byte integers",
+			(long long) gh_get_type_size(etype));
+		COMPILE_FAIL();
+	}
+	return local;
 }
 
-static u64 get_sysfun(gh_local *local) {
-	#define SF_CHECK(n, num) \
-	if (!strcmp(local->name, n)) { return num; }
-	SF_CHECK("print8", GH_SYSFUN_PRINT8);
-	SF_CHECK("print16", GH_SYSFUN_PRINT16);
-	SF_CHECK("print32", GH_SYSFUN_PRINT32);
-	SF_CHECK("print64", GH_SYSFUN_PRINT64);
+// Loads the reference to an array for a parameter of type GH_ARRAY_OF(...)
+static void gh_emit_array_ref(gh_node node, gh_type *type) {
+	gh_local *local = gh_get_array_arg(node, *type);
+	emitb(GH_VM_MOV_IMM_A64);
+	emitqw((u64) local->len << 32 | (u32) local->offset);
+	*type = GH_TOK_KW_U64;
+}
 
-	COMPILE_FAIL();
+// vload32(xs, i) and the like. The lanes are the elements from i on, so
+// the whole run is checked by one BOUND on i.
+static void gh_emit_vec_index(gh_ast *ast, u8 op, const gh_type *params) {
+	gh_list args = ast->primary.args;
+	gh_local *local = gh_get_array_arg(gh_ast_nth(tree, args, 0), params[0]);
+	u32 lanes = (u32) (16 / gh_get_type_size(local->type));
+	if (local->len < lanes) {
+		gh_log(GH_LOG_ERR, "\"%s\" is too short to hold a vector", local->name);
+		COMPILE_FAIL();
+	}
+	i64 base = local->offset;
+	gh_emit_index(gh_ast_nth(tree, args, 1), local->len - lanes + 1);
+	if (op == GH_VM_VSTORE_INDEX32 || op == GH_VM_VSTORE_INDEX64) {
+		emitb(GH_VM_PUSH64);
+		gh_type vtype = params[2];
+		gh_emit_expr(gh_ast_nth(tree, args, 2), &vtype);
+	}
+	emitb(op);
+	emitqw((u64) base);
 }
 
-static void gh_emit_primary(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	if (ast->primary.literal->id == GH_TOK_LIT_INT) {
+static void gh_emit_primary(gh_ast *ast, gh_type *type) {
+	if (ast->tok.kind == GH_TOK_LIT_STRING) {
+		if (*type == GH_TOK_KW_UNIT)
+			*type = GH_TOK_KW_STR;
+		if (*type != GH_TOK_KW_STR) {
+			gh_log(GH_LOG_ERR, "a string literal can only be a str");
+			COMPILE_FAIL();
+		}
+		gh_emit_str(ast->tok);
+	} else if (ast->tok.kind == GH_TOK_LIT_INT) {
 		switch (*type) {
 			case GH_TOK_KW_UNIT:
 				*type = GH_TOK_KW_I32;
@@ -323,43 +682,51 @@ static void gh_emit_primary(gh_local_list *pl, gh_ast *ast, gh_type *type) {
 
 			BIT_CASE8:
 				emitb(GH_VM_MOV_IMM_A8);
-				emitb((u8)ast->primary.literal->info.i);
+				emitb((u8)gh_token_int(toks, ast->tok));
 				break;
 
 			BIT_CASE16:
 				emitb(GH_VM_MOV_IMM_A16);
-				emitw((u16)ast->primary.literal->info.i);
+				emitw((u16)gh_token_int(toks, ast->tok));
 				break;
 
 			BIT_CASE32:
 			do_i32:
 				emitb(GH_VM_MOV_IMM_A32);
-				emitdw((u32)ast->primary.literal->info.i);
+				emitdw((u32)gh_token_int(toks, ast->tok));
 				break;
 
 			BIT_CASE64:
 				emitb(GH_VM_MOV_IMM_A64);
-				emitqw((u64)ast->primary.literal->info.i);
+				emitqw((u64)gh_token_int(toks, ast->tok));
 				break;
 
 			case GH_TOK_KW_F32:
 				emitb(GH_VM_MOV_IMM_A32);
 				f32_u32 x;
-				x.f = (f32) ast->primary.literal->info.i;
+				x.f = (f32) (i64) gh_token_int(toks, ast->tok);
 				emitdw(x.u);
 				break;
 
 			case GH_TOK_KW_F64:
 				emitb(GH_VM_MOV_IMM_A64);
 				f64_u64 y;
-				y.f = ast->primary.literal->info.i;
+				y.f = (f64) (i64) gh_token_int(toks, ast->tok);
 				emitqw(y.u);
 				break;
 
+			case GH_TOK_KW_V4I32:
+			case GH_TOK_KW_V2I64: {
+				gh_type lane = gh_lane_type(*type);
+				gh_emit_primary(ast, &lane);
+				gh_emit_cast(lane, *type);
+				break;
+			}
+
 			default:
 				COMPILE_FAIL();
 		}
-	} else if (ast->primary.literal->id == GH_TOK_LIT_FLOAT) {
+	} else if (ast->tok.kind == GH_TOK_LIT_FLOAT) {
 		switch (*type) {
 			case GH_TOK_KW_UNIT:
 				*type = GH_TOK_KW_F32;
@@ -373,23 +740,28 @@ static void gh_emit_primary(gh_local_list *pl, gh_ast *ast, gh_type *type) {
 			do_f32:
 				emitb(GH_VM_MOV_IMM_A32);
 				f32_u32 x;
-				x.f = (f32) ast->primary.literal->info.flt;
+				x.f = (f32) gh_token_flt(toks, ast->tok);
 				emitdw(x.u);
 				break;
 			case GH_TOK_KW_F64:
 				emitb(GH_VM_MOV_IMM_A64);
-				f32_u32 y;
-				y.f = ast->primary.literal->info.flt;
+				f64_u64 y;
+				y.f = gh_token_flt(toks, ast->tok);
 				emitqw(y.u);
 				break;
 
 			default:
 				COMPILE_FAIL();
 		}
-	} else if (ast->primary.literal->id == GH_TOK_IDENT) {
-		gh_local *local = gh_get_req_local(pl, ast->primary.literal);
-		if (ast->primary.clist) {
-			if (local->id != GH_LOCAL_FUN && local->id != GH_LOCAL_SYSFUN) {
+	} else if (ast->tok.kind == GH_TOK_IDENT) {
+		if (ast->primary.index) {
+			gh_emit_element(ast, type);
+			return ;
+		}
+		gh_local *local = gh_get_req_local(ast->tok);
+		if (ast->primary.call) {
+			if (local->id != GH_LOCAL_FUN && local->id != GH_LOCAL_SYSFUN
+					&& local->id != GH_LOCAL_BUILTIN) {
 				gh_log(GH_LOG_ERR, "can only call a function identifier");
 				COMPILE_FAIL();
 			}
@@ -398,36 +770,48 @@ static void gh_emit_primary(gh_local_list *pl, gh_ast *ast, gh_type *type) {
 				*type = local->type;
 
 			VEC(gh_type) plist = local->param_types;
-			gh_ast *clist = ast->primary.clist;
+			gh_list args = ast->primary.args;
 			i64 popsize = 0;
-			i64 nc = 0;
-			for (gh_ast *c = clist; c; c = c->clist.clist)
-				if (c->clist.expr) nc++;
-			if ((u64) nc != plist.used) {
-				gh_log(GH_LOG_ERR, "expected %llu args to function, got %lld",
-					plist.used, nc);
+			if ((u64) args.len != plist.used) {
+				gh_log(GH_LOG_ERR, "expected %llu args to function, got %u",
+					plist.used, args.len);
 				COMPILE_FAIL();
 			}
 
-			gh_ast **clist_copy = NULL;
-			if (nc) {
-				clist_copy = gh_malloc(nc * sizeof(gh_ast *));
-				for (nc = 0; clist; nc++, clist = clist->clist.clist)
-					clist_copy[nc] = clist->clist.expr;
-
-				for (nc -= 1; nc >= 0; nc--) {
-					if (clist_copy[nc]) {
-						gh_type type = plist.data[nc];
-						gh_emit_expr(pl, clist_copy[nc], &type);
-						gh_emit_op_push(&type);
-						popsize += gh_get_type_size(type);
-					}
-				}
+			// Emitting the arguments may add locals, which moves the stack
+			u64 idx = local - syms.locals.data;
+			gh_type ret = local->type;
+			if (local->inline_size) {
+				gh_emit_inline(ast, idx);
+				goto result;
+			}
+			if (local->id == GH_LOCAL_BUILTIN && plist.used > 1) {
+				gh_emit_vec_index(ast, (u8) local->offset, plist.data);
+				goto result;
+			}
+			if (local->id == GH_LOCAL_BUILTIN) {
+				u8 op = (u8) local->offset;
+				gh_type type = plist.data[0];
+				gh_emit_expr(gh_ast_nth(tree, args, 0), &type);
+				emitb(op);
+				goto result;
+			}
+
+			// Arguments are pushed last to first
+			for (u32 i = args.len; i-- > 0;) {
+				gh_type type = plist.data[i];
+				if (gh_is_array_ref(type))
+					gh_emit_array_ref(gh_ast_nth(tree, args, i), &type);
+				else
+					gh_emit_expr(gh_ast_nth(tree, args, i), &type);
+				gh_emit_op_push(&type);
+				popsize += gh_get_type_size(type);
 			}
 
+			local = &syms.locals.data[idx];
 			if (local->id == GH_LOCAL_SYSFUN) {
 				emitb(GH_VM_SYSFUN);
-				emitqw(get_sysfun(local));
+				emitqw((u64) local->offset);
 			} else {
 				emitb(GH_VM_CALL);
 				emitqw((u64) local->offset);
@@ -436,171 +820,382 @@ static void gh_emit_primary(gh_local_list *pl, gh_ast *ast, gh_type *type) {
 				emitb(GH_VM_ADD_SP);
 				emitqw((u64) popsize);
 			}
-			if (clist_copy)
-				free(clist_copy);
+		result:
+			// An integer result is used at a wider width as it is
+			if (gh_is_float(ret) || gh_is_float(*type) || gh_is_vector(*type)
+					|| ret == GH_TOK_KW_STR || *type == GH_TOK_KW_STR)
+				gh_emit_cast(ret, *type);
 		} else {
 			if (local->id != GH_LOCAL_VAR) {
 				gh_log(GH_LOG_ERR, "can only use a variable identifier in an expression");
 				COMPILE_FAIL();
 			}
+			local = gh_get_var(ast->tok, 0);
 			if (*type == GH_TOK_KW_UNIT)
 				*type = local->type;
-
-			switch (local->type) {
-				MULTI_CASE(GH_VM_MOV_OFFSET_A8);
-				default: COMPILE_FAIL();
-			}
-			emitqw((u64) local->offset);
-			gh_emit_cast(local->type, *type);
+			gh_emit_var_load(local->type, local->offset, *type);
 		}
 	} else {
 		COMPILE_FAIL();
 	}
 }
 
-static void gh_emit_unary(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_expr(pl, ast->unary.child, type);
+// Nodes whose emission is pending on an operand, for the iterative walks
+// over chains of unary and binary operators below
+static VEC(u32) spine;
 
-	if (*type == GH_TOK_KW_UNIT) COMPILE_FAIL();
-	if (ast->unary.op->id == GH_TOK_MINUS) {
-		OP_MULTI(GH_VM_SIGN_A8);
-	} else if (ast->unary.op->id == GH_TOK_NEG) {
-		OP_MULTI(GH_VM_NEG_A8);
-	} else if (ast->unary.op->id == GH_TOK_BNEG) {
-		OP_MULTI(GH_VM_BNEG_A8);
-	} else { COMPILE_FAIL(); }
+// A loop-invariant expression, evaluated once before the loop into a
+// temporary, see gh_licm
+typedef struct {
+	gh_node node;
+	gh_type want; // the type it is emitted at, unit to infer it
+	gh_type type; // the type it leaves in register a
+	i64 offset;
+} gh_hoist;
+
+DEFINE_VEC(gh_hoist);
+
+// Of every loop being emitted, innermost last
+static VEC(gh_hoist) hoists;
+
+static gh_hoist *gh_hoisted(gh_node node, gh_type want) {
+	for (u64 i = hoists.used; i-- > 0;) {
+		if (hoists.data[i].node == node && hoists.data[i].want == want)
+			return &hoists.data[i];
+	}
+	return NULL;
 }
 
-static void gh_emit_branchop_prefix(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_expr(pl, ast->branch_op.first, type);
-	gh_emit_op_push(type);
-	gh_emit_expr(pl, ast->branch_op.second, type);
+// All 64 bits are kept, so the value is the same as if it was computed
+static int gh_emit_hoisted(gh_node node, gh_type *type) {
+	gh_hoist *hoist = gh_hoisted(node, *type);
+	if (!hoist)
+		return 0;
+	emitb(GH_VM_MOV_OFFSET_A64);
+	emitqw((u64) hoist->offset);
+	*type = hoist->type;
+	return 1;
 }
 
-static void gh_emit_factor(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branchop_prefix(pl, ast, type);
-	switch (ast->branch_op.op->id) {
-		case GH_TOK_MULT: OP_MULTI(GH_VM_MUL8); break;
-		case GH_TOK_DIV: OP_MULTI(GH_VM_DIV8); break;
-		case GH_TOK_MODULO: OP_MULTI(GH_VM_MOD8); break;
-		default: COMPILE_FAIL();
+static void gh_emit_unary(gh_node node, gh_type *type) {
+	u64 top = spine.used;
+	while (NODE(node)->type == GH_AST_UNARY && !(hoists.used && gh_hoisted(node, *type))) {
+		APPEND_VEC(spine, node);
+		node = NODE(node)->unary.child;
 	}
-}
 
-static void gh_emit_adder(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branchop_prefix(pl, ast, type);
-	switch (ast->branch_op.op->id) {
-		case GH_TOK_PLUS: OP_MULTI(GH_VM_ADD8); break;
-		case GH_TOK_MINUS: OP_MULTI(GH_VM_SUB8); break;
-		default: COMPILE_FAIL();
+	gh_emit_expr(node, type);
+	if (*type == GH_TOK_KW_UNIT) COMPILE_FAIL();
+	while (spine.used > top) {
+		gh_ast *ast = NODE(spine.data[--spine.used]);
+		if (ast->tok.kind == GH_TOK_MINUS) {
+			OP_ARITH(GH_VM_SIGN_A8, GH_VM_FSIGN32);
+		} else if (ast->tok.kind == GH_TOK_NEG) {
+			OP_INT(GH_VM_NEG_A8);
+		} else if (ast->tok.kind == GH_TOK_BNEG) {
+			OP_INT(GH_VM_BNEG_A8);
+		} else { COMPILE_FAIL(); }
 	}
 }
 
-static void gh_emit_shifter(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branchop_prefix(pl, ast, type);
-	switch (ast->branch_op.op->id) {
-		case GH_TOK_LSHIFT: OP_MULTI(GH_VM_LSHIFT8); break;
-		case GH_TOK_RSHIFT: OP_MULTI(GH_VM_RSHIFT8); break;
-		default: COMPILE_FAIL();
+// The lane-wise op for an operator, binary or compound assignment, with
+// the first operand pushed and the second in register v
+static void gh_emit_vector_op(u8 op, gh_type *type) {
+	u8 q = *type == GH_TOK_KW_V2I64;
+	switch (op) {
+		case GH_TOK_PLUS: case GH_TOK_PLUS_ASSIGN: emitb(GH_VM_VADD32 + q); break;
+		case GH_TOK_MINUS: case GH_TOK_MINUS_ASSIGN: emitb(GH_VM_VSUB32 + q); break;
+		case GH_TOK_MULT: case GH_TOK_MULT_ASSIGN: emitb(GH_VM_VMUL32 + q); break;
+		case GH_TOK_BAND: emitb(GH_VM_VAND); break;
+		case GH_TOK_BOR: emitb(GH_VM_VOR); break;
+		case GH_TOK_BXOR: emitb(GH_VM_VXOR); break;
+		case GH_TOK_EQ: emitb(GH_VM_VCMPEQ32 + q); break;
+		case GH_TOK_LT: emitb(GH_VM_VCMPLT32 + q); break;
+		case GH_TOK_GT: emitb(GH_VM_VCMPGT32 + q); break;
+		default:
+			gh_log(GH_LOG_ERR, "operator not supported on vectors");
+			COMPILE_FAIL();
 	}
 }
 
-static void gh_emit_relation(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branchop_prefix(pl, ast, type);
-	OP_MULTI(GH_VM_CMP8);
-	switch (ast->branch_op.op->id) {
-		case GH_TOK_GT: emitb(GH_VM_SETGT); break;
-		case GH_TOK_LT: emitb(GH_VM_SETLT); break;
-		case GH_TOK_GEQ: emitb(GH_VM_SETGE); break;
-		case GH_TOK_LEQ: emitb(GH_VM_SETLE); break;
+// Emits the operator of a binary node, with the first operand on the
+// stack and the second in register a
+static void gh_emit_branch_op(gh_ast *ast, gh_type *type) {
+	if (gh_is_vector(*type)) {
+		gh_emit_vector_op(ast->tok.kind, type);
+		return ;
+	}
+	switch (ast->type) {
+		case GH_AST_BOR:  OP_INT(GH_VM_BOR8);  break;
+		case GH_AST_BXOR: OP_INT(GH_VM_BXOR8); break;
+		case GH_AST_BAND: OP_INT(GH_VM_BAND8); break;
+		case GH_AST_COMPARE: {
+			OP_ARITH(GH_VM_CMP8, GH_VM_FCMP32);
+			switch (ast->tok.kind) {
+				case GH_TOK_EQ: emitb(GH_VM_SETEQ); break;
+				case GH_TOK_NEQ: emitb(GH_VM_SETNEQ); break;
+				default: COMPILE_FAIL();
+			}
+			break;
+		}
+		case GH_AST_RELATION: {
+			OP_ARITH(GH_VM_CMP8, GH_VM_FCMP32);
+			switch (ast->tok.kind) {
+				case GH_TOK_GT: emitb(GH_VM_SETGT); break;
+				case GH_TOK_LT: emitb(GH_VM_SETLT); break;
+				case GH_TOK_GEQ: emitb(GH_VM_SETGE); break;
+				case GH_TOK_LEQ: emitb(GH_VM_SETLE); break;
+				default: COMPILE_FAIL();
+			}
+			break;
+		}
+		case GH_AST_SHIFTER: {
+			switch (ast->tok.kind) {
+				case GH_TOK_LSHIFT: OP_INT(GH_VM_LSHIFT8); break;
+				case GH_TOK_RSHIFT: OP_INT(GH_VM_RSHIFT8); break;
+				default: COMPILE_FAIL();
+			}
+			break;
+		}
+		case GH_AST_ADDER: {
+			switch (ast->tok.kind) {
+				case GH_TOK_PLUS: OP_ARITH(GH_VM_ADD8, GH_VM_FADD32); break;
+				case GH_TOK_MINUS: OP_ARITH(GH_VM_SUB8, GH_VM_FSUB32); break;
+				default: COMPILE_FAIL();
+			}
+			break;
+		}
+		case GH_AST_FACTOR: {
+			switch (ast->tok.kind) {
+				case GH_TOK_MULT: OP_ARITH(GH_VM_MUL8, GH_VM_FMUL32); break;
+				case GH_TOK_DIV: OP_ARITH(GH_VM_DIV8, GH_VM_FDIV32); break;
+				case GH_TOK_MODULO: OP_INT(GH_VM_MOD8); break;
+				default: COMPILE_FAIL();
+			}
+			break;
+		}
 		default: COMPILE_FAIL();
 	}
 }
 
-static void gh_emit_compare(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branchop_prefix(pl, ast, type);
-	OP_MULTI(GH_VM_CMP8);
-	switch (ast->branch_op.op->id) {
-		case GH_TOK_EQ: emitb(GH_VM_SETEQ); break;
-		case GH_TOK_NEQ: emitb(GH_VM_SETNEQ); break;
-		default: COMPILE_FAIL();
+static int gh_is_branch(u8 type) {
+	return type >= GH_AST_OR && type <= GH_AST_FACTOR;
+}
+
+// Jumps to the same target that isn't emitted yet. The list is threaded
+// through their operands: each holds where the previous one's operand
+// is, + 1, and the list is the last one's, + 1, or 0 if it's empty.
+typedef u64 gh_jumps;
+
+static gh_jumps gh_emit_jump(u8 op, gh_jumps list) {
+	emitb(op);
+	u64 pos = bc->bytes.used;
+	emitqw(list);
+	return pos + 1;
+}
+
+// A JZ or a JNZ on register a at the width of the type
+static gh_jumps gh_emit_test(u8 sense, gh_type *type, gh_jumps list) {
+	OP_MULTI(sense ? GH_VM_JNZ8 : GH_VM_JZ8);
+	u64 pos = bc->bytes.used;
+	emitqw(list);
+	return pos + 1;
+}
+
+static void gh_patch_jumps(gh_jumps list, u64 addr) {
+	u64 end = bc->bytes.used;
+	while (list) {
+		bc->bytes.used = list - 1;
+		u64 prev = 0;
+		for (u64 i = 0; i < 8; i++)
+			prev = (prev << 8) | bc->bytes.data[bc->bytes.used + i];
+		emitqw(addr);
+		list = prev;
 	}
+	bc->bytes.used = end;
 }
 
-static void gh_emit_branch_prefix(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_expr(pl, ast->branch.first, type);
-	gh_emit_op_push(type);
-	gh_emit_expr(pl, ast->branch.second, type);
+static int gh_is_logic(gh_node node, gh_type *type) {
+	u8 kind = NODE(node)->type;
+	return (kind == GH_AST_AND || kind == GH_AST_OR)
+		&& !(hoists.used && gh_hoisted(node, *type));
 }
 
-static void gh_emit_band(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branch_prefix(pl, ast, type);
-	OP_MULTI(GH_VM_BAND8);
+// Emits a condition as control flow: a jump, added to list, that is taken
+// when the condition's truth is sense, falling through otherwise. The
+// operands of && and || jump straight to where they decide the result
+// and the rest is skipped, so no 0 or 1 is materialized.
+static gh_jumps gh_emit_jump_if(gh_node node, u8 sense, gh_jumps list, gh_type *type) {
+	if (gh_is_logic(node, type)) {
+		u8 kind = NODE(node)->type;
+		if (sense == (kind == GH_AST_OR)) {
+			// Each operand decides on its own: false for &&, true for ||.
+			// Chains are walked like gh_emit_branch does.
+			u64 top = spine.used;
+			while (NODE(node)->type == kind && gh_is_logic(node, type)) {
+				APPEND_VEC(spine, node);
+				node = NODE(node)->branch.first;
+			}
+			list = gh_emit_jump_if(node, sense, list, type);
+			while (spine.used > top) {
+				gh_ast *ast = NODE(spine.data[--spine.used]);
+				list = gh_emit_jump_if(ast->branch.second, sense, list, type);
+			}
+			return list;
+		}
+
+		gh_ast *ast = NODE(node);
+		gh_jumps skip = gh_emit_jump_if(ast->branch.first, !sense, 0, type);
+		list = gh_emit_jump_if(ast->branch.second, sense, list, type);
+		gh_patch_jumps(skip, bc->bytes.used);
+		return list;
+	}
+
+	gh_ast *ast = NODE(node);
+	if (ast->type == GH_AST_UNARY && ast->tok.kind == GH_TOK_NEG
+			&& !(hoists.used && gh_hoisted(node, *type)))
+		return gh_emit_jump_if(ast->unary.child, !sense, list, type);
+
+	gh_emit_expr(node, type);
+	return gh_emit_test(sense, type, list);
 }
 
-static void gh_emit_bxor(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branch_prefix(pl, ast, type);
-	OP_MULTI(GH_VM_BXOR8);
+// x && y or x || y as a value, with x in register a
+static void gh_emit_logic(gh_ast *ast, gh_type *type) {
+	u8 sense = ast->type == GH_AST_OR; // the truth of x that decides
+	gh_jumps decided = gh_emit_test(sense, type, 0);
+	decided = gh_emit_jump_if(ast->branch.second, sense, decided, type);
+	emitb(GH_VM_MOV_IMM_A8);
+	emitb(!sense);
+	gh_jumps end = gh_emit_jump(GH_VM_JMP, 0);
+	gh_patch_jumps(decided, bc->bytes.used);
+	emitb(GH_VM_MOV_IMM_A8);
+	emitb(sense);
+	gh_patch_jumps(end, bc->bytes.used);
 }
 
-static void gh_emit_bor(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branch_prefix(pl, ast, type);
-	OP_MULTI(GH_VM_BOR8);
+// Binary operators associate to the left, so long chains like a + b + c
+// hang off the first operand. The chain is walked down iteratively and
+// emitted on the way back up, and only second operands recurse.
+static void gh_emit_branch(gh_node node, gh_type *type) {
+	u64 top = spine.used;
+	while (gh_is_branch(NODE(node)->type) && !(hoists.used && gh_hoisted(node, *type))) {
+		APPEND_VEC(spine, node);
+		node = NODE(node)->branch.first;
+	}
+
+	gh_emit_expr(node, type);
+	while (spine.used > top) {
+		gh_ast *ast = NODE(spine.data[--spine.used]);
+		if (ast->type == GH_AST_AND || ast->type == GH_AST_OR) {
+			gh_emit_logic(ast, type);
+			continue;
+		}
+		gh_emit_op_push(type);
+		gh_emit_expr(ast->branch.second, type);
+		gh_emit_branch_op(ast, type);
+	}
 }
 
-static void gh_emit_and(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branch_prefix(pl, ast, type);
-	OP_MULTI(GH_VM_AND8);
+// The operator of a compound assignment, with the old value on the stack
+static void gh_emit_assgn_op(u8 op, gh_type *type) {
+	if (gh_is_vector(*type)) {
+		gh_emit_vector_op(op, type);
+		return ;
+	}
+	switch (op) {
+		case GH_TOK_PLUS_ASSIGN: OP_ARITH(GH_VM_ADD8, GH_VM_FADD32); break;
+		case GH_TOK_MINUS_ASSIGN: OP_ARITH(GH_VM_SUB8, GH_VM_FSUB32); break;
+		case GH_TOK_MULT_ASSIGN: OP_ARITH(GH_VM_MUL8, GH_VM_FMUL32); break;
+		case GH_TOK_DIV_ASSIGN: OP_ARITH(GH_VM_DIV8, GH_VM_FDIV32); break;
+		case GH_TOK_MODULO_ASSIGN: fallthrough(); // todo
+		default: COMPILE_FAIL();
+	}
 }
 
-static void gh_emit_or(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_emit_branch_prefix(pl, ast, type);
-	OP_MULTI(GH_VM_OR8);
+// xs[i] op= e. The index is evaluated first and kept on the stack, and
+// the element is computed and stored at the type of the array.
+static void gh_emit_assgn_element(gh_ast *ast, gh_type *type) {
+	gh_local *local = gh_get_var(ast->tok, 1);
+	gh_type etype;
+	u32 len = gh_var_elems(local, &etype);
+	i64 base = local->offset, offset;
+	if (*type == GH_TOK_KW_UNIT)
+		*type = etype;
+	int indexed = !gh_const_index(ast->assgn.index, etype, base, len, &offset);
+	if (indexed) {
+		gh_emit_index(ast->assgn.index, len);
+		emitb(GH_VM_PUSH64);
+	}
+	gh_type vtype = etype;
+	if (ast->assgn.op != GH_TOK_ASSIGN) {
+		if (indexed) {
+			switch (etype) {
+				MOV_CASE(GH_VM_MOV_INDEX_A8);
+				default: COMPILE_FAIL();
+			}
+			emitqw((u64) base);
+		} else {
+			gh_emit_var_load(etype, offset, etype);
+		}
+		gh_emit_op_push(&vtype);
+		gh_emit_expr(ast->assgn.expr, &vtype);
+		gh_emit_assgn_op(ast->assgn.op, &vtype);
+	} else {
+		gh_emit_expr(ast->assgn.expr, &vtype);
+	}
+	switch (etype) {
+		MOV_CASE(indexed ? GH_VM_MOV_A_INDEX8 : GH_VM_MOV_A_OFFSET8);
+		default: COMPILE_FAIL();
+	}
+	emitqw((u64) (indexed ? base : offset));
+	gh_emit_cast(etype, *type);
 }
 
-static void gh_emit_assgn(gh_local_list *pl, gh_ast *ast, gh_type *type) {
-	gh_local *local = gh_get_req_local(pl, ast->assgn.ident);
+static void gh_emit_assgn(gh_ast *ast, gh_type *type) {
+	if (ast->assgn.index) {
+		gh_emit_assgn_element(ast, type);
+		return ;
+	}
+	gh_local *local = gh_get_var(ast->tok, 0);
 	if (*type == GH_TOK_KW_UNIT)
 		*type = local->type;
-	if (ast->assgn.op->id == GH_TOK_ASSIGN) {
-		gh_emit_expr(pl, ast->assgn.expr, type);
-		OP_MULTI(GH_VM_MOV_A_OFFSET8);
+	if ((gh_is_vector(*type) || gh_is_vector(local->type)) && *type != local->type) {
+		gh_log(GH_LOG_ERR, "a vector can only be assigned as a vector of its type");
+		COMPILE_FAIL();
+	}
+	if (ast->assgn.op == GH_TOK_ASSIGN) {
+		gh_emit_expr(ast->assgn.expr, type);
+		OP_MOV(GH_VM_MOV_A_OFFSET8, GH_VM_VSTORE32);
 		emitqw((u64) local->offset);
 		return ;
 	}
 
-	OP_MULTI(GH_VM_MOV_OFFSET_A8);
+	OP_MOV(GH_VM_MOV_OFFSET_A8, GH_VM_VLOAD32);
 	emitqw((u64) local->offset);
 	gh_emit_op_push(type);
-	gh_emit_expr(pl, ast->assgn.expr, type);
-	switch (ast->assgn.op->id) {
-		case GH_TOK_PLUS_ASSIGN: OP_MULTI(GH_VM_ADD8); break;
-		case GH_TOK_MINUS_ASSIGN: OP_MULTI(GH_VM_SUB8); break;
-		case GH_TOK_MULT_ASSIGN: OP_MULTI(GH_VM_MUL8); break;
-		case GH_TOK_DIV_ASSIGN: OP_MULTI(GH_VM_DIV8); break;
-		case GH_TOK_MODULO_ASSIGN: fallthrough(); // todo
-		default: COMPILE_FAIL();
-	}
-	OP_MULTI(GH_VM_MOV_A_OFFSET8);
+	gh_emit_expr(ast->assgn.expr, type);
+	gh_emit_assgn_op(ast->assgn.op, type);
+	OP_MOV(GH_VM_MOV_A_OFFSET8, GH_VM_VSTORE32);
 	emitqw((u64) local->offset);
 }
 
 // Emits code to evaluate an expression, the result stored in register a.
-static void gh_emit_expr(gh_local_list *pl, gh_ast *ast, gh_type *type) {
+static void gh_emit_expr(gh_node node, gh_type *type) {
+	if (hoists.used && gh_emit_hoisted(node, type))
+		return ;
+	gh_ast *ast = NODE(node);
 	switch (ast->type) {
-		case GH_AST_ASSGN:    gh_emit_assgn(pl, ast, type);    break;
-		case GH_AST_OR:       gh_emit_or(pl, ast, type);       break;
-		case GH_AST_AND:      gh_emit_and(pl, ast, type);      break;
-		case GH_AST_BOR:      gh_emit_bor(pl, ast, type);      break;
-		case GH_AST_BXOR:     gh_emit_bxor(pl, ast, type);     break;
-		case GH_AST_BAND:     gh_emit_band(pl, ast, type);     break;
-		case GH_AST_COMPARE:  gh_emit_compare(pl, ast, type);  break;
-		case GH_AST_RELATION: gh_emit_relation(pl, ast, type); break;
-		case GH_AST_SHIFTER:  gh_emit_shifter(pl, ast, type);  break;
-		case GH_AST_ADDER:    gh_emit_adder(pl, ast, type);    break;
-		case GH_AST_FACTOR:   gh_emit_factor(pl, ast, type);   break;
-		case GH_AST_UNARY:    gh_emit_unary(pl, ast, type);    break;
-		case GH_AST_PRIMARY:  gh_emit_primary(pl, ast, type);  break;
+		case GH_AST_ASSGN:    gh_emit_assgn(ast, type);    break;
+		case GH_AST_OR:       case GH_AST_AND:
+		case GH_AST_BOR:      case GH_AST_BXOR:
+		case GH_AST_BAND:     case GH_AST_COMPARE:
+		case GH_AST_RELATION: case GH_AST_SHIFTER:
+		case GH_AST_ADDER:    case GH_AST_FACTOR:
+			gh_emit_branch(node, type);
+			break;
+		case GH_AST_UNARY:    gh_emit_unary(node, type);    break;
+		case GH_AST_PRIMARY:  gh_emit_primary(ast, type);  break;
 		default: COMPILE_FAIL();
 	}
 }
@@ -643,14 +1238,43 @@ static void gh_emit_expr(gh_local_list *pl, gh_ast *ast, gh_type *type) {
 // mov rsp, rbp  ; leave
 // pop rbp
 //
-static void gh_emit_var(gh_local_list *pl, gh_ast *ast) {
-	gh_type type = ast->var.type->id;
-
-	if (ast->var.expr) {
-		gh_emit_expr(pl, ast->var.expr, &type);
-	} else {
+// An array, which is zeroed too
+static void gh_emit_array(gh_ast *ast) {
+	gh_type type = ast->var.type;
+	i64 size = gh_get_type_size(type) * (i64) ast->var.len;
+	if (!size || gh_is_vector(type)) {
+		gh_log(GH_LOG_ERR, "cannot declare an array of unit or of vectors");
+		COMPILE_FAIL();
+	}
+	i64 offset = gh_calc_offset(size);
+	emitb(GH_VM_MOV_IMM_A64);
+	emitqw((u64) offset);
+	emitb(GH_VM_CLEAR);
+	emitqw((u64) size);
+	gh_add_local(&(const gh_local) {
+		.id = GH_LOCAL_VAR,
+		.name = gh_token_str(toks, ast->tok),
+		.key = ast->tok.payload,
+		.type = type,
+		.len = ast->var.len,
+		.offset = offset,
+	});
+}
+
+static void gh_emit_var(gh_ast *ast) {
+	gh_type type = ast->var.type;
+	if (ast->var.len) {
+		gh_emit_array(ast);
+		return ;
+	}
+
+	if (ast->var.expr) {
+		gh_emit_expr(ast->var.expr, &type);
+	} else {
 		emitb(GH_VM_MOV_IMM_A64);
 		emitqw((u64) 0);
+		if (gh_is_vector(type))
+			emitb(GH_VM_VSPLAT64);
 	}
 
 	i64 typesize = gh_get_type_size(type);
@@ -665,82 +1289,619 @@ static void gh_emit_var(gh_local_list *pl, gh_ast *ast) {
 		case 2: emitb(GH_VM_MOV_A_OFFSET16); break;
 		case 4: emitb(GH_VM_MOV_A_OFFSET32); break;
 		case 8: emitb(GH_VM_MOV_A_OFFSET64); break;
+		case 16: emitb(type == GH_TOK_KW_V2I64 ? GH_VM_VSTORE64 : GH_VM_VSTORE32); break;
 		default: COMPILE_FAIL(); break;
 	}
 	emitqw((u64) offset);
-	gh_add_local(pl, &(const gh_local) {
+	gh_add_local(&(const gh_local) {
 		.id = GH_LOCAL_VAR,
-		.name = ast->var.ident->info.str,
+		.name = gh_token_str(toks, ast->tok),
+		.key = ast->tok.payload,
 		.type = type,
 		.offset = offset,
 	});
 }
 
-static void gh_emit_statement(gh_local_list *pl, gh_ast *ast);
+static void gh_emit_statements(gh_list list);
 
-static void gh_emit_block(gh_local_list *pl, gh_ast *ast) {
-	gh_local_list nlist;
-	gh_init_local_list(&nlist, pl);
-	gh_emit_statement(&nlist, ast);
+static void gh_emit_block(gh_list list) {
+	gh_enter_scope();
+	gh_emit_statements(list);
+	gh_leave_scope();
 }
 
-static void gh_emit_if(gh_local_list *pl, gh_ast *ast) {
-	gh_type _type = GH_TOK_KW_UNIT;
-	gh_type *type = &_type;
-	u8 has_expr = 0;
-	if (ast->ifexpr.expr) {
-		gh_emit_expr(pl, ast->ifexpr.expr, type);
-		OP_MULTI(GH_VM_JZ8);
-		has_expr = 1;
-	}
-	u64 iszero = bc->bytes.used;
-	if (has_expr)
-		emitqw(0);
+static void gh_emit_if(gh_ast *ast) {
+	gh_type type = GH_TOK_KW_UNIT;
+	gh_jumps other = 0;
+	if (ast->ifexpr.expr)
+		other = gh_emit_jump_if(ast->ifexpr.expr, 0, 0, &type);
 
-	gh_emit_block(pl, ast->ifexpr.statement);
-	emitb(GH_VM_JMP);
-	u64 jmp_cont = bc->bytes.used;
-	emitqw(0);
+	gh_emit_block(ast->ifexpr.block);
+	gh_jumps cont = gh_emit_jump(GH_VM_JMP, 0);
 
-	u64 zero_addr = bc->bytes.used;
+	gh_patch_jumps(other, bc->bytes.used);
 	if (ast->ifexpr.endif)
-		gh_emit_if(pl, ast->ifexpr.endif);
+		gh_emit_if(NODE(ast->ifexpr.endif));
+	gh_patch_jumps(cont, bc->bytes.used);
+}
 
-	u64 end = bc->bytes.used;
-	if (has_expr) {
-		bc->bytes.used = iszero;
-		emitqw(zero_addr);
+// A constant arm of a match. The key is the constant's bits at the width
+// of the matched type, sign-extended, which is the order CMP sees.
+typedef struct {
+	i64 key;
+	u32 arm;
+} gh_case;
+
+DEFINE_VEC(gh_case);
+
+static VEC(gh_case) match_cases;
+static VEC(u64) match_arms; // jumps to each arm, of every match being emitted
+
+#define GH_MATCH_MIN_CASES 4    // fewer constants are compared in turn
+#define GH_MATCH_MAX_TABLE 1024 // entries in a jump table, at least half used
+
+static int gh_match_const(gh_node node, gh_type type, i64 *key) {
+	gh_ast *ast = NODE(node);
+	u8 neg = 0;
+	if (ast->type == GH_AST_UNARY && ast->tok.kind == GH_TOK_MINUS) {
+		neg = 1;
+		ast = NODE(ast->unary.child);
 	}
+	if (ast->type != GH_AST_PRIMARY || ast->tok.kind != GH_TOK_LIT_INT)
+		return 0;
+	i64 size = gh_get_type_size(type);
+	if (!size)
+		return 0;
+	u64 v = gh_token_int(toks, ast->tok);
+	u32 shift = 64 - 8 * (u32) size;
+	*key = (i64) ((neg ? -v : v) << shift) >> shift;
+	return 1;
+}
 
-	bc->bytes.used = jmp_cont;
-	emitqw(end);
-	bc->bytes.used = end;
+static int gh_case_cmp(const void *a, const void *b) {
+	const gh_case *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->arm < y->arm ? -1 : x->arm > y->arm;
+}
+
+static void gh_emit_imm(gh_type *type, u64 v) {
+	switch (gh_get_type_size(*type)) {
+		case 1: emitb(GH_VM_MOV_IMM_A8); emitb((u8) v); break;
+		case 2: emitb(GH_VM_MOV_IMM_A16); emitw((u16) v); break;
+		case 4: emitb(GH_VM_MOV_IMM_A32); emitdw((u32) v); break;
+		case 8: emitb(GH_VM_MOV_IMM_A64); emitqw(v); break;
+		default: COMPILE_FAIL();
+	}
+}
+
+static void gh_emit_load(gh_type *type, i64 offset) {
+	OP_MULTI(GH_VM_MOV_OFFSET_A8);
+	emitqw((u64) offset);
+}
+
+// Compares x with each case in turn. Each compare subtracts the difference
+// from the previous constant, so x is only loaded once.
+static void gh_emit_cases_linear(const gh_case *c, u64 n, gh_type *type, i64 slot, u64 base) {
+	gh_emit_load(type, slot);
+	u64 prev = 0;
+	for (u64 i = 0; i < n; i++) {
+		u64 d = (u64) c[i].key - prev;
+		if (d) {
+			gh_emit_op_push(type);
+			gh_emit_imm(type, d);
+			OP_MULTI(GH_VM_SUB8);
+		}
+		u64 *arm = &match_arms.data[base + c[i].arm];
+		*arm = gh_emit_test(0, type, *arm);
+		prev = (u64) c[i].key;
+	}
+}
+
+// x - lo indexes the table, and anything out of range wraps around to
+// above it. The gaps jump to miss.
+static gh_jumps gh_emit_cases_table(const gh_case *c, u64 n, gh_type *type,
+		i64 slot, u64 base, gh_jumps miss) {
+	u64 lo = (u64) c[0].key;
+	u64 span = (u64) c[n - 1].key - lo + 1;
+	gh_emit_load(type, slot);
+	if (lo) {
+		gh_emit_op_push(type);
+		gh_emit_imm(type, lo);
+		OP_MULTI(GH_VM_SUB8);
+	}
+	OP_MULTI(GH_VM_JTAB8);
+	emitqw(span);
+	for (u64 k = 0, i = 0; k < span; k++) {
+		if ((u64) c[i].key - lo == k) {
+			u64 *arm = &match_arms.data[base + c[i++].arm];
+			*arm = gh_emit_jump(GH_VM_JMP, *arm);
+		} else {
+			miss = gh_emit_jump(GH_VM_JMP, miss);
+		}
+	}
+	return miss;
+}
+
+// Dispatches on x over sorted, distinct cases. Falls through if none is
+// equal, or takes one of the jumps added to miss.
+static gh_jumps gh_emit_cases(const gh_case *c, u64 n, gh_type *type,
+		i64 slot, u64 base, gh_jumps miss) {
+	if (n < GH_MATCH_MIN_CASES) {
+		gh_emit_cases_linear(c, n, type, slot, base);
+		return miss;
+	}
+	u64 span = (u64) c[n - 1].key - (u64) c[0].key;
+	if (span < GH_MATCH_MAX_TABLE && span < 2 * n)
+		return gh_emit_cases_table(c, n, type, slot, base, miss);
+
+	u64 mid = n / 2;
+	gh_emit_load(type, slot);
+	gh_emit_op_push(type);
+	gh_emit_imm(type, (u64) c[mid].key);
+	OP_MULTI(GH_VM_CMP8);
+	emitb(GH_VM_SETLT);
+	gh_jumps lower = gh_emit_test(1, type, 0);
+	miss = gh_emit_cases(c + mid, n - mid, type, slot, base, miss);
+	miss = gh_emit_jump(GH_VM_JMP, miss);
+	gh_patch_jumps(lower, bc->bytes.used);
+	return gh_emit_cases(c, mid, type, slot, base, miss);
+}
+
+// match x begin ... end runs the first arm whose expression equals x, or
+// the else arm if none does. Runs of constant arms are dispatched on all
+// at once: dense ones through a JTAB, sparse ones by binary search over
+// the sorted constants. Other arms are compared on their own in between,
+// so an earlier arm still wins. Without x, each arm is a condition and
+// they are tested in order, like else if.
+static void gh_emit_match(gh_ast *ast) {
+	gh_list arms = ast->match.arms;
+	if (!arms.len)
+		return ;
+	u64 base = match_arms.used;
+	for (u32 i = 0; i < arms.len; i++)
+		APPEND_VEC(match_arms, 0);
+
+	gh_type match_type = GH_TOK_KW_UNIT, *type = &match_type;
+	i64 frame = offset_counter, slot = 0;
+	if (ast->match.expr) {
+		gh_emit_expr(ast->match.expr, type);
+		if (*type == GH_TOK_KW_F32 || *type == GH_TOK_KW_F64 || *type == GH_TOK_KW_UNIT) {
+			gh_log(GH_LOG_ERR, "can only match on an integer");
+			COMPILE_FAIL();
+		}
+		slot = gh_calc_offset(gh_get_type_size(*type));
+		OP_MULTI(GH_VM_MOV_A_OFFSET8);
+		emitqw((u64) slot);
+	}
+
+	gh_ast *last = NODE(gh_ast_nth(tree, arms, arms.len - 1));
+	u32 n = last->mselect.expr ? arms.len : arms.len - 1;
+	for (u32 i = 0; i < n;) {
+		gh_node expr = NODE(gh_ast_nth(tree, arms, i))->mselect.expr;
+		gh_jumps jumps;
+		i64 key;
+		if (!ast->match.expr) {
+			gh_type cond = GH_TOK_KW_UNIT;
+			jumps = gh_emit_jump_if(expr, 1, 0, &cond);
+			match_arms.data[base + i++] = jumps;
+			continue;
+		}
+		if (!gh_match_const(expr, *type, &key)) {
+			gh_type arm_type = *type;
+			gh_emit_load(type, slot);
+			gh_emit_op_push(type);
+			gh_emit_expr(expr, &arm_type);
+			OP_MULTI(GH_VM_SUB8);
+			jumps = gh_emit_test(0, type, 0);
+			match_arms.data[base + i++] = jumps;
+			continue;
+		}
+
+		u64 top = match_cases.used;
+		for (; i < n; i++) {
+			expr = NODE(gh_ast_nth(tree, arms, i))->mselect.expr;
+			if (!gh_match_const(expr, *type, &key))
+				break;
+			APPEND_VEC(match_cases, ((gh_case) {.key = key, .arm = i}));
+		}
+		gh_case *c = &match_cases.data[top];
+		u64 ncases = 0;
+		qsort(c, match_cases.used - top, sizeof(gh_case), gh_case_cmp);
+		for (u64 k = 0; k < match_cases.used - top; k++) {
+			if (!ncases || c[k].key != c[ncases - 1].key)
+				c[ncases++] = c[k];
+		}
+		gh_jumps miss = gh_emit_cases(c, ncases, type, slot, base, 0);
+		gh_patch_jumps(miss, bc->bytes.used);
+		match_cases.used = top;
+	}
+
+	offset_counter = frame; // x is only read by the dispatch
+	if (n < arms.len)
+		gh_emit_block(last->mselect.block);
+	gh_jumps end = gh_emit_jump(GH_VM_JMP, 0);
+	for (u32 i = 0; i < n; i++) {
+		gh_patch_jumps(match_arms.data[base + i], bc->bytes.used);
+		gh_emit_block(NODE(gh_ast_nth(tree, arms, i))->mselect.block);
+		end = gh_emit_jump(GH_VM_JMP, end);
+	}
+	gh_patch_jumps(end, bc->bytes.used);
+	match_arms.used = base;
+}
+
+// Loop-invariant code motion. Before a loop is emitted, its condition
+// and body are walked twice in the scopes they will be emitted in: first
+// to find the locals the loop assigns, then to find the largest pure
+// subexpressions that read none of them and can't trap. Those are
+// evaluated once before the loop and read back wherever they appear.
+// An expression's code depends on the type it is emitted at, so the
+// walks pass types down the same way gh_emit_expr does.
+#define GH_LICM_MAX_HOISTS 16
+#define GH_LICM_MAX_DEPTH 256
+
+static struct {
+	VEC(u64) writes; // locals assigned in the loop
+	u64 locals;      // syms.locals.used at the loop, later ones are its own
+	u64 hoists;      // hoists.used at the loop
+	u32 depth;
+	u8 pass;         // 0 finds the writes, 1 hoists
+	u8 failed;
+} licm;
+
+static void gh_licm_hoist(gh_node node, gh_type want, gh_type type) {
+	u8 kind = NODE(node)->type;
+	if (licm.pass != 1 || (!gh_is_branch(kind) && kind != GH_AST_UNARY))
+		return ;
+	// The temporary holds register a
+	if (gh_is_vector(type))
+		return ;
+	if (hoists.used - licm.hoists >= GH_LICM_MAX_HOISTS || gh_hoisted(node, want))
+		return ;
+	gh_hoist hoist = {
+		.node = node,
+		.want = want,
+		.type = type,
+	};
+	APPEND_VEC(hoists, hoist);
+}
+
+static int gh_licm_expr(gh_node node, gh_type *type);
+
+// Division by it can't trap
+static int gh_is_nonzero_lit(gh_node node) {
+	gh_ast *ast = NODE(node);
+	return ast->type == GH_AST_PRIMARY && ast->tok.kind == GH_TOK_LIT_INT
+		&& gh_token_int(toks, ast->tok);
+}
+
+// Hoists an expression if it is invariant as a whole
+static void gh_licm_root(gh_node node, gh_type want) {
+	gh_type type = want;
+	if (gh_licm_expr(node, &type))
+		gh_licm_hoist(node, want, type);
+}
+
+static int gh_licm_primary(gh_ast *ast, gh_type *type) {
+	if (ast->tok.kind == GH_TOK_LIT_STRING) {
+		if (*type == GH_TOK_KW_UNIT)
+			*type = GH_TOK_KW_STR;
+		return 1;
+	}
+	if (ast->tok.kind == GH_TOK_LIT_INT || ast->tok.kind == GH_TOK_LIT_FLOAT) {
+		if (*type == GH_TOK_KW_UNIT)
+			*type = ast->tok.kind == GH_TOK_LIT_INT ? GH_TOK_KW_I32 : GH_TOK_KW_F32;
+		return 1;
+	}
+
+	gh_local *local = gh_find_local(ast->tok.payload);
+	if (!local) {
+		licm.failed = 1;
+		return 0;
+	}
+	if (ast->primary.index) {
+		// The read can fail its bounds check, so only the index moves
+		if (*type == GH_TOK_KW_UNIT)
+			(void) gh_var_elems(local, type);
+		gh_licm_root(ast->primary.index, GH_TOK_KW_I64);
+		return 0;
+	}
+	if (*type == GH_TOK_KW_UNIT)
+		*type = local->type;
+	if (!ast->primary.call) {
+		u64 idx = local - syms.locals.data;
+		if (local->id != GH_LOCAL_VAR || idx >= licm.locals)
+			return 0;
+		for (u64 i = 0; i < licm.writes.used; i++) {
+			if (licm.writes.data[i] == idx)
+				return 0;
+		}
+		return 1;
+	}
+
+	gh_list args = ast->primary.args;
+	if (local->id == GH_LOCAL_VAR || local->param_types.used != args.len) {
+		licm.failed = 1;
+		return 0;
+	}
+	const gh_type *ptypes = local->param_types.data;
+	for (u32 i = args.len; i-- > 0;) {
+		if (!gh_is_array_ref(ptypes[i]))
+			gh_licm_root(gh_ast_nth(tree, args, i), ptypes[i]);
+	}
+	return 0;
+}
+
+// Returns whether the expression is invariant in the loop
+static int gh_licm_expr(gh_node node, gh_type *type) {
+	gh_hoist *hoist = hoists.used ? gh_hoisted(node, *type) : NULL;
+	if (hoist) {
+		*type = hoist->type;
+		return 1;
+	}
+	if (licm.depth >= GH_LICM_MAX_DEPTH) {
+		licm.failed = 1;
+		return 0;
+	}
+
+	licm.depth++;
+	int invariant = 0;
+	gh_ast *ast = NODE(node);
+	switch (ast->type) {
+		case GH_AST_ASSGN: {
+			gh_local *local = gh_find_local(ast->tok.payload);
+			if (!local || local->id != GH_LOCAL_VAR) {
+				licm.failed = 1;
+				break;
+			}
+			if (licm.pass == 0)
+				APPEND_VEC(licm.writes, (u64) (local - syms.locals.data));
+			if (ast->assgn.index) {
+				gh_type etype;
+				(void) gh_var_elems(local, &etype);
+				if (*type == GH_TOK_KW_UNIT)
+					*type = etype;
+				gh_licm_root(ast->assgn.index, GH_TOK_KW_I64);
+				gh_licm_root(ast->assgn.expr, etype);
+				break;
+			}
+			if (*type == GH_TOK_KW_UNIT)
+				*type = local->type;
+			gh_licm_root(ast->assgn.expr, *type);
+			break;
+		}
+		case GH_AST_UNARY:
+			invariant = gh_licm_expr(ast->unary.child, type);
+			break;
+		case GH_AST_PRIMARY:
+			invariant = gh_licm_primary(ast, type);
+			break;
+		default: {
+			if (!gh_is_branch(ast->type)) {
+				licm.failed = 1;
+				break;
+			}
+			gh_type want = *type;
+			int first = gh_licm_expr(ast->branch.first, type);
+			gh_type mid = *type;
+			int second = gh_licm_expr(ast->branch.second, type);
+			int traps = ast->type == GH_AST_FACTOR
+				&& (ast->tok.kind == GH_TOK_DIV || ast->tok.kind == GH_TOK_MODULO)
+				&& !gh_is_nonzero_lit(ast->branch.second);
+			invariant = first && second && !traps;
+			if (!invariant && first)
+				gh_licm_hoist(ast->branch.first, want, mid);
+			if (!invariant && second)
+				gh_licm_hoist(ast->branch.second, mid, *type);
+			break;
+		}
+	}
+	licm.depth--;
+	return invariant;
+}
+
+static void gh_licm_statements(gh_list list);
+
+static void gh_licm_block(gh_list list) {
+	gh_enter_scope();
+	gh_licm_statements(list);
+	gh_leave_scope();
+}
+
+static void gh_licm_statement(gh_node node) {
+	gh_ast *ast = NODE(node);
+	switch (ast->type) {
+		case GH_AST_VAR:
+			if (ast->var.expr)
+				gh_licm_root(ast->var.expr, ast->var.type);
+			gh_add_local(&(const gh_local) {
+				.id = GH_LOCAL_VAR,
+				.name = gh_token_str(toks, ast->tok),
+				.key = ast->tok.payload,
+				.type = ast->var.type,
+				.len = ast->var.len,
+			});
+			break;
+		case GH_AST_IF:
+			for (;;) {
+				if (ast->ifexpr.expr)
+					gh_licm_root(ast->ifexpr.expr, GH_TOK_KW_UNIT);
+				gh_licm_block(ast->ifexpr.block);
+				if (!ast->ifexpr.endif)
+					break;
+				ast = NODE(ast->ifexpr.endif);
+			}
+			break;
+		case GH_AST_MATCH: {
+			// Arms are compared at the type of x, and constant ones are
+			// never evaluated
+			gh_type type = GH_TOK_KW_UNIT;
+			i64 key;
+			if (ast->match.expr && gh_licm_expr(ast->match.expr, &type))
+				gh_licm_hoist(ast->match.expr, GH_TOK_KW_UNIT, type);
+			for (u32 i = 0; i < ast->match.arms.len && !licm.failed; i++) {
+				gh_ast *arm = NODE(gh_ast_nth(tree, ast->match.arms, i));
+				if (arm->mselect.expr && !(ast->match.expr
+						&& gh_match_const(arm->mselect.expr, type, &key)))
+					gh_licm_root(arm->mselect.expr, type);
+				gh_licm_block(arm->mselect.block);
+			}
+			break;
+		}
+		case GH_AST_WHILE:
+			gh_licm_root(ast->whileexpr.expr, GH_TOK_KW_UNIT);
+			gh_licm_block(ast->whileexpr.block);
+			break;
+		case GH_AST_RETURN:
+			if (ast->returnexpr.expr)
+				gh_licm_root(ast->returnexpr.expr, GH_TOK_KW_UNIT);
+			break;
+		case GH_AST_BLOCK: gh_licm_block(ast->block.block); break;
+		default: gh_licm_root(node, GH_TOK_KW_UNIT); break;
+	}
+}
+
+static void gh_licm_statements(gh_list list) {
+	for (u32 i = 0; i < list.len && !licm.failed; i++)
+		gh_licm_statement(gh_ast_nth(tree, list, i));
+}
+
+// Emits the loop's preheader: its invariant expressions, each into an
+// 8-byte temporary so the raw bits in register a are kept
+static void gh_licm(gh_ast *ast) {
+	licm.locals = syms.locals.used;
+	licm.hoists = hoists.used;
+	licm.writes.used = 0;
+	licm.failed = 0;
+	for (licm.pass = 0; licm.pass < 2 && !licm.failed; licm.pass++) {
+		licm.depth = 0;
+		gh_licm_root(ast->whileexpr.expr, GH_TOK_KW_UNIT);
+		gh_licm_block(ast->whileexpr.block);
+	}
+	if (licm.failed) {
+		hoists.used = licm.hoists;
+		return ;
+	}
+
+	// The walks open and close scopes, which give their slots back
+	u64 nhoists = hoists.used;
+	for (u64 i = licm.hoists; i < nhoists; i++)
+		hoists.data[i].offset = gh_calc_offset(8);
+	for (u64 i = licm.hoists; i < nhoists; i++) {
+		gh_hoist hoist = hoists.data[i];
+		gh_type type = hoist.want;
+		hoists.used = i;
+		gh_emit_expr(hoist.node, &type);
+		emitb(GH_VM_MOV_A_OFFSET64);
+		emitqw((u64) hoist.offset);
+	}
+	hoists.used = nhoists;
 }
 
-static void gh_emit_while(gh_local_list *pl, gh_ast *ast) {
-	gh_type _type = GH_TOK_KW_UNIT;
-	gh_type *type = &_type;
+static void gh_emit_while(gh_ast *ast) {
+	gh_type type = GH_TOK_KW_UNIT;
+	u64 outer = hoists.used;
+	gh_licm(ast);
 	u64 top = bc->bytes.used;
-	gh_emit_expr(pl, ast->whileexpr.expr, type);
-	OP_MULTI(GH_VM_JZ8);
-	u64 iszero = bc->bytes.used;
-	emitqw(0);
+	gh_jumps end = gh_emit_jump_if(ast->whileexpr.expr, 0, 0, &type);
 
-	gh_emit_block(pl, ast->whileexpr.block);
+	gh_emit_block(ast->whileexpr.block);
 	emitb(GH_VM_JMP);
 	emitqw(top);
 
-	u64 end = bc->bytes.used;
-	bc->bytes.used = iszero;
-	emitqw(end);
-	bc->bytes.used = end;
+	gh_patch_jumps(end, bc->bytes.used);
+	hoists.used = outer;
 }
 
 static gh_type fun_ret_type;
-static void gh_emit_return(gh_local_list *pl, gh_ast *ast) {
+static i64 fun_param_size; // bytes of arguments the function takes
+static VEC(u64) inline_exits; // jumps to the end of the bodies being inlined
+static u32 inline_depth;
+
+// An argument that is the parameter it would overwrite
+static int gh_tail_unchanged(gh_node node, gh_type ptype, i64 param) {
+	gh_ast *arg = NODE(node);
+	if (arg->type != GH_AST_PRIMARY || arg->tok.kind != GH_TOK_IDENT || arg->primary.call)
+		return 0;
+	gh_local *var = gh_find_local(arg->tok.payload);
+	return var && var->id == GH_LOCAL_VAR && var->offset == param
+		&& gh_get_type_size(var->type) == gh_get_type_size(ptype)
+		&& gh_is_float(var->type) == gh_is_float(ptype);
+}
+
+// return f(...), where f takes as many bytes of arguments as the function
+// being emitted and returns an integer or a float like it does, at the same
+// width, reuses the frame: the new arguments overwrite the current ones and
+// f is jumped to, leaving the return address as it is. Every argument is
+// evaluated before any parameter is written, into a temporary but for the
+// last one.
+static int gh_emit_tail_call(gh_ast *call) {
+	if (inline_depth || fun_ret_type == GH_TOK_KW_UNIT
+			|| call->type != GH_AST_PRIMARY || !call->primary.call)
+		return 0;
+	gh_local *local = gh_find_local(call->tok.payload);
+	if (!local || local->id != GH_LOCAL_FUN || local->inline_size
+			|| gh_get_type_size(local->type) != gh_get_type_size(fun_ret_type)
+			|| gh_is_float(local->type) != gh_is_float(fun_ret_type)
+			|| local->param_types.used != call->primary.args.len)
+		return 0;
+	i64 size = 0;
+	LOOP_VEC(local->param_types, ptype, {
+		size += gh_get_type_size(*ptype);
+	});
+	if (size != fun_param_size)
+		return 0;
+
+	// Emitting the arguments may add locals, which moves the stack
+	u64 idx = local - syms.locals.data;
+	gh_list args = call->primary.args;
+	i64 frame = offset_counter;
+	i64 temps = gh_calc_offset(size);
+
+	i64 param = 16 + size, temp = temps; // skip base pointer and instruction pointer
+	for (u32 i = args.len; i-- > 0;) {
+		gh_type ptype = syms.locals.data[idx].param_types.data[i];
+		gh_node arg = gh_ast_nth(tree, args, i);
+		param -= gh_get_type_size(ptype);
+		if (!gh_tail_unchanged(arg, ptype, param)) {
+			gh_emit_expr(arg, &ptype);
+			gh_emit_store(ptype, i ? temp : param);
+		}
+		temp += gh_get_type_size(ptype);
+	}
+
+	local = &syms.locals.data[idx];
+	param = 16 + size;
+	temp = temps;
+	for (u32 i = args.len; i-- > 1;) {
+		gh_type ptype = local->param_types.data[i];
+		param -= gh_get_type_size(ptype);
+		if (!gh_tail_unchanged(gh_ast_nth(tree, args, i), ptype, param)) {
+			gh_emit_load(&ptype, temp);
+			gh_emit_store(ptype, param);
+		}
+		temp += gh_get_type_size(ptype);
+	}
+	// A call to itself keeps the frame as it is, past ENTER and ADD_SP
+	if (local->offset == (i64) LAST_VEC(bc->funs)->offset) {
+		emitb(GH_VM_JMP);
+		emitqw((u64) local->offset + 2 + gh_vm_operand_size(GH_VM_ADD_SP));
+	} else {
+		emitb(GH_VM_LEAVE);
+		emitb(GH_VM_JMP);
+		emitqw((u64) local->offset);
+	}
+	offset_counter = frame;
+	bc->ntail++;
+	return 1;
+}
+
+static void gh_emit_return(gh_ast *ast) {
+	if (ast->returnexpr.expr && gh_emit_tail_call(NODE(ast->returnexpr.expr)))
+		return ;
 	if (ast->returnexpr.expr) {
 		gh_type type = GH_TOK_KW_UNIT;
-		gh_emit_expr(pl, ast->returnexpr.expr, &type);
+		gh_emit_expr(ast->returnexpr.expr, &type);
 		if (fun_ret_type == GH_TOK_KW_UNIT) {
 			gh_log(GH_LOG_ERR, "returning an expression in a function returning unit");
 			COMPILE_FAIL();
@@ -748,29 +1909,252 @@ static void gh_emit_return(gh_local_list *pl, gh_ast *ast) {
 			gh_emit_cast(type, fun_ret_type);
 		}
 	}
+	if (inline_depth) {
+		emitb(GH_VM_JMP);
+		APPEND_VEC(inline_exits, bc->bytes.used);
+		emitqw(0);
+		return ;
+	}
 	emitb(GH_VM_LEAVE);
 	emitb(GH_VM_RET);
 }
 
-static void gh_emit_statement(gh_local_list *pl, gh_ast *ast) {
-	while (ast) {
-		gh_ast *child = ast->statement.child;
-		switch (child->type) {
-			case GH_AST_VAR: gh_emit_var(pl, child); break;
-			case GH_AST_IF:  gh_emit_if(pl, child); break;
-			case GH_AST_MATCH: break;
-			case GH_AST_WHILE: gh_emit_while(pl, child); break;
-			case GH_AST_RETURN: gh_emit_return(pl, child); break;
-			case GH_AST_STATEMENT: gh_emit_block(pl, child); break;
-			default: gh_emit_expr(pl, child, &(gh_type){GH_TOK_KW_UNIT}); break;
+static void gh_emit_statement(gh_node node) {
+	gh_ast *child = NODE(node);
+	switch (child->type) {
+		case GH_AST_VAR: gh_emit_var(child); break;
+		case GH_AST_IF:  gh_emit_if(child); break;
+		case GH_AST_MATCH: gh_emit_match(child); break;
+		case GH_AST_WHILE: gh_emit_while(child); break;
+		case GH_AST_RETURN: gh_emit_return(child); break;
+		case GH_AST_BLOCK: gh_emit_block(child->block.block); break;
+		default: gh_emit_expr(node, &(gh_type){GH_TOK_KW_UNIT}); break;
+	}
+}
+
+static void gh_emit_statements(gh_list list) {
+	for (u32 i = 0; i < list.len; i++)
+		gh_emit_statement(gh_ast_nth(tree, list, i));
+}
+
+// The largest body, in nodes, that calls are replaced with
+#define GH_INLINE_BUDGET 32
+
+// Adds the size of a subtree to *cost, counting calls to functions that
+// are themselves inlined at their expanded size. Returns -1 once the
+// budget is exceeded, or if the function calls itself.
+static int gh_inline_cost(gh_node node, u32 self, u32 *cost);
+
+static int gh_inline_cost_list(gh_list list, u32 self, u32 *cost) {
+	for (u32 i = 0; i < list.len; i++) {
+		if (gh_inline_cost(gh_ast_nth(tree, list, i), self, cost))
+			return -1;
+	}
+	return 0;
+}
+
+static int gh_inline_cost(gh_node node, u32 self, u32 *cost) {
+	if (!node)
+		return 0;
+	if (++*cost > GH_INLINE_BUDGET)
+		return -1;
+
+	gh_ast *ast = NODE(node);
+	switch (ast->type) {
+		case GH_AST_VAR: return gh_inline_cost(ast->var.expr, self, cost);
+		case GH_AST_BLOCK: return gh_inline_cost_list(ast->block.block, self, cost);
+		case GH_AST_IF:
+			if (gh_inline_cost(ast->ifexpr.expr, self, cost)
+				|| gh_inline_cost_list(ast->ifexpr.block, self, cost))
+				return -1;
+			return gh_inline_cost(ast->ifexpr.endif, self, cost);
+		case GH_AST_MATCH:
+			if (gh_inline_cost(ast->match.expr, self, cost))
+				return -1;
+			return gh_inline_cost_list(ast->match.arms, self, cost);
+		case GH_AST_MSELECT:
+			if (gh_inline_cost(ast->mselect.expr, self, cost))
+				return -1;
+			return gh_inline_cost_list(ast->mselect.block, self, cost);
+		case GH_AST_WHILE:
+			if (gh_inline_cost(ast->whileexpr.expr, self, cost))
+				return -1;
+			return gh_inline_cost_list(ast->whileexpr.block, self, cost);
+		case GH_AST_RETURN: return gh_inline_cost(ast->returnexpr.expr, self, cost);
+		case GH_AST_ASSGN:
+			if (gh_inline_cost(ast->assgn.index, self, cost))
+				return -1;
+			return gh_inline_cost(ast->assgn.expr, self, cost);
+		case GH_AST_UNARY: return gh_inline_cost(ast->unary.child, self, cost);
+		case GH_AST_PRIMARY: {
+			if (!ast->primary.call)
+				return gh_inline_cost(ast->primary.index, self, cost);
+			if (ast->tok.payload == self)
+				return -1;
+			gh_local *callee = gh_find_local(ast->tok.payload);
+			if (callee && callee->inline_size)
+				*cost += callee->inline_size;
+			return gh_inline_cost_list(ast->primary.args, self, cost);
 		}
-		ast = ast->statement.statement;
+		default:
+			if (!gh_is_branch(ast->type))
+				return -1;
+			if (gh_inline_cost(ast->branch.first, self, cost))
+				return -1;
+			return gh_inline_cost(ast->branch.second, self, cost);
+	}
+}
+
+// The callee was compiled seeing only the globals and its own locals, so
+// the caller's locals are unbound while its body is emitted in their place
+static void gh_hide_locals(u64 start) {
+	for (u64 i = syms.locals.used; i-- > start;)
+		syms.heads[syms.locals.data[i].key] = syms.locals.data[i].shadow;
+}
+
+static void gh_show_locals(u64 start) {
+	for (u64 i = start; i < syms.locals.used; i++)
+		syms.heads[syms.locals.data[i].key] = (u32) i + 1;
+}
+
+static void gh_emit_store(gh_type type, i64 offset) {
+	switch (gh_get_type_size(type)) {
+		case 1: emitb(GH_VM_MOV_A_OFFSET8); break;
+		case 2: emitb(GH_VM_MOV_A_OFFSET16); break;
+		case 4: emitb(GH_VM_MOV_A_OFFSET32); break;
+		case 8: emitb(GH_VM_MOV_A_OFFSET64); break;
+		default: COMPILE_FAIL(); break;
+	}
+	emitqw((u64) offset);
+}
+
+// Emits the body of a small function in place of a call to it. The
+// parameters become locals in fresh slots of the caller's frame, which
+// the arguments are stored to last to first, like they would be pushed,
+// and every return jumps to the end with the value in register a.
+static void gh_emit_inline(gh_ast *call, u64 callee) {
+	gh_ast *fun = NODE(syms.locals.data[callee].node);
+	gh_type ret_type = syms.locals.data[callee].type;
+	const gh_type *ptypes = syms.locals.data[callee].param_types.data;
+	gh_list args = call->primary.args;
+	gh_list params = fun->fun.params;
+
+	i64 frame = offset_counter, base = frame;
+	for (u32 i = 0; i < params.len; i++)
+		(void) gh_calc_offset(gh_get_type_size(ptypes[i]));
+	i64 slot = offset_counter;
+	for (u32 i = args.len; i-- > 0;) {
+		gh_type type = ptypes[i];
+		gh_emit_expr(gh_ast_nth(tree, args, i), &type);
+		gh_emit_store(type, slot);
+		slot += gh_get_type_size(ptypes[i]);
+	}
+
+	u64 caller = syms.scopes.data[1];
+	gh_hide_locals(caller);
+	gh_enter_scope();
+	for (u32 i = 0; i < params.len; i++) {
+		gh_ast *param = NODE(gh_ast_nth(tree, params, i));
+		base -= gh_get_type_size(ptypes[i]);
+		gh_add_local(&(const gh_local) {
+			.id = GH_LOCAL_VAR,
+			.name = gh_token_str(toks, param->tok),
+			.key = param->tok.payload,
+			.type = ptypes[i],
+			.offset = base,
+		});
+	}
+
+	gh_type saved_ret = fun_ret_type;
+	u64 exits = inline_exits.used;
+	fun_ret_type = ret_type;
+	inline_depth++;
+	gh_emit_statements(fun->fun.block);
+	inline_depth--;
+	fun_ret_type = saved_ret;
+
+	gh_list body = fun->fun.block;
+	if (!body.len || NODE(gh_ast_nth(tree, body, body.len - 1))->type != GH_AST_RETURN) {
+		emitb(GH_VM_MOV_IMM_A64);
+		emitqw(0);
+	}
+
+	u64 end = bc->bytes.used;
+	while (inline_exits.used > exits) {
+		bc->bytes.used = inline_exits.data[--inline_exits.used];
+		emitqw(end);
+	}
+	bc->bytes.used = end;
+
+	gh_leave_scope();
+	gh_show_locals(caller);
+	offset_counter = frame; // the parameters are dead once it returns
+	bc->ninlined++;
+}
+
+// The body of a function, from ENTER on
+static void gh_emit_fun_body(gh_ast *ast, u8 is_main) {
+	emitb(GH_VM_ENTER);
+	emitb(GH_VM_ADD_SP);
+
+	u64 old_nbytes = bc->bytes.used;
+	emitqw(0);
+
+	gh_emit_statements(ast->fun.block);
+
+	if (is_main) {
+		emitb(GH_VM_EXIT);
+	} else {
+		// This may be a duplicate for functions that return something at the end,
+		// so that may want to be optimized later
+		emitb(GH_VM_MOV_IMM_A64);
+		emitqw(0);
+		emitb(GH_VM_LEAVE);
+		emitb(GH_VM_RET);
 	}
+
+	u64 tmp = bc->bytes.used;
+	bc->bytes.used = old_nbytes;
+	emitqw((u64) offset_min);
+	bc->bytes.used = tmp;
+	offset_counter = offset_min = 0;
+}
+
+static int gh_ir_callee_of(u32 key, gh_ir_callee *callee) {
+	gh_local *local = gh_find_local(key);
+	if (!local || (local->id != GH_LOCAL_FUN && local->id != GH_LOCAL_SYSFUN))
+		return -1;
+	*callee = (gh_ir_callee) {
+		.sysfun = local->id == GH_LOCAL_SYSFUN,
+		.target = (u64) local->offset,
+		.ret = local->type,
+		.params = local->param_types.data,
+		.nparams = local->param_types.used,
+	};
+	return 0;
 }
 
-static void gh_emit_fun(gh_local_list *pl, gh_ast *ast) {
+// Returns -1 if the function has to be emitted directly instead
+static int gh_emit_fun_ir(gh_ast *ast, u8 is_main) {
+	gh_ir_fun f;
+	if (gh_ir_build(&f, ast, is_main)) {
+		if (bc->dump_ir)
+			gh_log(GH_LOG_INFO, "%s: not supported by the IR, emitted directly",
+				gh_token_str(toks, ast->tok));
+		return -1;
+	}
+	gh_ir_optimize(&f);
+	if (bc->dump_ir)
+		gh_ir_debug(stderr, toks, &f);
+	gh_ir_lower(&f, bc);
+	gh_ir_deinit(&f);
+	return 0;
+}
+
+static void gh_emit_fun(gh_node node) {
+	gh_ast *ast = NODE(node);
 	gh_local *found;
-	if ((found = gh_find_local(pl, ast->fun.ident->info.str))) {
+	if ((found = gh_find_local(ast->tok.payload))) {
 		if (found->id != GH_LOCAL_FUN) {
 			gh_log(GH_LOG_ERR, "function declaration of already declared variable");
 			COMPILE_FAIL();
@@ -780,124 +2164,179 @@ static void gh_emit_fun(gh_local_list *pl, gh_ast *ast) {
 			COMPILE_FAIL();
 		}
 	}
-	gh_local *fun_local = gh_add_local(pl, &(const gh_local) {
+	u64 fun_local = gh_add_local(&(const gh_local) {
 		.id = GH_LOCAL_FUN,
-		.name = ast->fun.ident->info.str,
-		.type = ast->fun.type->id,
+		.name = gh_token_str(toks, ast->tok),
+		.key = ast->tok.payload,
+		.type = ast->fun.type,
 		.emitted = 1,
+		.offset = (i64) bc->bytes.used,
+		.param_types = INIT_VEC(gh_type),
+		.node = node,
 	});
-	fun_ret_type = ast->fun.type->id;
-	fun_local->param_types = INIT_VEC(gh_type);
+	fun_ret_type = ast->fun.type;
+	if (gh_is_vector(fun_ret_type)) {
+		gh_log(GH_LOG_ERR, "a function cannot return a vector");
+		COMPILE_FAIL();
+	}
+	u8 is_main = !strcmp(syms.locals.data[fun_local].name, "main");
 
-	gh_local_list fun_list;
-	gh_init_local_list(&fun_list, pl);
-	gh_ast *flist = ast->fun.flist;
+	gh_enter_scope();
+	gh_list params = ast->fun.params;
 	i64 offset = 16; // skip base pointer and instruct pointer
-	while (flist) {
-		gh_add_local(&fun_list, &(const gh_local) {
+	for (u32 i = 0; i < params.len; i++) {
+		gh_ast *param = NODE(gh_ast_nth(tree, params, i));
+		gh_add_local(&(const gh_local) {
 			.id = GH_LOCAL_VAR,
-			.name = flist->flist.ident->info.str,
-			.type = flist->flist.type->id,
+			.name = gh_token_str(toks, param->tok),
+			.key = param->tok.payload,
+			.type = param->param.type,
 			.offset = offset,
 		});
-		int typesize = gh_get_type_size(flist->flist.type->id);
-		if (!typesize) {
-			gh_log(GH_LOG_ERR, "cannot have unit type in function parameters");
+		int typesize = gh_get_type_size(param->param.type);
+		if (!typesize || gh_is_vector(param->param.type)) {
+			gh_log(GH_LOG_ERR, "cannot have unit or vector types in function parameters");
 			COMPILE_FAIL();
 		}
-		APPEND_VEC(fun_local->param_types, flist->flist.type->id);
+		APPEND_VEC(syms.locals.data[fun_local].param_types, param->param.type);
 		offset += typesize;
-		flist = flist->flist.flist; // wow I'm so good at naming things
 	}
+	fun_param_size = offset - 16;
 
 	APPEND_VEC(bc->funs, (gh_fun){});
 	gh_fun *fun = LAST_VEC(bc->funs);
 	fun->offset = bc->bytes.used;
-
-	emitb(GH_VM_ENTER);
-	emitb(GH_VM_ADD_SP);
-
-	u64 old_nbytes = bc->bytes.used;
-	emitqw(0);
-
-	gh_emit_statement(&fun_list, ast->fun.block);
-
-	if (!strcmp(fun_local->name, "main")) {
+	const gh_local *sig = &syms.locals.data[fun_local];
+	u64 len = strlen(sig->name);
+	fun->name = gh_malloc(len + 1);
+	memcpy(fun->name, sig->name, len + 1);
+	fun->ret = sig->type;
+	fun->nparams = (u32) sig->param_types.used;
+	fun->params = gh_malloc(sizeof(gh_type) * (fun->nparams + 1));
+	memcpy(fun->params, sig->param_types.data, sizeof(gh_type) * fun->nparams);
+
+	if (!bc->opt_ir || gh_emit_fun_ir(ast, is_main))
+		gh_emit_fun_body(ast, is_main);
+	gh_leave_scope();
+
+	u32 cost = 1;
+	if (!is_main && !gh_inline_cost_list(ast->fun.block, ast->tok.payload, &cost))
+		syms.locals.data[fun_local].inline_size = cost;
+
+	if (is_main) {
 		bc->main_idx = bc->funs.used - 1;
 		bc->main_defined = 1;
-		emitb(GH_VM_EXIT);
-	} else {
-		// This may be a duplicate for functions that return something at the end,
-		// so that may want to be optimized later
-		emitb(GH_VM_MOV_IMM_A64);
-		emitqw(0);
-		emitb(GH_VM_LEAVE);
-		emitb(GH_VM_RET);
 	}
-
-	u64 tmp = bc->bytes.used;
-	bc->bytes.used = old_nbytes;
-	emitqw((u64) offset_counter);
-	bc->bytes.used = tmp;
-
 	fun->nbytes = bc->bytes.used - fun->offset;
-	offset_counter = 0;
 }
 
-static void gh_bytecode_compile(gh_bytecode *bytecode, gh_ast *ast) {
-	if (setjmp(compile_end))
-		return ;
-
+static int gh_bytecode_compile(gh_bytecode *bytecode, const gh_lexer *lx, const gh_ast_tree *ast) {
 	bc = bytecode;
-	gh_init_code();
+	toks = lx;
+	tree = ast;
+	spine = INIT_VEC(u32);
+	inline_exits = INIT_VEC(u64);
+	inline_depth = 0;
+	hoists = INIT_VEC(gh_hoist);
+	licm.writes = INIT_VEC(u64);
+	match_cases = INIT_VEC(gh_case);
+	match_arms = INIT_VEC(u64);
+	gh_sym_init();
+	if (bc->opt_ir)
+		gh_ir_begin(toks, tree, gh_ir_callee_of);
+	str_offsets = gh_malloc(sizeof(u32) * (toks->strs.used + 1));
+	memset(str_offsets, 0, sizeof(u32) * (toks->strs.used + 1));
+	if (setjmp(compile_end)) {
+		if (bc->opt_ir)
+			gh_ir_end();
+		gh_free(str_offsets);
+		FREE_VEC(spine);
+		FREE_VEC(inline_exits);
+		FREE_VEC(hoists);
+		FREE_VEC(licm.writes);
+		FREE_VEC(match_cases);
+		FREE_VEC(match_arms);
+		gh_sym_deinit();
+		return -1;
+	}
 
-	gh_local_list list;
-	gh_init_local_list(&list, NULL);
-	gh_register_sysfuns(&list);
-	gh_ast *decl = ast->prgm.decl;
-	while (decl) {
-		gh_ast *child = decl->decl.child;
+	gh_init_code();
+	gh_enter_scope();
+	gh_register_sysfuns();
+	gh_list decls = NODE(tree->root)->prgm.decls;
+	for (u32 i = 0; i < decls.len; i++) {
+		gh_ast *child = NODE(gh_ast_nth(tree, decls, i));
 		switch (child->type) {
-			case GH_AST_FUN: gh_emit_fun(&list, child); break;
-			//case GH_AST_VAR: gh_emit_global(&list, child); break;
+			case GH_AST_FUN: gh_emit_fun(gh_ast_nth(tree, decls, i)); break;
+			//case GH_AST_VAR: gh_emit_global(child); break;
 			default: COMPILE_FAIL();
 		}
-		decl = decl->decl.decl;
 	}
-	gh_deinit_local_list(&list);
+	if (bc->opt_ir)
+		gh_ir_end();
+	gh_free(str_offsets);
+	gh_sym_deinit();
+	FREE_VEC(spine);
+	FREE_VEC(inline_exits);
+	FREE_VEC(hoists);
+	FREE_VEC(licm.writes);
+	FREE_VEC(match_cases);
+	FREE_VEC(match_arms);
+
+	// A host may only call other functions, so main is left to the caller
+	bc->nrewrites = gh_opt_peephole(bc);
+	return 0;
+}
 
-	if (bc->main_defined) {
-		compile_success = 1;
-	} else {
-		gh_log(GH_LOG_ERR, "no main function defined");
-	}
+static u64 gh_clock_ns(void) {
+	struct timespec ts;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000ULL + (u64) ts.tv_nsec;
 }
 
-int gh_bytecode_src(gh_bytecode *bytecode, char *file) {
+int gh_bytecode_src(gh_bytecode *bytecode, const char *file, gh_parse_stats *stats) {
 	char *src = gh_slurp_src(file);
 	if (!src)
 		return -1;
-
-	token_v tokens = gh_token_init(src);
+	int ret = gh_bytecode_str(bytecode, src, stats);
 	free(src);
-	if (!VEC_IS_NULL(tokens)) {
-		gh_ast *ast;
-		if ((ast = gh_ast_init(tokens))) {
-			//gh_ast_debug(ast);
-			gh_bytecode_compile(bytecode, ast);
-			gh_ast_deinit(ast);
-		}
-		gh_token_deinit(tokens);
-	}
-	if (!compile_success) {
+	if (ret < 0)
 		gh_log(GH_LOG_ERR, "failed to compile %s", file);
+	return ret;
+}
+
+int gh_bytecode_str(gh_bytecode *bytecode, const char *src, gh_parse_stats *stats) {
+	gh_lexer lx;
+	if (gh_lex_init(&lx, src))
 		return -1;
+	gh_ast_tree tree;
+	u64 start = gh_clock_ns();
+	int err = gh_ast_init(&tree, &lx);
+	if (stats) {
+		stats->parse_ns = gh_clock_ns() - start;
+		stats->nnodes = tree.nodes.used;
+		stats->nbytes = tree.nodes.used * sizeof(gh_ast)
+			+ tree.extra.used * sizeof(u32);
 	}
+	int ret = -1;
+	if (!err) {
+		(void) gh_opt_fold(&tree, &lx);
+		//gh_ast_debug(&lx, &tree);
+		ret = gh_bytecode_compile(bytecode, &lx, &tree);
+		gh_ast_deinit(&tree);
+	}
+	gh_lex_deinit(&lx);
+	return ret;
+}
 
-	return 0;
+i64 gh_bytecode_find(const gh_bytecode *bytecode, const char *name) {
+	for (u64 i = 0; i < bytecode->funs.used; i++) {
+		if (!strcmp(bytecode->funs.data[i].name, name))
+			return (i64) i;
+	}
+	return -1;
 }
 
 void gh_bytecode_deinit(gh_bytecode *bytecode) {
-	FREE_VEC(bytecode->bytes);
-	FREE_VEC(bytecode->funs);
+	gh_free_code(bytecode);
 }
@@ -4,27 +4,38 @@
 #include "types.h"
 #include "ast.h"
 
-typedef enum {
-	GH_SYSFUN_PRINT8 = 0,
-	GH_SYSFUN_PRINT16,
-	GH_SYSFUN_PRINT32,
-	GH_SYSFUN_PRINT64,
-	GH_SYSFUN_LAST,
-} gh_sysfun_idx;
+typedef enum gh_token_id gh_type;
 
 typedef struct {
 	u64 offset;
 	u64 nbytes;
+
+	// The signature, for a host to call it by, see gh_vm_call
+	char *name;
+	gh_type ret;
+	gh_type *params;
+	u32 nparams;
 } gh_fun;
 
 DEFINE_VEC(gh_fun);
-DEFINE_VEC(u8);
 
 typedef struct {
 	VEC(u8) bytes;
 	VEC(gh_fun) funs;
+
+	// String constants, each stored once and referred to by MOV_STR_A. The
+	// VMs running the bytecode only ever read it, so they can share it, and
+	// it belongs to the bytecode as much as the code does.
+	VEC(u8) rodata;
+
 	u64 main_idx; // idx into funs
 	u8 main_defined;
+	u64 nrewrites; // by the peephole pass
+	u64 ninlined;  // call sites replaced by the callee's body
+	u64 ntail;     // calls that reuse the caller's frame
+
+	u8 opt_ir;  // compile functions through the SSA IR, see ir.h
+	u8 dump_ir; // and print it
 } gh_bytecode;
 
 // beware of double evaluation
@@ -59,10 +70,22 @@ typedef struct {
 	APPEND_VEC_RAW(v, (qw >> 0) & 0xff); \
 } while (0)
 
+// Parser counters, filled in by gh_bytecode_src and gh_bytecode_str when
+// asked for
+typedef struct {
+	u64 nnodes;
+	u64 nbytes;
+	u64 parse_ns;
+} gh_parse_stats;
+
 // Should implement gh_bytecode_verify
 // that checks if the bytecode is valid; that is if
 // all indices are within bounds, as well as other stuff.
 void gh_bytecode_init(gh_bytecode *bytecode);
-int gh_bytecode_src(gh_bytecode *bytecode, char *file);
+int gh_bytecode_src(gh_bytecode *bytecode, const char *file, gh_parse_stats *stats);
+// The same for source that's already in memory
+int gh_bytecode_str(gh_bytecode *bytecode, const char *src, gh_parse_stats *stats);
+// The index in funs of the function called name, or -1 if there's none
+i64 gh_bytecode_find(const gh_bytecode *bytecode, const char *name);
 void gh_bytecode_deinit(gh_bytecode *bytecode);
 #endif // _GALACH_BYTECODE_H
@@ -1,4 +1,5 @@
 #include "debug.h"
+#include "native.h"
 #include "log.h"
 #include <inttypes.h>
 
@@ -14,6 +15,9 @@ static char *token_map[] = {
 	[GH_TOK_KW_U64] = "TOK_KW_U64",
 	[GH_TOK_KW_F32] = "TOK_KW_F32",
 	[GH_TOK_KW_F64] = "TOK_KW_F64",
+	[GH_TOK_KW_V4I32] = "TOK_KW_V4I32",
+	[GH_TOK_KW_V2I64] = "TOK_KW_V2I64",
+	[GH_TOK_KW_STR] = "TOK_KW_STR",
 
 	[GH_TOK_KW_VAR] = "TOK_KW_VAR",
 	[GH_TOK_KW_FUN] = "TOK_KW_FUN",
@@ -70,16 +74,18 @@ static char *token_map[] = {
 	
 	[GH_TOK_LPAREN] = "TOK_LPAREN",
 	[GH_TOK_RPAREN] = "TOK_RPAREN",
+	[GH_TOK_LBRACKET] = "TOK_LBRACKET",
+	[GH_TOK_RBRACKET] = "TOK_RBRACKET",
+	[GH_TOK_SEMICOLON] = "TOK_SEMICOLON",
 
 	[GH_TOK_COMMA] = "TOK_COMMA",
 	[GH_TOK_EOF]   = "EOF",
 };
 
 static const char *ast_map[] = {
-	[GH_AST_PRGM]="GH_AST_PRGM",      [GH_AST_DECL]="GH_AST_DECL",
-	[GH_AST_FUN]="GH_AST_FUN",       [GH_AST_FLIST]="GH_AST_FLIST",
-	[GH_AST_VAR]="GH_AST_VAR",
-	[GH_AST_STATEMENT]="GH_AST_STATEMENT", [GH_AST_CLIST]="GH_AST_CLIST",
+	[GH_AST_NONE]="GH_AST_NONE",      [GH_AST_PRGM]="GH_AST_PRGM",
+	[GH_AST_FUN]="GH_AST_FUN",       [GH_AST_PARAM]="GH_AST_PARAM",
+	[GH_AST_VAR]="GH_AST_VAR",       [GH_AST_BLOCK]="GH_AST_BLOCK",
 	[GH_AST_IF]="GH_AST_IF",        [GH_AST_MATCH]="GH_AST_MATCH",
 	[GH_AST_MSELECT]="GH_AST_MSELECT",   [GH_AST_WHILE]="GH_AST_WHILE",
 	[GH_AST_ASSGN]="GH_AST_ASSGN",     [GH_AST_RETURN]="GH_AST_RETURN",
@@ -101,106 +107,129 @@ void gh_token_print(FILE *fp, gh_token *token) {
 	switch (token->id) {
 		case GH_TOK_IDENT:
 		case GH_TOK_LIT_STRING:
-			(void) fprintf(stderr, "(\"%s\")", token->info.str);
+			(void) fprintf(fp, "(\"%s\")", token->info.str);
 			break;
 		case GH_TOK_LIT_INT:
-			(void) fprintf(stderr, "(%" PRIu64 ")", token->info.i);
+			(void) fprintf(fp, "(%" PRIu64 ")", token->info.i);
 			break;
 		case GH_TOK_LIT_FLOAT:
-			(void) fprintf(stderr, "(%lf)", token->info.flt);
+			(void) fprintf(fp, "(%lf)", token->info.flt);
 			break;
 		default: break;
 	}
 }
 
-void gh_token_debug(FILE *fp, token_v tokens) {
-	LOOP_VEC(tokens, token, {
-		gh_token_print(fp, token);
+// Drains the lexer, so this needs a lexer of its own
+void gh_token_debug(FILE *fp, gh_lexer *lx) {
+	for (;;) {
+		gh_tok tok = gh_lex_next(lx);
+		gh_token token = gh_token_get(lx, tok);
+		gh_token_print(fp, &token);
 		(void) fputc(' ', fp);
-	});
+		if (tok.kind == GH_TOK_EOF)
+			break;
+	}
 	(void) fputc('\n', fp);
 }
 
-static void gh_ast_debug_rec(gh_ast *root, int level) {
+static const gh_lexer *ast_tokens;
+static const gh_ast_tree *ast_tree;
+static void gh_ast_debug_tok(gh_tok tok) {
+	gh_token token = gh_token_get(ast_tokens, tok);
+	gh_token_print(stderr, &token);
+	(void) fputc('\n', stderr);
+}
+
+static void gh_ast_debug_kind(u8 kind) {
+	(void) fprintf(stderr, "%s\n", token_map[kind]);
+}
+
+static void gh_ast_debug_rec(gh_node node, int level);
+static void gh_ast_debug_list(gh_list list, int level) {
+	(void) fprintf(stderr, "[%" PRIu32 "]\n", list.len);
+	for (u32 i = 0; i < list.len; i++) {
+		for (int j = 0; j <= level; j++) (void) fprintf(stderr, "│ ");
+		(void) fprintf(stderr, "├─");
+		gh_ast_debug_rec(gh_ast_nth(ast_tree, list, i), level+1);
+	}
+}
+
+static void gh_ast_debug_rec(gh_node node, int level) {
 	#define PAD() for (int i = 0; i < level; i++) (void) fprintf(stderr, "│ ");
 	#define ARR() (void) fprintf(stderr, "├─")
 	#define DO(child) gh_ast_debug_rec((child), level+1)
-	#define DOTOK(child) gh_token_print(stderr, (child)); (void) fputc('\n', stderr)
+	#define DOLIST(child) gh_ast_debug_list((child), level)
+	#define DOTOK(child) gh_ast_debug_tok((child))
+	#define DOKIND(child) gh_ast_debug_kind((child))
 
-	if (!root) {
+	if (!node) {
 		(void) fprintf(stderr, "(null)\n");
 		return ;
 	}
 
+	gh_ast *root = gh_ast_get(ast_tree, node);
 	(void) fprintf(stderr, "(%s)\n", ast_map[root->type]);
 	PAD(); ARR();
 	switch (root->type) {
-		case GH_AST_PRGM: gh_ast_debug_rec(root->prgm.decl, level+1); break;
-		case GH_AST_DECL:
-			DO(root->decl.child); PAD(); ARR();
-			DO(root->decl.decl); break;
+		case GH_AST_PRGM: DOLIST(root->prgm.decls); break;
 		case GH_AST_FUN:
-			DOTOK(root->fun.ident); PAD(); ARR();
-			DO(root->fun.flist); PAD(); ARR();
-			DOTOK(root->fun.type); PAD(); ARR();
-			DO(root->fun.block); break;
-		case GH_AST_FLIST:
-			DOTOK(root->flist.type); PAD(); ARR();
-			DOTOK(root->flist.ident); PAD(); ARR();
-			DO(root->flist.flist); break;
+			DOTOK(root->tok); PAD(); ARR();
+			DOLIST(root->fun.params); PAD(); ARR();
+			DOKIND(root->fun.type); PAD(); ARR();
+			DOLIST(root->fun.block); break;
+		case GH_AST_PARAM:
+			DOKIND(root->param.type); PAD(); ARR();
+			DOTOK(root->tok); break;
 		case GH_AST_VAR:
-			DOTOK(root->var.ident); PAD(); ARR();
-			DOTOK(root->var.type); PAD(); ARR();
+			DOTOK(root->tok); PAD(); ARR();
+			DOKIND(root->var.type); PAD(); ARR();
 			DO(root->var.expr); break;
-		case GH_AST_STATEMENT:
-			DO(root->statement.child); PAD(); ARR();
-			DO(root->statement.statement); break;
+		case GH_AST_BLOCK: DOLIST(root->block.block); break;
 		case GH_AST_IF:
 			DO(root->ifexpr.expr); PAD(); ARR();
-			DO(root->ifexpr.statement); PAD(); ARR();
+			DOLIST(root->ifexpr.block); PAD(); ARR();
 			DO(root->ifexpr.endif); break;
 		case GH_AST_MATCH:
 			DO(root->match.expr); PAD(); ARR();
-			DO(root->match.mselect); break;
+			DOLIST(root->match.arms); break;
 		case GH_AST_MSELECT:
 			DO(root->mselect.expr); PAD(); ARR();
-			DO(root->mselect.statement); PAD(); ARR();
-			DO(root->mselect.mselect); break;
+			DOLIST(root->mselect.block); break;
 		case GH_AST_WHILE:
 			DO(root->whileexpr.expr); PAD(); ARR();
-			DO(root->whileexpr.block); break;
+			DOLIST(root->whileexpr.block); break;
 		case GH_AST_RETURN:
-			DO(root->whileexpr.expr); break;
+			DO(root->returnexpr.expr); break;
 		case GH_AST_OR: case GH_AST_AND:
 		case GH_AST_BOR: case GH_AST_BXOR:
-		case GH_AST_BAND:
+		case GH_AST_BAND: case GH_AST_COMPARE:
+		case GH_AST_RELATION: case GH_AST_SHIFTER:
+		case GH_AST_ADDER: case GH_AST_FACTOR:
+			DOTOK(root->tok); PAD(); ARR();
 			DO(root->branch.first); PAD(); ARR();
 			DO(root->branch.second); break;
-		case GH_AST_COMPARE: case GH_AST_RELATION:
-		case GH_AST_SHIFTER: case GH_AST_ADDER:
-		case GH_AST_FACTOR:
-			DOTOK(root->branch_op.op); PAD(); ARR();
-			DO(root->branch_op.first); PAD(); ARR();
-			DO(root->branch_op.second); break;
 		case GH_AST_ASSGN:
-			DOTOK(root->assgn.ident); PAD(); ARR();
-			DOTOK(root->assgn.op); PAD(); ARR();
+			DOTOK(root->tok); PAD(); ARR();
+			DOKIND(root->assgn.op); PAD(); ARR();
 			DO(root->assgn.expr); break;
 		case GH_AST_UNARY:
-			DOTOK(root->unary.op); PAD(); ARR();
+			DOTOK(root->tok); PAD(); ARR();
 			DO(root->unary.child); break;
 		case GH_AST_PRIMARY:
-			DOTOK(root->primary.literal); PAD(); ARR();
-			DO(root->primary.clist); break;
-		case GH_AST_CLIST:
-			DO(root->clist.expr); PAD(); ARR();
-			DO(root->clist.clist); break;
+			DOTOK(root->tok);
+			if (root->primary.call) {
+				PAD(); ARR();
+				DOLIST(root->primary.args);
+			}
+			break;
 		default: break;
 	}
 }
 
-void gh_ast_debug(gh_ast *root) {
-	gh_ast_debug_rec(root, 0);
+void gh_ast_debug(const gh_lexer *lx, const gh_ast_tree *tree) {
+	ast_tokens = lx;
+	ast_tree = tree;
+	gh_ast_debug_rec(tree->root, 0);
 }
 
 static char *op_map[] = {
@@ -214,23 +243,41 @@ static char *op_map[] = {
 	[GH_VM_MOV_OFFSET_A32] = "mov.dw",
 	[GH_VM_MOV_OFFSET_A64] = "mov.qw",
 
+	[GH_VM_MOV_OFFSET_SX_A8] = "movsx.b",
+	[GH_VM_MOV_OFFSET_SX_A16] = "movsx.w",
+	[GH_VM_MOV_OFFSET_SX_A32] = "movsx.dw",
+
+	[GH_VM_MOV_INDEX_A8] = "mov.b",
+	[GH_VM_MOV_INDEX_A16] = "mov.w",
+	[GH_VM_MOV_INDEX_A32] = "mov.dw",
+	[GH_VM_MOV_INDEX_A64] = "mov.qw",
+
+	[GH_VM_MOV_A_INDEX8] = "mov.b",
+	[GH_VM_MOV_A_INDEX16] = "mov.w",
+	[GH_VM_MOV_A_INDEX32] = "mov.dw",
+	[GH_VM_MOV_A_INDEX64] = "mov.qw",
+
+	[GH_VM_BOUND] = "bound",
+	[GH_VM_CLEAR] = "clear",
+
 	[GH_VM_SIGN_A8] = "sign.b",
 	[GH_VM_SIGN_A16] = "sign.w",
 	[GH_VM_SIGN_A32] = "sign.dw",
 	[GH_VM_SIGN_A64] = "sign.qw",
 
-	[GH_VM_ZEXT_A8_16] = "zext.b.w",
-	[GH_VM_ZEXT_A16_32] = "zext.w.dw",
-	[GH_VM_ZEXT_A32_64] = "zext.dw.qw",
+	[GH_VM_ZEXT_A8] = "zext.b",
+	[GH_VM_ZEXT_A16] = "zext.w",
+	[GH_VM_ZEXT_A32] = "zext.dw",
 
-	[GH_VM_SEXT_A8_16] = "sext.b.w",
-	[GH_VM_SEXT_A16_32] = "sext.w.dw",
-	[GH_VM_SEXT_A32_64] = "sext.dw.qw",
+	[GH_VM_SEXT_A8] = "sext.b",
+	[GH_VM_SEXT_A16] = "sext.w",
+	[GH_VM_SEXT_A32] = "sext.dw",
 
 	[GH_VM_MOV_IMM_A8] = "mov.b",
 	[GH_VM_MOV_IMM_A16] = "mov.w",
 	[GH_VM_MOV_IMM_A32] = "mov.dw",
 	[GH_VM_MOV_IMM_A64] = "mov.qw",
+	[GH_VM_MOV_STR_A] = "mov.str",
 
 	[GH_VM_NEG_A8] = "neg.b",
 	[GH_VM_NEG_A16] = "neg.w",
@@ -277,6 +324,85 @@ static char *op_map[] = {
 	[GH_VM_MOD32] = "mod.dw",
 	[GH_VM_MOD64] = "mod.qw",
 
+	[GH_VM_MULHI8] = "mulhi.b",
+	[GH_VM_MULHI16] = "mulhi.w",
+	[GH_VM_MULHI32] = "mulhi.dw",
+	[GH_VM_MULHI64] = "mulhi.qw",
+
+	[GH_VM_FADD32] = "fadd.dw",
+	[GH_VM_FADD64] = "fadd.qw",
+
+	[GH_VM_FSUB32] = "fsub.dw",
+	[GH_VM_FSUB64] = "fsub.qw",
+
+	[GH_VM_FMUL32] = "fmul.dw",
+	[GH_VM_FMUL64] = "fmul.qw",
+
+	[GH_VM_FDIV32] = "fdiv.dw",
+	[GH_VM_FDIV64] = "fdiv.qw",
+
+	[GH_VM_FCMP32] = "fcmp.dw",
+	[GH_VM_FCMP64] = "fcmp.qw",
+
+	[GH_VM_FSIGN32] = "fsign.dw",
+	[GH_VM_FSIGN64] = "fsign.qw",
+
+	[GH_VM_ITOF32] = "itof.dw",
+	[GH_VM_ITOF64] = "itof.qw",
+
+	[GH_VM_UTOF32] = "utof.dw",
+	[GH_VM_UTOF64] = "utof.qw",
+
+	[GH_VM_FTOI32] = "ftoi.dw",
+	[GH_VM_FTOI64] = "ftoi.qw",
+
+	[GH_VM_FTOU32] = "ftou.dw",
+	[GH_VM_FTOU64] = "ftou.qw",
+
+	[GH_VM_FEXT] = "fext",
+
+	[GH_VM_VLOAD32] = "vload.dw",
+	[GH_VM_VLOAD64] = "vload.qw",
+
+	[GH_VM_VSTORE32] = "vstore.dw",
+	[GH_VM_VSTORE64] = "vstore.qw",
+
+	[GH_VM_VLOAD_INDEX32] = "vload.dw",
+	[GH_VM_VLOAD_INDEX64] = "vload.qw",
+
+	[GH_VM_VSTORE_INDEX32] = "vstore.dw",
+	[GH_VM_VSTORE_INDEX64] = "vstore.qw",
+
+	[GH_VM_VPUSH] = "vpush",
+
+	[GH_VM_VSPLAT32] = "vsplat.dw",
+	[GH_VM_VSPLAT64] = "vsplat.qw",
+
+	[GH_VM_VADD32] = "vadd.dw",
+	[GH_VM_VADD64] = "vadd.qw",
+
+	[GH_VM_VSUB32] = "vsub.dw",
+	[GH_VM_VSUB64] = "vsub.qw",
+
+	[GH_VM_VMUL32] = "vmul.dw",
+	[GH_VM_VMUL64] = "vmul.qw",
+
+	[GH_VM_VAND] = "vand",
+	[GH_VM_VOR] = "vor",
+	[GH_VM_VXOR] = "vxor",
+
+	[GH_VM_VCMPEQ32] = "vcmpeq.dw",
+	[GH_VM_VCMPEQ64] = "vcmpeq.qw",
+
+	[GH_VM_VCMPLT32] = "vcmplt.dw",
+	[GH_VM_VCMPLT64] = "vcmplt.qw",
+
+	[GH_VM_VCMPGT32] = "vcmpgt.dw",
+	[GH_VM_VCMPGT64] = "vcmpgt.qw",
+
+	[GH_VM_VSUM32] = "vsum.dw",
+	[GH_VM_VSUM64] = "vsum.qw",
+
 	[GH_VM_LSHIFT8] = "lshift.b",
 	[GH_VM_LSHIFT16] = "lshift.w",
 	[GH_VM_LSHIFT32] = "lshift.dw",
@@ -328,6 +454,14 @@ static char *op_map[] = {
 	[GH_VM_JZ16] = "jz.w",
 	[GH_VM_JZ32] = "jz.dw",
 	[GH_VM_JZ64] = "jz.qw",
+	[GH_VM_JNZ8] = "jnz.b",
+	[GH_VM_JNZ16] = "jnz.w",
+	[GH_VM_JNZ32] = "jnz.dw",
+	[GH_VM_JNZ64] = "jnz.qw",
+	[GH_VM_JTAB8] = "jtab.b",
+	[GH_VM_JTAB16] = "jtab.w",
+	[GH_VM_JTAB32] = "jtab.dw",
+	[GH_VM_JTAB64] = "jtab.qw",
 	[GH_VM_JMP] = "jmp",
 	[GH_VM_CALL] = "call",
 	[GH_VM_RET] = "ret",
@@ -397,7 +531,45 @@ static int gh_disas_offset(FILE *fp, u8 *b, u8 *e) {
 static int gh_disas_addr(FILE *fp, u8 *b, u8 *e) {
 	CHECK_DISAS(b, e, 8);
 	u64 addr = gh_disas_get64(fp, b, e);
-	(void) fprintf(fp, "0x%llx", addr);
+	(void) fprintf(fp, "0x%" PRIx64, addr);
+	return 8;
+}
+
+// A native's index, and its name
+static int gh_disas_native(FILE *fp, u8 *b, u8 *e) {
+	CHECK_DISAS(b, e, 8);
+	u64 idx = gh_disas_get64(fp, b, e);
+	const gh_native *nf = gh_native_get(idx);
+	(void) fprintf(fp, "0x%" PRIx64 " (%s)", idx, nf ? nf->name : "?");
+	return 8;
+}
+
+// The string a view refers to, quoted
+static int gh_disas_str(FILE *fp, gh_bytecode *bc, u8 *b, u8 *e) {
+	CHECK_DISAS(b, e, 8);
+	u64 view = gh_disas_get64(fp, b, e);
+	u64 offset = view >> 32, len = (u32) view;
+	if (offset + len > bc->rodata.used) {
+		(void) fprintf(fp, "<bad string>");
+		return 8;
+	}
+	fputc('"', fp);
+	for (u64 i = 0; i < len; i++) {
+		u8 c = bc->rodata.data[offset + i];
+		switch (c) {
+			case '\n': (void) fprintf(fp, "\\n"); break;
+			case '\t': (void) fprintf(fp, "\\t"); break;
+			case '"': (void) fprintf(fp, "\\\""); break;
+			case '\\': (void) fprintf(fp, "\\\\"); break;
+			default:
+				if (c >= ' ' && c <= '~')
+					fputc(c, fp);
+				else
+					(void) fprintf(fp, "\\x%.2x", c);
+				break;
+		}
+	}
+	fputc('"', fp);
 	return 8;
 }
 
@@ -442,15 +614,50 @@ static void gh_disas_func(FILE *fp, gh_bytecode *bc, gh_fun *fun) {
 			OFFSET_A(GH_VM_MOV_OFFSET_A8);
 			SINGLE_A(GH_VM_SIGN_A8);
 
-			case GH_VM_ZEXT_A8_16:
-			case GH_VM_ZEXT_A16_32:
-			case GH_VM_ZEXT_A32_64:
+			case GH_VM_MOV_OFFSET_SX_A8:
+			case GH_VM_MOV_OFFSET_SX_A16:
+			case GH_VM_MOV_OFFSET_SX_A32:
+				(void) fprintf(fp, "[bp");
+				c = gh_disas_offset(fp, b, e);
+				if (c < 0) goto end;
+				(void) fprintf(fp, "], a");
+				break;
+
+			case GH_VM_MOV_INDEX_A8:
+			case GH_VM_MOV_INDEX_A16:
+			case GH_VM_MOV_INDEX_A32:
+			case GH_VM_MOV_INDEX_A64:
+				(void) fprintf(fp, "[bp");
+				c = gh_disas_offset(fp, b, e);
+				if (c < 0) goto end;
+				(void) fprintf(fp, "+a*%d], a", 1 << (b[-1] - GH_VM_MOV_INDEX_A8));
+				break;
+
+			case GH_VM_MOV_A_INDEX8:
+			case GH_VM_MOV_A_INDEX16:
+			case GH_VM_MOV_A_INDEX32:
+			case GH_VM_MOV_A_INDEX64:
+				(void) fprintf(fp, "a, [bp");
+				c = gh_disas_offset(fp, b, e);
+				if (c < 0) goto end;
+				(void) fprintf(fp, "+pop*%d]", 1 << (b[-1] - GH_VM_MOV_A_INDEX8));
+				break;
+
+			case GH_VM_BOUND:
+			case GH_VM_CLEAR:
+				c = gh_disas_imm64(fp, b, e);
+				if (c < 0) goto end;
+				break;
+
+			case GH_VM_ZEXT_A8:
+			case GH_VM_ZEXT_A16:
+			case GH_VM_ZEXT_A32:
 				(void) fprintf(fp, "a");
 				break;
 
-			case GH_VM_SEXT_A8_16:
-			case GH_VM_SEXT_A16_32:
-			case GH_VM_SEXT_A32_64:
+			case GH_VM_SEXT_A8:
+			case GH_VM_SEXT_A16:
+			case GH_VM_SEXT_A32:
 				(void) fprintf(fp, "a");
 				break;
 
@@ -474,10 +681,88 @@ static void gh_disas_func(FILE *fp, gh_bytecode *bc, gh_fun *fun) {
 				if (c < 0) goto end;
 				(void) fprintf(fp, ", a");
 				break;
+			case GH_VM_MOV_STR_A:
+				c = gh_disas_str(fp, bc, b, e);
+				if (c < 0) goto end;
+				(void) fprintf(fp, ", a");
+				break;
 
 			SINGLE_A(GH_VM_NEG_A8);
 			SINGLE_A(GH_VM_BNEG_A8);
 
+			case GH_VM_MULHI8:
+			case GH_VM_MULHI16:
+			case GH_VM_MULHI32:
+			case GH_VM_MULHI64:
+				(void) fprintf(fp, ">> ");
+				c = gh_disas_imm8(fp, b, e);
+				if (c < 0) goto end;
+				break;
+
+			case GH_VM_FSIGN32:
+			case GH_VM_FSIGN64:
+			case GH_VM_ITOF32:
+			case GH_VM_ITOF64:
+			case GH_VM_UTOF32:
+			case GH_VM_UTOF64:
+			case GH_VM_FTOI32:
+			case GH_VM_FTOI64:
+			case GH_VM_FTOU32:
+			case GH_VM_FTOU64:
+			case GH_VM_FEXT:
+				(void) fprintf(fp, "a");
+				break;
+
+			case GH_VM_VLOAD32:
+			case GH_VM_VLOAD64:
+				(void) fprintf(fp, "[bp");
+				c = gh_disas_offset(fp, b, e);
+				if (c < 0) goto end;
+				(void) fprintf(fp, "], v");
+				break;
+
+			case GH_VM_VSTORE32:
+			case GH_VM_VSTORE64:
+				(void) fprintf(fp, "v, [bp");
+				c = gh_disas_offset(fp, b, e);
+				if (c < 0) goto end;
+				(void) fprintf(fp, "]");
+				break;
+
+			case GH_VM_VLOAD_INDEX32:
+			case GH_VM_VLOAD_INDEX64:
+				(void) fprintf(fp, "[bp");
+				c = gh_disas_offset(fp, b, e);
+				if (c < 0) goto end;
+				(void) fprintf(fp, "+a*%d], v", b[-1] == GH_VM_VLOAD_INDEX32 ? 4 : 8);
+				break;
+
+			case GH_VM_VSTORE_INDEX32:
+			case GH_VM_VSTORE_INDEX64:
+				(void) fprintf(fp, "v, [bp");
+				c = gh_disas_offset(fp, b, e);
+				if (c < 0) goto end;
+				(void) fprintf(fp, "+pop*%d]", b[-1] == GH_VM_VSTORE_INDEX32 ? 4 : 8);
+				break;
+
+			case GH_VM_VSPLAT32:
+			case GH_VM_VSPLAT64:
+				(void) fprintf(fp, "a, v");
+				break;
+
+			case GH_VM_VSUM32:
+			case GH_VM_VSUM64:
+				(void) fprintf(fp, "v, a");
+				break;
+
+			case GH_VM_JTAB8:
+			case GH_VM_JTAB16:
+			case GH_VM_JTAB32:
+			case GH_VM_JTAB64:
+				c = gh_disas_imm64(fp, b, e);
+				if (c < 0) goto end;
+				break;
+
 			case GH_VM_ADD_SP:
 			case GH_VM_CALL:
 				c = gh_disas_offset(fp, b, e);
@@ -488,12 +773,20 @@ static void gh_disas_func(FILE *fp, gh_bytecode *bc, gh_fun *fun) {
 			case GH_VM_JZ16:
 			case GH_VM_JZ32:
 			case GH_VM_JZ64:
+			case GH_VM_JNZ8:
+			case GH_VM_JNZ16:
+			case GH_VM_JNZ32:
+			case GH_VM_JNZ64:
 			case GH_VM_JMP:
-			case GH_VM_SYSFUN:
 				c = gh_disas_addr(fp, b, e);
 				if (c < 0) goto end;
 				break;
 
+			case GH_VM_SYSFUN:
+				c = gh_disas_native(fp, b, e);
+				if (c < 0) goto end;
+				break;
+
 			default:
 				break;
 		}
@@ -507,4 +800,86 @@ void gh_disas(FILE *fp, gh_bytecode *bc) {
 	LOOP_VEC(bc->funs, fun, {
 		gh_disas_func(fp, bc, fun);
 	});
+	if (bc->rodata.used)
+		(void) fprintf(fp, "\n=== rodata: %" PRIu64 " bytes ===\n", bc->rodata.used);
+}
+
+static const char *ir_op_map[] = {
+	[GH_IR_NOP]="nop",     [GH_IR_CONST]="const", [GH_IR_PARAM]="param",
+	[GH_IR_PHI]="phi",     [GH_IR_COPY]="copy",   [GH_IR_ZEXT]="zext",
+	[GH_IR_SEXT]="sext",   [GH_IR_SIGN]="sign",   [GH_IR_NOT]="not",
+	[GH_IR_BNOT]="bnot",   [GH_IR_ADD]="add",     [GH_IR_SUB]="sub",
+	[GH_IR_MUL]="mul",     [GH_IR_DIV]="div",     [GH_IR_MOD]="mod",
+	[GH_IR_SHL]="shl",     [GH_IR_SHR]="shr",     [GH_IR_BAND]="band",
+	[GH_IR_BXOR]="bxor",   [GH_IR_BOR]="bor",     [GH_IR_AND]="and",
+	[GH_IR_OR]="or",       [GH_IR_EQ]="eq",       [GH_IR_NEQ]="neq",
+	[GH_IR_LT]="lt",       [GH_IR_GT]="gt",       [GH_IR_LE]="le",
+	[GH_IR_GE]="ge",       [GH_IR_CALL]="call",   [GH_IR_SYSFUN]="sysfun",
+	[GH_IR_JMP]="jmp",     [GH_IR_BR]="br",       [GH_IR_RET]="ret",
+	[GH_IR_EXIT]="exit",
+};
+
+static const char *ir_type_map[] = {
+	[GH_TOK_KW_UNIT]="unit",
+	[GH_TOK_KW_I8]="i8",   [GH_TOK_KW_U8]="u8",
+	[GH_TOK_KW_I16]="i16", [GH_TOK_KW_U16]="u16",
+	[GH_TOK_KW_I32]="i32", [GH_TOK_KW_U32]="u32",
+	[GH_TOK_KW_I64]="i64", [GH_TOK_KW_U64]="u64",
+};
+
+void gh_ir_debug(FILE *fp, const gh_lexer *lx, const gh_ir_fun *f) {
+	#define IR_STR(key) (lx->strs.data[(key)])
+	(void) fprintf(fp, "\n=== IR of %s: %" PRIu64 " copies, %" PRIu64 " numbered, "
+		"%" PRIu64 " dead ===\n", IR_STR(f->name), f->ncopies, f->nvn, f->ndead);
+	LOOP_VEC(f->order, b, {
+		const gh_ir_block *block = &f->blocks.data[*b];
+		(void) fprintf(fp, "b%" PRIu32 ":", *b);
+		if (block->preds.used)
+			(void) fprintf(fp, " ; preds");
+		for (u64 i = 0; i < block->preds.used; i++)
+			(void) fprintf(fp, " b%" PRIu32, block->preds.data[i]);
+		(void) fputc('\n', fp);
+
+		for (gh_ir_val v = block->first; v; v = f->insns.data[v].next) {
+			const gh_ir_insn *in = &f->insns.data[v];
+			(void) fputc('\t', fp);
+			if (in->op < GH_IR_JMP && in->type != GH_TOK_KW_UNIT)
+				(void) fprintf(fp, "v%" PRIu32 " = ", v);
+			(void) fprintf(fp, "%s", ir_op_map[in->op]);
+			if (in->op < GH_IR_JMP)
+				(void) fprintf(fp, " %s", ir_type_map[in->type]);
+
+			switch (in->op) {
+				case GH_IR_CONST: (void) fprintf(fp, " %" PRIu64, in->imm); break;
+				case GH_IR_PARAM: (void) fprintf(fp, " [bp+%" PRIu64 "]", in->imm); break;
+				case GH_IR_PHI:
+					(void) fprintf(fp, " %s", IR_STR(f->vars.data[in->imm]));
+					for (u32 i = 0; i < in->list.len; i++)
+						(void) fprintf(fp, " [b%" PRIu32 " v%" PRIu32 "]",
+							block->preds.data[i], f->extra.data[in->list.start + i]);
+					break;
+				case GH_IR_CALL: case GH_IR_SYSFUN:
+					(void) fprintf(fp, " %s0x%" PRIx64 "(",
+						in->op == GH_IR_SYSFUN ? "#" : "", in->imm);
+					for (u32 i = 0; i < in->list.len; i++)
+						(void) fprintf(fp, "%sv%" PRIu32, i ? ", " : "",
+							f->extra.data[in->list.start + i]);
+					(void) fputc(')', fp);
+					break;
+				case GH_IR_JMP:
+					(void) fprintf(fp, " b%" PRIu32, block->succ[0]);
+					break;
+				case GH_IR_BR:
+					(void) fprintf(fp, " v%" PRIu32 ", b%" PRIu32 ", b%" PRIu32,
+						in->arg[0], block->succ[0], block->succ[1]);
+					break;
+				default:
+					for (int i = 0; i < 2 && in->arg[i]; i++)
+						(void) fprintf(fp, "%sv%" PRIu32, i ? ", " : " ", in->arg[i]);
+					break;
+			}
+			(void) fputc('\n', fp);
+		}
+	});
+	#undef IR_STR
 }
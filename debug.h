@@ -5,12 +5,14 @@
 #include "ast.h"
 #include "bytecode.h"
 #include "vm.h"
+#include "ir.h"
 
 #include <stdio.h>
 
 void gh_token_print(FILE *fp, gh_token *token);
-void gh_token_debug(FILE *fp, token_v tokens);
-void gh_ast_debug(gh_ast *root);
+void gh_token_debug(FILE *fp, gh_lexer *lx);
+void gh_ast_debug(const gh_lexer *lx, const gh_ast_tree *tree);
 void gh_disas(FILE *fp, gh_bytecode *bc);
+void gh_ir_debug(FILE *fp, const gh_lexer *lx, const gh_ir_fun *f);
 
 #endif // _GALACH_DEBUG_H
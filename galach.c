@@ -8,23 +8,43 @@
 #include "bytecode.h"
 #include "vm.h"
 #include "debug.h"
+#include "native.h"
+#include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <sys/resource.h>
 
 static void usage() {
 	(void) fprintf(stderr,
 		"The Galach programming language\n"
 		"Specify source(s) and any options\n"
 		"example: ./galach -d main.glc\n"
+		"  -d  print the disassembled bytecode\n"
+		"  -s  print parser statistics\n"
+		"  -O  optimize functions through the SSA IR\n"
+		"  -I  print the optimized IR, implies -O\n"
+		"  -L<lib>  load native functions from a shared library,\n"
+		"           for the sources after it\n"
 	);
 	exit(EXIT_FAILURE);
 }
 
 static u8 opt_disas;
+static u8 opt_stats;
+static u8 opt_ir;
+static u8 opt_dump_ir;
 static void gh_parse_opt(char *arg) {
 	switch (arg[1]) {
 		case 'd': opt_disas = 1; break;
+		case 's': opt_stats = 1; break;
+		case 'O': opt_ir = 1; break;
+		case 'I': opt_ir = opt_dump_ir = 1; break;
+		case 'L':
+			if (!arg[2] || gh_native_load(arg + 2) < 0)
+				exit(EXIT_FAILURE);
+			break;
 		default: usage();
 	}
 }
@@ -39,16 +59,34 @@ int main(int argc, char **argv) {
 			gh_parse_opt(argv[i]);
 		} else {
 			nsources++;
-			if (gh_bytecode_src(&bytecode, argv[i]) < 0)
+			bytecode.opt_ir = opt_ir;
+			bytecode.dump_ir = opt_dump_ir;
+			gh_parse_stats stats;
+			if (gh_bytecode_src(&bytecode, argv[i], opt_stats ? &stats : NULL) < 0)
 				return -1;
+			if (opt_stats) {
+				struct rusage usage;
+				(void) getrusage(RUSAGE_SELF, &usage);
+				gh_log(GH_LOG_INFO, "%s: %" PRIu64 " nodes, %" PRIu64 " bytes, "
+					"parsed in %.3f ms, max rss %ld KiB", argv[i],
+					stats.nnodes, stats.nbytes, stats.parse_ns / 1e6, usage.ru_maxrss);
+			}
 		}
 	}
 
 	if (!nsources)
 		usage();
+	if (!bytecode.main_defined) {
+		gh_log(GH_LOG_ERR, "no main function defined");
+		return -1;
+	}
 
-	if (opt_disas)
+	if (opt_disas) {
+		gh_log(GH_LOG_INFO, "peephole: %" PRIu64 " rewrites", bytecode.nrewrites);
+		gh_log(GH_LOG_INFO, "inliner: %" PRIu64 " calls inlined", bytecode.ninlined);
+		gh_log(GH_LOG_INFO, "tail calls: %" PRIu64, bytecode.ntail);
 		gh_disas(stderr, &bytecode);
+	}
 
 	gh_vm vm;
 	gh_vm_init(&vm, &bytecode);
@@ -57,5 +95,6 @@ int main(int argc, char **argv) {
 	gh_vm_deinit(&vm);
 
 	gh_bytecode_deinit(&bytecode);
+	gh_native_deinit();
 	return 0;
 }
@@ -0,0 +1,34 @@
+#ifndef _GALACH_H
+#define _GALACH_H
+
+/*
+ * Galach as a library, for linking against libgalach.a or libgalach.so.
+ *
+ * Compile once, then call functions as often as needed:
+ *
+ *	gh_bytecode bc;
+ *	gh_bytecode_init(&bc);
+ *	if (gh_bytecode_str(&bc, src, NULL) < 0) ...
+ *	i64 f = gh_bytecode_find(&bc, "score");
+ *
+ *	gh_vm vm;
+ *	gh_vm_init(&vm, &bc);
+ *	u64 args[] = {...}, ret;
+ *	if (gh_vm_call(&vm, (u64) f, args, &ret) < 0) ...
+ *
+ *	gh_vm_deinit(&vm);
+ *	gh_bytecode_deinit(&bc);
+ *	gh_native_deinit();
+ *
+ * Natives the program calls have to be added before it's compiled, see
+ * native.h. Any number of VMs can run the same bytecode.
+ */
+
+#include "types.h"
+#include "token.h"
+#include "bytecode.h"
+#include "vm.h"
+#include "native.h"
+#include "log.h"
+
+#endif // _GALACH_H
@@ -0,0 +1,1559 @@
+#include <string.h>
+#include <setjmp.h>
+
+#include "ir.h"
+#include "vm.h"
+#include "log.h"
+
+static gh_ir_fun *fn;
+#define INSN(v) (&fn->insns.data[(v)])
+#define BLOCK(b) (&fn->blocks.data[(b)])
+
+// Appends with doubling growth, for arrays that get large
+#define PUSH_VEC(vec, x) do { \
+	if ((vec).used == (vec).size) \
+		GROW_VEC((vec), (vec).size); \
+	APPEND_VEC_RAW((vec), (x)); \
+} while (0)
+
+static int gh_ir_is_int(gh_type type) {
+	return type >= GH_TOK_KW_I8 && type <= GH_TOK_KW_U64;
+}
+
+static int gh_ir_is_signed(gh_type type) {
+	switch (type) {
+		case GH_TOK_KW_I8: case GH_TOK_KW_I16:
+		case GH_TOK_KW_I32: case GH_TOK_KW_I64: return 1;
+		default: return 0;
+	}
+}
+
+// 0, 1, 2, 3 for 8, 16, 32 and 64 bits, which is how far each sized op
+// is from its 8-bit form
+static u8 gh_ir_wi(gh_type type) {
+	return (type - GH_TOK_KW_I8) / 2;
+}
+
+static u64 gh_ir_mask(gh_type type) {
+	u8 wi = gh_ir_wi(type);
+	return wi == 3 ? ~0ULL : (1ULL << (8 << wi)) - 1;
+}
+
+static gh_ir_val gh_ir_insn_new(u32 block, u8 op, gh_type type) {
+	gh_ir_val v = (gh_ir_val) fn->insns.used;
+	PUSH_VEC(fn->insns, ((gh_ir_insn) {
+		.op = op,
+		.type = (u8) type,
+		.block = block,
+	}));
+	return v;
+}
+
+static void gh_ir_link_tail(gh_ir_val v) {
+	gh_ir_block *b = BLOCK(INSN(v)->block);
+	if (b->last)
+		INSN(b->last)->next = v;
+	else
+		b->first = v;
+	b->last = v;
+}
+
+static void gh_ir_link_head(gh_ir_val v) {
+	gh_ir_block *b = BLOCK(INSN(v)->block);
+	INSN(v)->next = b->first;
+	b->first = v;
+	if (!b->last)
+		b->last = v;
+}
+
+// Reserves n operands for an instruction
+static gh_list gh_ir_list(u32 n) {
+	gh_list list = { .start = (u32) fn->extra.used, .len = n };
+	if (fn->extra.size - fn->extra.used < n)
+		GROW_VEC(fn->extra, fn->extra.size + n);
+	fn->extra.used += n;
+	return list;
+}
+
+#define OPERAND(in, i) (fn->extra.data[(in)->list.start + (i)])
+
+/*
+ * Construction, after Braun et al., "Simple and Efficient Construction of
+ * Static Single Assignment Form". The current value of each variable is
+ * kept per block, and a read in a block that doesn't assign the variable
+ * asks its predecessors, placing a phi where they join. A block is sealed
+ * once all of its predecessors are known; reads in a loop header before
+ * that get a phi whose operands are filled in when it is.
+ *
+ * Phis that turn out to be trivial are left for copy propagation to
+ * remove.
+ */
+typedef struct {
+	u32 shadow; // variable of the same name this one hides, + 1
+	gh_type type;
+} gh_ir_var;
+
+DEFINE_VEC(gh_ir_var);
+
+typedef struct {
+	u32 var;
+	u32 block;
+	gh_ir_val val;
+	u32 gen; // the entry is empty unless this is defs_gen
+} gh_ir_def;
+
+static const gh_lexer *toks;
+static const gh_ast_tree *tree;
+static gh_ir_lookup lookup;
+#define NODE(n) gh_ast_get(tree, (n))
+
+static jmp_buf build_end;
+#define BUILD_FAIL() longjmp(build_end, 1)
+
+// Reads that recurse further than this give up rather than risk the C
+// stack, on long chains of blocks that don't assign the variable
+#define IR_MAX_DEPTH 4096
+
+static VEC(gh_ir_var) vars;  // by variable
+static VEC(u32) bound;       // variables in scope, innermost last
+static VEC(u64) scopes;      // bound.used when each open scope was entered
+static u32 *heads;           // innermost variable of each name + 1
+static u64 nheads;
+static VEC(u32) stack;       // pending nodes and call arguments
+static gh_ir_def *defs;      // open addressing on (var, block)
+static u64 defs_size;
+static u64 defs_used;
+static u32 defs_gen;
+static u32 depth;
+static u32 cur;              // block being appended to
+static gh_type ret_type;
+
+// Set by each gh_ir_expr: the value is left in the register the way the
+// op computing it leaves it, rather than the way a load leaves it
+static u8 raw;
+
+void gh_ir_begin(const gh_lexer *lx, const gh_ast_tree *t, gh_ir_lookup l) {
+	toks = lx;
+	tree = t;
+	lookup = l;
+	vars = INIT_VEC(gh_ir_var);
+	bound = INIT_VEC(u32);
+	scopes = INIT_VEC(u64);
+	stack = INIT_VEC(u32);
+	nheads = lx->strs.used + 1;
+	heads = gh_malloc(nheads * sizeof(u32));
+	memset(heads, 0, nheads * sizeof(u32));
+	defs_size = 1024;
+	defs = gh_malloc(defs_size * sizeof(gh_ir_def));
+	memset(defs, 0, defs_size * sizeof(gh_ir_def));
+	defs_gen = 0;
+}
+
+void gh_ir_end(void) {
+	FREE_VEC(vars);
+	FREE_VEC(bound);
+	FREE_VEC(scopes);
+	FREE_VEC(stack);
+	gh_free(heads);
+	gh_free(defs);
+	heads = NULL;
+	defs = NULL;
+}
+
+static u64 gh_ir_def_hash(u32 var, u32 block) {
+	u64 h = (u64) var * 0x9e3779b97f4a7c15ULL ^ (u64) block * 0xc2b2ae3d27d4eb4fULL;
+	return h ^ (h >> 32);
+}
+
+// Entries of older builds count as empty. Nothing is ever deleted within
+// a build, so a probe can stop at the first one.
+static gh_ir_def *gh_ir_def_slot(u32 var, u32 block) {
+	u64 mask = defs_size - 1;
+	for (u64 i = gh_ir_def_hash(var, block) & mask;; i = (i + 1) & mask) {
+		gh_ir_def *d = &defs[i];
+		if (d->gen != defs_gen || (d->var == var && d->block == block))
+			return d;
+	}
+}
+
+static void gh_ir_write(u32 var, u32 block, gh_ir_val val) {
+	if ((defs_used + 1) * 2 > defs_size) {
+		gh_ir_def *old = defs;
+		u64 old_size = defs_size;
+		defs_size *= 2;
+		defs = gh_malloc(defs_size * sizeof(gh_ir_def));
+		memset(defs, 0, defs_size * sizeof(gh_ir_def));
+		for (u64 i = 0; i < old_size; i++)
+			if (old[i].gen == defs_gen)
+				*gh_ir_def_slot(old[i].var, old[i].block) = old[i];
+		gh_free(old);
+	}
+	gh_ir_def *d = gh_ir_def_slot(var, block);
+	if (d->gen != defs_gen)
+		defs_used++;
+	*d = (gh_ir_def) { .var = var, .block = block, .val = val, .gen = defs_gen };
+}
+
+static gh_ir_val gh_ir_emit(u8 op, gh_type type, gh_ir_val a, gh_ir_val b, u64 imm) {
+	gh_ir_val v = gh_ir_insn_new(cur, op, type);
+	INSN(v)->arg[0] = a;
+	INSN(v)->arg[1] = b;
+	INSN(v)->imm = imm;
+	gh_ir_link_tail(v);
+	return v;
+}
+
+static gh_ir_val gh_ir_const(gh_type type, u64 imm) {
+	return gh_ir_emit(GH_IR_CONST, type, 0, 0, imm & gh_ir_mask(type));
+}
+
+static u32 gh_ir_block_new(void) {
+	u32 b = (u32) fn->blocks.used;
+	APPEND_VEC(fn->blocks, ((gh_ir_block) { .preds = NULL_VEC(u32) }));
+	return b;
+}
+
+static void gh_ir_edge(u32 from, u32 to) {
+	gh_ir_block *b = BLOCK(from);
+	b->succ[b->nsucc++] = to;
+	APPEND_VEC(BLOCK(to)->preds, from);
+}
+
+static void gh_ir_jmp(u32 to) {
+	(void) gh_ir_emit(GH_IR_JMP, GH_TOK_KW_UNIT, 0, 0, 0);
+	gh_ir_edge(cur, to);
+}
+
+static void gh_ir_br(gh_ir_val cond, u32 t, u32 f) {
+	(void) gh_ir_emit(GH_IR_BR, GH_TOK_KW_UNIT, cond, 0, 0);
+	gh_ir_edge(cur, t);
+	gh_ir_edge(cur, f);
+}
+
+static gh_ir_val gh_ir_read(u32 var, u32 block);
+
+static void gh_ir_phi_operands(gh_ir_val phi) {
+	u32 block = INSN(phi)->block;
+	u32 var = (u32) INSN(phi)->imm;
+	gh_list list = gh_ir_list((u32) BLOCK(block)->preds.used);
+	INSN(phi)->list = list;
+	for (u32 i = 0; i < list.len; i++) {
+		gh_ir_val v = gh_ir_read(var, BLOCK(block)->preds.data[i]);
+		fn->extra.data[list.start + i] = v;
+	}
+}
+
+static gh_ir_val gh_ir_phi(u32 var, u32 block) {
+	gh_ir_val v = gh_ir_insn_new(block, GH_IR_PHI, vars.data[var].type);
+	INSN(v)->imm = var;
+	gh_ir_link_head(v);
+	return v;
+}
+
+static gh_ir_val gh_ir_read(u32 var, u32 block) {
+	gh_ir_def *d = gh_ir_def_slot(var, block);
+	if (d->gen == defs_gen)
+		return d->val;
+	if (++depth > IR_MAX_DEPTH)
+		BUILD_FAIL();
+
+	gh_ir_val v;
+	u64 npreds = BLOCK(block)->preds.used;
+	if (!BLOCK(block)->sealed) {
+		v = gh_ir_phi(var, block);
+	} else if (npreds == 1) {
+		v = gh_ir_read(var, BLOCK(block)->preds.data[0]);
+	} else if (npreds == 0) {
+		// Only in unreachable code after a return, which is dropped
+		v = gh_ir_insn_new(block, GH_IR_CONST, vars.data[var].type);
+		gh_ir_link_head(v);
+	} else {
+		v = gh_ir_phi(var, block);
+		gh_ir_write(var, block, v);
+		gh_ir_phi_operands(v);
+	}
+	depth--;
+	gh_ir_write(var, block, v);
+	return v;
+}
+
+static void gh_ir_seal(u32 block) {
+	for (gh_ir_val v = BLOCK(block)->first; v && INSN(v)->op == GH_IR_PHI; v = INSN(v)->next)
+		if (!INSN(v)->list.len)
+			gh_ir_phi_operands(v);
+	BLOCK(block)->sealed = 1;
+}
+
+static void gh_ir_enter_scope(void) {
+	APPEND_VEC(scopes, bound.used);
+}
+
+static void gh_ir_leave_scope(void) {
+	u64 start = scopes.data[--scopes.used];
+	while (bound.used > start) {
+		u32 var = bound.data[--bound.used];
+		heads[fn->vars.data[var]] = vars.data[var].shadow;
+	}
+}
+
+static u32 gh_ir_declare(u32 key, gh_type type) {
+	u32 var = (u32) fn->vars.used;
+	APPEND_VEC(fn->vars, key);
+	APPEND_VEC(vars, ((gh_ir_var) { .shadow = heads[key], .type = type }));
+	APPEND_VEC(bound, var);
+	heads[key] = var + 1;
+	return var;
+}
+
+// A value of the same width under another type
+static gh_ir_val gh_ir_retype(gh_ir_val v, gh_type type) {
+	if (INSN(v)->type == type)
+		return v;
+	return gh_ir_emit(GH_IR_COPY, type, v, 0, 0);
+}
+
+// The same steps gh_emit_cast takes
+static gh_ir_val gh_ir_cast(gh_ir_val v, gh_type from, gh_type to) {
+	if (!gh_ir_is_int(from) || !gh_ir_is_int(to))
+		BUILD_FAIL();
+	u8 wf = gh_ir_wi(from), wt = gh_ir_wi(to);
+	if (wf == wt)
+		return gh_ir_retype(v, to);
+	if (wt < wf || (wf == 0 && to == GH_TOK_KW_U64))
+		BUILD_FAIL();
+	raw = 1;
+	u8 op = gh_ir_is_signed(from) && gh_ir_is_signed(to) ? GH_IR_SEXT : GH_IR_ZEXT;
+	return gh_ir_emit(op, to, v, 0, 0);
+}
+
+static gh_ir_val gh_ir_expr(gh_node node, gh_type *type);
+
+static gh_ir_val gh_ir_call(const gh_ast *ast, gh_type *type) {
+	gh_ir_callee callee;
+	if (lookup(ast->tok.payload, &callee))
+		BUILD_FAIL();
+	if (*type == GH_TOK_KW_UNIT)
+		*type = callee.ret;
+	else if (callee.ret == GH_TOK_KW_UNIT)
+		BUILD_FAIL(); // the value is whatever the callee left behind
+
+	gh_list args = ast->primary.args;
+	if (args.len != callee.nparams)
+		BUILD_FAIL();
+
+	// Arguments are evaluated last to first, like they are pushed
+	u64 top = stack.used;
+	for (u32 i = args.len; i-- > 0;) {
+		gh_type t = callee.params[i];
+		if (!gh_ir_is_int(t))
+			BUILD_FAIL();
+		gh_ir_val v = gh_ir_expr(gh_ast_nth(tree, args, i), &t);
+		APPEND_VEC(stack, v);
+	}
+
+	gh_ir_val v = gh_ir_emit(callee.sysfun ? GH_IR_SYSFUN : GH_IR_CALL,
+		*type, 0, 0, callee.target);
+	gh_list list = gh_ir_list(args.len);
+	for (u32 i = 0; i < args.len; i++)
+		fn->extra.data[list.start + i] = stack.data[top + args.len - 1 - i];
+	INSN(v)->list = list;
+	stack.used = top;
+	raw = 1;
+	return v;
+}
+
+static gh_ir_val gh_ir_primary(const gh_ast *ast, gh_type *type) {
+	raw = 0;
+	if (ast->tok.kind == GH_TOK_LIT_INT) {
+		if (*type == GH_TOK_KW_UNIT)
+			*type = GH_TOK_KW_I32;
+		if (!gh_ir_is_int(*type))
+			BUILD_FAIL();
+		return gh_ir_const(*type, gh_token_int(toks, ast->tok));
+	}
+	if (ast->tok.kind != GH_TOK_IDENT)
+		BUILD_FAIL();
+
+	u32 var = heads[ast->tok.payload];
+	if (ast->primary.index)
+		BUILD_FAIL();
+	if (ast->primary.call) {
+		if (var)
+			BUILD_FAIL();
+		return gh_ir_call(ast, type);
+	}
+	if (!var--)
+		BUILD_FAIL();
+	gh_type vt = vars.data[var].type;
+	if (*type == GH_TOK_KW_UNIT)
+		*type = vt;
+	return gh_ir_cast(gh_ir_read(var, cur), vt, *type);
+}
+
+static u8 gh_ir_unary_op(enum gh_token_id kind) {
+	switch (kind) {
+		case GH_TOK_MINUS: return GH_IR_SIGN;
+		case GH_TOK_NEG: return GH_IR_NOT;
+		case GH_TOK_BNEG: return GH_IR_BNOT;
+		default: BUILD_FAIL();
+	}
+}
+
+static u8 gh_ir_binary_op(const gh_ast *ast) {
+	switch (ast->type) {
+		case GH_AST_OR: return GH_IR_OR;
+		case GH_AST_AND: return GH_IR_AND;
+		case GH_AST_BOR: return GH_IR_BOR;
+		case GH_AST_BXOR: return GH_IR_BXOR;
+		case GH_AST_BAND: return GH_IR_BAND;
+		default: break;
+	}
+	switch (ast->tok.kind) {
+		case GH_TOK_EQ: return GH_IR_EQ;
+		case GH_TOK_NEQ: return GH_IR_NEQ;
+		case GH_TOK_GT: return GH_IR_GT;
+		case GH_TOK_LT: return GH_IR_LT;
+		case GH_TOK_GEQ: return GH_IR_GE;
+		case GH_TOK_LEQ: return GH_IR_LE;
+		case GH_TOK_LSHIFT: return GH_IR_SHL;
+		case GH_TOK_RSHIFT: return GH_IR_SHR;
+		case GH_TOK_PLUS: return GH_IR_ADD;
+		case GH_TOK_MINUS: return GH_IR_SUB;
+		case GH_TOK_MULT: return GH_IR_MUL;
+		case GH_TOK_DIV: return GH_IR_DIV;
+		case GH_TOK_MODULO: return GH_IR_MOD;
+		default: BUILD_FAIL();
+	}
+}
+
+// Chains are walked iteratively, like gh_emit_unary and gh_emit_branch do
+static gh_ir_val gh_ir_unary(gh_node node, gh_type *type) {
+	u64 top = stack.used;
+	while (NODE(node)->type == GH_AST_UNARY) {
+		APPEND_VEC(stack, node);
+		node = NODE(node)->unary.child;
+	}
+
+	gh_ir_val v = gh_ir_expr(node, type);
+	if (!gh_ir_is_int(*type))
+		BUILD_FAIL();
+	while (stack.used > top) {
+		const gh_ast *ast = NODE(stack.data[--stack.used]);
+		v = gh_ir_emit(gh_ir_unary_op(ast->tok.kind), *type, v, 0, 0);
+		raw = 1;
+	}
+	return v;
+}
+
+// Whether evaluating an expression can be told apart from skipping it:
+// calls and assignments can, and so can division that may trap. The
+// second operand of && and || is skipped by gh_emit_logic, while the IR
+// evaluates both, so it has to be safe to evaluate anyway.
+static int gh_ir_effects(gh_node node, u32 depth) {
+	const gh_ast *ast = NODE(node);
+	if (depth > 64)
+		return 1;
+	switch (ast->type) {
+		case GH_AST_PRIMARY: return ast->primary.call || ast->primary.index;
+		case GH_AST_UNARY: return gh_ir_effects(ast->unary.child, depth + 1);
+		case GH_AST_FACTOR: {
+			const gh_ast *d = NODE(ast->branch.second);
+			if (ast->tok.kind != GH_TOK_MULT && !(d->type == GH_AST_PRIMARY
+					&& d->tok.kind == GH_TOK_LIT_INT && gh_token_int(toks, d->tok)))
+				return 1;
+			break;
+		}
+		default:
+			if (ast->type < GH_AST_OR || ast->type > GH_AST_FACTOR)
+				return 1;
+			break;
+	}
+	return gh_ir_effects(ast->branch.first, depth + 1)
+		|| gh_ir_effects(ast->branch.second, depth + 1);
+}
+
+static gh_ir_val gh_ir_branch(gh_node node, gh_type *type) {
+	u64 top = stack.used;
+	while (NODE(node)->type >= GH_AST_OR && NODE(node)->type <= GH_AST_FACTOR) {
+		APPEND_VEC(stack, node);
+		node = NODE(node)->branch.first;
+	}
+
+	gh_ir_val v = gh_ir_expr(node, type);
+	while (stack.used > top) {
+		const gh_ast *ast = NODE(stack.data[--stack.used]);
+		if (!gh_ir_is_int(*type))
+			BUILD_FAIL();
+		if ((ast->type == GH_AST_AND || ast->type == GH_AST_OR)
+				&& gh_ir_effects(ast->branch.second, 0))
+			BUILD_FAIL();
+		gh_ir_val second = gh_ir_expr(ast->branch.second, type);
+		v = gh_ir_emit(gh_ir_binary_op(ast), *type, v, second, 0);
+		raw = 1;
+	}
+	return v;
+}
+
+static gh_ir_val gh_ir_assgn(const gh_ast *ast, gh_type *type) {
+	u32 var = heads[ast->tok.payload];
+	if (!var-- || ast->assgn.index)
+		BUILD_FAIL();
+	gh_type vt = vars.data[var].type;
+	if (*type == GH_TOK_KW_UNIT)
+		*type = vt;
+	// gh_emit_assgn stores at the width of the expression
+	if (!gh_ir_is_int(*type) || gh_ir_wi(*type) != gh_ir_wi(vt))
+		BUILD_FAIL();
+
+	gh_ir_val v;
+	if (ast->assgn.op == GH_TOK_ASSIGN) {
+		v = gh_ir_expr(ast->assgn.expr, type);
+	} else {
+		u8 op;
+		switch (ast->assgn.op) {
+			case GH_TOK_PLUS_ASSIGN: op = GH_IR_ADD; break;
+			case GH_TOK_MINUS_ASSIGN: op = GH_IR_SUB; break;
+			case GH_TOK_MULT_ASSIGN: op = GH_IR_MUL; break;
+			case GH_TOK_DIV_ASSIGN: op = GH_IR_DIV; break;
+			default: BUILD_FAIL();
+		}
+		gh_ir_val old = gh_ir_retype(gh_ir_read(var, cur), *type);
+		gh_ir_val rhs = gh_ir_expr(ast->assgn.expr, type);
+		v = gh_ir_emit(op, *type, old, rhs, 0);
+		raw = 1;
+	}
+	gh_ir_write(var, cur, gh_ir_retype(v, vt));
+	return v;
+}
+
+// The value of an expression, with type flowing down from the context
+// exactly as in gh_emit_expr. The value has the type *type ends up as.
+static gh_ir_val gh_ir_expr(gh_node node, gh_type *type) {
+	const gh_ast *ast = NODE(node);
+	switch (ast->type) {
+		case GH_AST_ASSGN: return gh_ir_assgn(ast, type);
+		case GH_AST_OR:       case GH_AST_AND:
+		case GH_AST_BOR:      case GH_AST_BXOR:
+		case GH_AST_BAND:     case GH_AST_COMPARE:
+		case GH_AST_RELATION: case GH_AST_SHIFTER:
+		case GH_AST_ADDER:    case GH_AST_FACTOR:
+			return gh_ir_branch(node, type);
+		case GH_AST_UNARY: return gh_ir_unary(node, type);
+		case GH_AST_PRIMARY: return gh_ir_primary(ast, type);
+		default: BUILD_FAIL();
+	}
+}
+
+static gh_ir_val gh_ir_cond(gh_node node) {
+	gh_type type = GH_TOK_KW_UNIT;
+	gh_ir_val v = gh_ir_expr(node, &type);
+	if (!gh_ir_is_int(type))
+		BUILD_FAIL();
+	return v;
+}
+
+static void gh_ir_statements(gh_list list);
+
+static void gh_ir_body(gh_list list) {
+	gh_ir_enter_scope();
+	gh_ir_statements(list);
+	gh_ir_leave_scope();
+}
+
+static void gh_ir_var_decl(const gh_ast *ast) {
+	gh_type type = ast->var.type;
+	gh_ir_val v = 0;
+	if (ast->var.len)
+		BUILD_FAIL();
+	if (ast->var.expr)
+		v = gh_ir_expr(ast->var.expr, &type);
+	if (!gh_ir_is_int(type))
+		BUILD_FAIL();
+	if (!v)
+		v = gh_ir_const(type, 0);
+	gh_ir_write(gh_ir_declare(ast->tok.payload, type), cur, v);
+}
+
+static void gh_ir_if(const gh_ast *ast) {
+	u32 end = gh_ir_block_new();
+	for (; ast; ast = ast->ifexpr.endif ? NODE(ast->ifexpr.endif) : NULL) {
+		if (!ast->ifexpr.expr) {
+			gh_ir_body(ast->ifexpr.block);
+			gh_ir_jmp(end);
+			break;
+		}
+		gh_ir_val cond = gh_ir_cond(ast->ifexpr.expr);
+		u32 then = gh_ir_block_new(), other = gh_ir_block_new();
+		gh_ir_br(cond, then, other);
+		gh_ir_seal(then);
+		gh_ir_seal(other);
+
+		cur = then;
+		gh_ir_body(ast->ifexpr.block);
+		gh_ir_jmp(end);
+		cur = other;
+		if (!ast->ifexpr.endif)
+			gh_ir_jmp(end);
+	}
+	gh_ir_seal(end);
+	cur = end;
+}
+
+static void gh_ir_while(const gh_ast *ast) {
+	u32 top = gh_ir_block_new();
+	gh_ir_jmp(top);
+	cur = top;
+	gh_ir_val cond = gh_ir_cond(ast->whileexpr.expr);
+	u32 body = gh_ir_block_new(), end = gh_ir_block_new();
+	gh_ir_br(cond, body, end);
+	gh_ir_seal(body);
+
+	cur = body;
+	gh_ir_body(ast->whileexpr.block);
+	gh_ir_jmp(top);
+	gh_ir_seal(top);
+	gh_ir_seal(end);
+	cur = end;
+}
+
+static void gh_ir_return(const gh_ast *ast) {
+	// gh_emit_return leaves main with RET, and a bare return leaves
+	// whatever was in the register
+	if (fn->is_main)
+		BUILD_FAIL();
+	if (ast->returnexpr.expr) {
+		if (ret_type == GH_TOK_KW_UNIT)
+			BUILD_FAIL();
+		gh_type type = GH_TOK_KW_UNIT;
+		gh_ir_val v = gh_ir_expr(ast->returnexpr.expr, &type);
+		v = gh_ir_cast(v, type, ret_type);
+		(void) gh_ir_emit(GH_IR_RET, GH_TOK_KW_UNIT, v, 0, raw);
+	} else {
+		if (ret_type != GH_TOK_KW_UNIT)
+			BUILD_FAIL();
+		(void) gh_ir_emit(GH_IR_RET, GH_TOK_KW_UNIT, 0, 0, 0);
+	}
+
+	// Anything up to the next join is unreachable
+	cur = gh_ir_block_new();
+	gh_ir_seal(cur);
+}
+
+static void gh_ir_statement(gh_node node) {
+	const gh_ast *ast = NODE(node);
+	switch (ast->type) {
+		case GH_AST_VAR: gh_ir_var_decl(ast); break;
+		case GH_AST_IF: gh_ir_if(ast); break;
+		case GH_AST_MATCH: BUILD_FAIL(); // dispatched by gh_emit_match
+		case GH_AST_WHILE: gh_ir_while(ast); break;
+		case GH_AST_RETURN: gh_ir_return(ast); break;
+		case GH_AST_BLOCK: gh_ir_body(ast->block.block); break;
+		default: (void) gh_ir_expr(node, &(gh_type){GH_TOK_KW_UNIT}); break;
+	}
+}
+
+static void gh_ir_statements(gh_list list) {
+	for (u32 i = 0; i < list.len; i++)
+		gh_ir_statement(gh_ast_nth(tree, list, i));
+}
+
+static void gh_ir_prune(void);
+
+int gh_ir_build(gh_ir_fun *f, const gh_ast *fun, u8 is_main) {
+	*f = (gh_ir_fun) {
+		.insns = INIT_VEC(gh_ir_insn),
+		.blocks = INIT_VEC(gh_ir_block),
+		.extra = INIT_VEC(u32),
+		.vars = INIT_VEC(u32),
+		.order = INIT_VEC(u32),
+		.name = fun->tok.payload,
+		.is_main = is_main,
+	};
+	fn = f;
+	ret_type = fun->fun.type;
+	vars.used = 0;
+	defs_gen++;
+	defs_used = 0;
+	depth = 0;
+	if (setjmp(build_end)) {
+		while (scopes.used)
+			gh_ir_leave_scope();
+		stack.used = 0;
+		gh_ir_deinit(f);
+		return -1;
+	}
+
+	(void) gh_ir_insn_new(0, GH_IR_NOP, GH_TOK_KW_UNIT); // value 0
+	cur = gh_ir_block_new();
+	gh_ir_seal(cur);
+
+	gh_ir_enter_scope();
+	gh_list params = fun->fun.params;
+	i64 offset = 16; // skip base pointer and instruction pointer
+	for (u32 i = 0; i < params.len; i++) {
+		const gh_ast *param = NODE(gh_ast_nth(tree, params, i));
+		gh_type type = param->param.type;
+		if (!gh_ir_is_int(type))
+			BUILD_FAIL();
+		gh_ir_val v = gh_ir_emit(GH_IR_PARAM, type, 0, 0, (u64) offset);
+		gh_ir_write(gh_ir_declare(param->tok.payload, type), cur, v);
+		offset += 1 << gh_ir_wi(type);
+	}
+	f->params = (u64) offset - 16;
+
+	gh_ir_statements(fun->fun.block);
+	if (is_main) {
+		(void) gh_ir_emit(GH_IR_EXIT, GH_TOK_KW_UNIT, 0, 0, 0);
+	} else {
+		gh_ir_val zero = gh_ir_const(GH_TOK_KW_I64, 0);
+		(void) gh_ir_emit(GH_IR_RET, GH_TOK_KW_UNIT, zero, 0, 0);
+	}
+	gh_ir_leave_scope();
+
+	gh_ir_prune();
+	return 0;
+}
+
+void gh_ir_deinit(gh_ir_fun *f) {
+	LOOP_VEC(f->blocks, b, {
+		if (!VEC_IS_NULL(b->preds))
+			FREE_VEC(b->preds);
+	});
+	FREE_VEC(f->insns);
+	FREE_VEC(f->blocks);
+	FREE_VEC(f->extra);
+	FREE_VEC(f->vars);
+	FREE_VEC(f->order);
+}
+
+/*
+ * Passes
+ */
+#define LOOP_INSNS(b, v) \
+	for (gh_ir_val v = BLOCK(b)->first; v; v = INSN(v)->next)
+
+#define LOOP_ORDER(b) \
+	for (u64 _i = 0, b; _i < fn->order.used && (b = fn->order.data[_i], 1); _i++)
+
+static int gh_ir_is_term(u8 op) {
+	return op >= GH_IR_JMP;
+}
+
+// Orders the reachable blocks, and drops the others along with their
+// edges into reachable ones
+static void gh_ir_prune(void) {
+	u64 n = fn->blocks.used;
+	u32 *post = gh_malloc(n * sizeof(u32));
+	u32 *walk = gh_malloc(n * sizeof(u32));
+	u8 *next = gh_malloc(n);
+	u64 npost = 0, top = 0;
+
+	walk[top++] = 0;
+	next[0] = 0;
+	BLOCK(0)->reachable = 1;
+	while (top) {
+		u32 b = walk[top - 1];
+		if (next[b] < BLOCK(b)->nsucc) {
+			u32 s = BLOCK(b)->succ[next[b]++];
+			if (!BLOCK(s)->reachable) {
+				BLOCK(s)->reachable = 1;
+				next[s] = 0;
+				walk[top++] = s;
+			}
+		} else {
+			post[npost++] = b;
+			top--;
+		}
+	}
+
+	fn->order.used = 0;
+	GROW_VEC(fn->order, npost);
+	for (u64 i = npost; i-- > 0;) {
+		BLOCK(post[i])->rpo = (u32) fn->order.used;
+		APPEND_VEC_RAW(fn->order, post[i]);
+	}
+	gh_free(post);
+	gh_free(walk);
+	gh_free(next);
+
+	for (u64 b = 0; b < n; b++) {
+		gh_ir_block *block = BLOCK(b);
+		if (!block->reachable) {
+			LOOP_INSNS(b, v)
+				INSN(v)->op = GH_IR_NOP;
+			continue;
+		}
+
+		// Phi operands follow the predecessors they come from
+		u64 kept = 0;
+		for (u64 i = 0; i < block->preds.used; i++) {
+			if (!BLOCK(block->preds.data[i])->reachable)
+				continue;
+			LOOP_INSNS(b, v) {
+				if (INSN(v)->op != GH_IR_PHI)
+					break;
+				OPERAND(INSN(v), kept) = OPERAND(INSN(v), i);
+			}
+			block->preds.data[kept++] = block->preds.data[i];
+		}
+		block->preds.used = kept;
+		LOOP_INSNS(b, v) {
+			if (INSN(v)->op != GH_IR_PHI)
+				break;
+			INSN(v)->list.len = (u32) kept;
+		}
+	}
+}
+
+static gh_ir_val gh_ir_resolve(gh_ir_val v) {
+	while (v && INSN(v)->op == GH_IR_COPY)
+		v = INSN(v)->arg[0];
+	return v;
+}
+
+// Phis whose operands are all one value, or the phi itself, are copies of
+// that value. Removing one can make others trivial, so this runs until
+// nothing changes, which leaves minimal SSA for the structured control
+// flow Galach has.
+static void gh_ir_copyprop(void) {
+	int changed;
+	do {
+		changed = 0;
+		LOOP_ORDER(b) {
+			LOOP_INSNS(b, v) {
+				gh_ir_insn *in = INSN(v);
+				if (in->op == GH_IR_NOP)
+					continue;
+				if (in->op != GH_IR_PHI)
+					break;
+				gh_ir_val same = 0;
+				u32 i;
+				for (i = 0; i < in->list.len; i++) {
+					gh_ir_val op = gh_ir_resolve(OPERAND(in, i));
+					if (op == v || op == same)
+						continue;
+					if (same)
+						break;
+					same = op;
+				}
+				if (i < in->list.len || !same)
+					continue;
+				in->op = GH_IR_COPY;
+				in->arg[0] = same;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	LOOP_ORDER(b) {
+		LOOP_INSNS(b, v) {
+			gh_ir_insn *in = INSN(v);
+			if (in->op == GH_IR_NOP || in->op == GH_IR_COPY)
+				continue;
+			in->arg[0] = gh_ir_resolve(in->arg[0]);
+			in->arg[1] = gh_ir_resolve(in->arg[1]);
+			for (u32 i = 0; i < in->list.len; i++)
+				OPERAND(in, i) = gh_ir_resolve(OPERAND(in, i));
+		}
+	}
+	LOOP_ORDER(b) {
+		LOOP_INSNS(b, v) {
+			if (INSN(v)->op == GH_IR_COPY) {
+				INSN(v)->op = GH_IR_NOP;
+				fn->ncopies++;
+			}
+		}
+	}
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm",
+// then a walk of the dominator tree numbering each block on the way down
+// and up, so dominance is two comparisons
+static void gh_ir_dominators(void) {
+	const u32 none = (u32) -1;
+	u64 n = fn->blocks.used;
+	LOOP_VEC(fn->blocks, b, { b->idom = none; });
+	BLOCK(0)->idom = 0;
+
+	int changed;
+	do {
+		changed = 0;
+		for (u64 i = 1; i < fn->order.used; i++) {
+			gh_ir_block *b = BLOCK(fn->order.data[i]);
+			u32 idom = none;
+			LOOP_VEC(b->preds, pred, {
+				u32 p = *pred;
+				if (BLOCK(p)->idom == none)
+					continue;
+				if (idom == none) {
+					idom = p;
+					continue;
+				}
+				while (p != idom) {
+					while (BLOCK(p)->rpo > BLOCK(idom)->rpo)
+						p = BLOCK(p)->idom;
+					while (BLOCK(idom)->rpo > BLOCK(p)->rpo)
+						idom = BLOCK(idom)->idom;
+				}
+			});
+			if (b->idom != idom) {
+				b->idom = idom;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	u32 *child = gh_malloc(n * sizeof(u32));
+	u32 *sibling = gh_malloc(n * sizeof(u32));
+	u32 *walk = gh_malloc(n * sizeof(u32));
+	for (u64 b = 0; b < n; b++)
+		child[b] = sibling[b] = none;
+	for (u64 i = fn->order.used; i-- > 1;) {
+		u32 b = fn->order.data[i], idom = BLOCK(b)->idom;
+		sibling[b] = child[idom];
+		child[idom] = b;
+	}
+
+	u32 counter = 0, top = 0;
+	walk[top++] = 0;
+	BLOCK(0)->pre = counter++;
+	while (top) {
+		u32 b = walk[top - 1];
+		u32 c = child[b];
+		if (c != none) {
+			child[b] = sibling[c];
+			BLOCK(c)->pre = counter++;
+			walk[top++] = c;
+		} else {
+			BLOCK(b)->post = counter++;
+			top--;
+		}
+	}
+	gh_free(child);
+	gh_free(sibling);
+	gh_free(walk);
+}
+
+static int gh_ir_dominates(u32 a, u32 b) {
+	return BLOCK(a)->pre <= BLOCK(b)->pre && BLOCK(b)->post <= BLOCK(a)->post;
+}
+
+static int gh_ir_is_pure(u8 op) {
+	return op == GH_IR_CONST || (op >= GH_IR_ZEXT && op <= GH_IR_GE);
+}
+
+static int gh_ir_commutes(u8 op) {
+	switch (op) {
+		case GH_IR_ADD: case GH_IR_MUL:
+		case GH_IR_BAND: case GH_IR_BXOR: case GH_IR_BOR:
+		case GH_IR_AND: case GH_IR_OR:
+		case GH_IR_EQ: case GH_IR_NEQ: return 1;
+		default: return 0;
+	}
+}
+
+static u64 gh_ir_vn_hash(const gh_ir_insn *in) {
+	u64 h = in->op | (u64) in->type << 8;
+	h = h * 0x9e3779b97f4a7c15ULL ^ in->arg[0];
+	h = h * 0x9e3779b97f4a7c15ULL ^ in->arg[1];
+	h = h * 0x9e3779b97f4a7c15ULL ^ in->imm;
+	return h ^ (h >> 29);
+}
+
+static int gh_ir_vn_equal(const gh_ir_insn *a, const gh_ir_insn *b) {
+	return a->op == b->op && a->type == b->type && a->imm == b->imm
+		&& a->arg[0] == b->arg[0] && a->arg[1] == b->arg[1];
+}
+
+// Pure values are numbered by their op, type and operands, in reverse
+// postorder so operands are numbered before their uses. A value equal to
+// one in a dominating position becomes a copy of it.
+static void gh_ir_gvn(void) {
+	u64 size = 64;
+	while (size < fn->insns.used * 2)
+		size *= 2;
+	u64 mask = size - 1;
+	gh_ir_val *table = gh_malloc(size * sizeof(gh_ir_val));
+	memset(table, 0, size * sizeof(gh_ir_val));
+
+	LOOP_ORDER(b) {
+		LOOP_INSNS(b, v) {
+			gh_ir_insn *in = INSN(v);
+			if (!gh_ir_is_pure(in->op))
+				continue;
+			in->arg[0] = gh_ir_resolve(in->arg[0]);
+			in->arg[1] = gh_ir_resolve(in->arg[1]);
+			if (gh_ir_commutes(in->op) && in->arg[0] > in->arg[1]) {
+				gh_ir_val tmp = in->arg[0];
+				in->arg[0] = in->arg[1];
+				in->arg[1] = tmp;
+			}
+
+			u64 i = gh_ir_vn_hash(in) & mask;
+			for (; table[i]; i = (i + 1) & mask)
+				if (gh_ir_vn_equal(INSN(table[i]), in))
+					break;
+			if (table[i] && gh_ir_dominates(INSN(table[i])->block, b)) {
+				in->op = GH_IR_COPY;
+				in->arg[0] = table[i];
+				in->arg[1] = 0;
+				fn->nvn++;
+			} else {
+				table[i] = v;
+			}
+		}
+	}
+	gh_free(table);
+}
+
+static int gh_ir_is_const(gh_ir_val v, u64 *imm) {
+	if (INSN(v)->op != GH_IR_CONST)
+		return 0;
+	*imm = INSN(v)->imm;
+	return 1;
+}
+
+// Division by zero stops the VM, so a division is only dead if its
+// divisor is a nonzero constant
+static int gh_ir_may_trap(const gh_ir_insn *in) {
+	u64 d;
+	if (in->op != GH_IR_DIV && in->op != GH_IR_MOD)
+		return 0;
+	return !gh_ir_is_const(in->arg[1], &d) || !d;
+}
+
+static void gh_ir_dce(void) {
+	u8 *live = gh_malloc(fn->insns.used);
+	memset(live, 0, fn->insns.used);
+	MAKE_VEC(u32, work);
+
+	LOOP_ORDER(b) {
+		LOOP_INSNS(b, v) {
+			gh_ir_insn *in = INSN(v);
+			if (in->op == GH_IR_CALL || in->op == GH_IR_SYSFUN
+					|| gh_ir_is_term(in->op) || gh_ir_may_trap(in)) {
+				live[v] = 1;
+				PUSH_VEC(work, v);
+			}
+		}
+	}
+
+	#define MARK(x) do { \
+		gh_ir_val _x = (x); \
+		if (_x && !live[_x]) { \
+			live[_x] = 1; \
+			PUSH_VEC(work, _x); \
+		} \
+	} while (0)
+	while (work.used) {
+		gh_ir_insn *in = INSN(work.data[--work.used]);
+		MARK(in->arg[0]);
+		MARK(in->arg[1]);
+		for (u32 i = 0; i < in->list.len; i++)
+			MARK(OPERAND(in, i));
+	}
+	#undef MARK
+
+	LOOP_ORDER(b) {
+		LOOP_INSNS(b, v) {
+			if (!live[v] && INSN(v)->op != GH_IR_NOP) {
+				INSN(v)->op = GH_IR_NOP;
+				fn->ndead++;
+			}
+		}
+	}
+	FREE_VEC(work);
+	gh_free(live);
+}
+
+// Takes removed instructions out of the block lists
+static void gh_ir_unlink(void) {
+	LOOP_ORDER(b) {
+		gh_ir_block *block = BLOCK(b);
+		gh_ir_val prev = 0;
+		LOOP_INSNS(b, v) {
+			if (INSN(v)->op == GH_IR_NOP)
+				continue;
+			if (prev)
+				INSN(prev)->next = v;
+			else
+				block->first = v;
+			prev = v;
+		}
+		INSN(prev)->next = 0; // the terminator is never removed
+		block->last = prev;
+	}
+}
+
+void gh_ir_optimize(gh_ir_fun *f) {
+	fn = f;
+	gh_ir_copyprop();
+	gh_ir_dominators();
+	gh_ir_gvn();
+	gh_ir_copyprop();
+	gh_ir_dce();
+	gh_ir_unlink();
+}
+
+/*
+ * Lowering. Every value that has to outlive its computation gets a frame
+ * slot of its own, and a phi's slot is written at the end of each
+ * predecessor. Constants and parameters are loaded where they are used,
+ * and so are pure values used once, later in the same block: they are
+ * computed right at the use, as an expression tree, the way the direct
+ * codegen would.
+ *
+ * Values are computed at their type's width, and every op reads its
+ * operands masked to that width, so whatever the register holds above it
+ * doesn't matter, with one exception: a return hands the whole register
+ * to the caller, which may read it at a wider type. GH_IR_RET records
+ * whether the direct codegen would have returned the value as an op left
+ * it, or as a load left it, zero-extended, and lowering reproduces that.
+ */
+#define MAX_TREE_DEPTH 64
+
+typedef struct {
+	u64 pos; // of the address operand
+	u32 block;
+} gh_ir_fixup;
+
+DEFINE_VEC(gh_ir_fixup);
+
+static gh_bytecode *bc;
+static i64 *slots;   // by value, 0 if it has none
+static i64 *temps;   // by phi, for moves that have to go through a temporary
+static u32 *nuses;
+static gh_ir_val *user; // the last use of each value
+static u8 *deferred; // computed where it is used
+static u8 *height;   // of the expression tree below a value
+static i64 frame;
+static gh_ir_val in_a; // value in the register, 0 if unknown
+static u8 in_a_raw;    // the register holds it as computed, not as loaded
+static u64 *addrs;     // by block
+static VEC(gh_ir_fixup) fixups;
+
+static void emitb(u8 b) {
+	emitb_vec(bc->bytes, b);
+}
+
+static void emitqw(u64 qw) {
+	emitqw_vec(bc->bytes, qw);
+}
+
+static void gh_ir_emit_imm(gh_type type, u64 imm) {
+	switch (gh_ir_wi(type)) {
+		case 0: emitb_vec(bc->bytes, (u8) imm); break;
+		case 1: emitw_vec(bc->bytes, (u16) imm); break;
+		case 2: emitdw_vec(bc->bytes, (u32) imm); break;
+		default: emitqw(imm); break;
+	}
+}
+
+static void gh_ir_patch(u64 pos, u64 qw) {
+	for (u64 i = 0; i < 8; i++)
+		bc->bytes.data[pos + i] = (u8) (qw >> (56 - i * 8));
+}
+
+static void gh_ir_jump_to(u8 op, u32 block) {
+	emitb(op);
+	APPEND_VEC(fixups, ((gh_ir_fixup) { .pos = bc->bytes.used, .block = block }));
+	emitqw(0);
+}
+
+static i64 gh_ir_slot(i64 *slot, gh_type type) {
+	if (!*slot) {
+		frame -= 1 << gh_ir_wi(type);
+		*slot = frame;
+	}
+	return *slot;
+}
+
+static void gh_ir_store(gh_ir_val v, i64 *slot) {
+	gh_type type = INSN(v)->type;
+	emitb(GH_VM_MOV_A_OFFSET8 + gh_ir_wi(type));
+	emitqw((u64) gh_ir_slot(slot, type));
+}
+
+static void gh_ir_load_slot(gh_type type, i64 offset) {
+	emitb(GH_VM_MOV_OFFSET_A8 + gh_ir_wi(type));
+	emitqw((u64) offset);
+}
+
+static void gh_ir_compute(gh_ir_val v);
+
+static void gh_ir_load(gh_ir_val v) {
+	if (v == in_a)
+		return ;
+	const gh_ir_insn *in = INSN(v);
+	if (in->op == GH_IR_CONST) {
+		emitb(GH_VM_MOV_IMM_A8 + gh_ir_wi(in->type));
+		gh_ir_emit_imm(in->type, in->imm);
+	} else if (in->op == GH_IR_PARAM) {
+		gh_ir_load_slot(in->type, (i64) in->imm);
+	} else if (slots[v]) {
+		gh_ir_load_slot(in->type, slots[v]);
+	} else {
+		gh_ir_compute(v);
+		return ;
+	}
+	in_a = v;
+	in_a_raw = 0;
+}
+
+static const u8 ir_vm_ops[] = {
+	[GH_IR_SIGN] = GH_VM_SIGN_A8,  [GH_IR_NOT] = GH_VM_NEG_A8,
+	[GH_IR_BNOT] = GH_VM_BNEG_A8,
+	[GH_IR_ADD] = GH_VM_ADD8,      [GH_IR_SUB] = GH_VM_SUB8,
+	[GH_IR_MUL] = GH_VM_MUL8,      [GH_IR_DIV] = GH_VM_DIV8,
+	[GH_IR_MOD] = GH_VM_MOD8,      [GH_IR_SHL] = GH_VM_LSHIFT8,
+	[GH_IR_SHR] = GH_VM_RSHIFT8,   [GH_IR_BAND] = GH_VM_BAND8,
+	[GH_IR_BXOR] = GH_VM_BXOR8,    [GH_IR_BOR] = GH_VM_BOR8,
+	[GH_IR_AND] = GH_VM_AND8,      [GH_IR_OR] = GH_VM_OR8,
+	[GH_IR_EQ] = GH_VM_SETEQ,      [GH_IR_NEQ] = GH_VM_SETNEQ,
+	[GH_IR_LT] = GH_VM_SETLT,      [GH_IR_GT] = GH_VM_SETGT,
+	[GH_IR_LE] = GH_VM_SETLE,      [GH_IR_GE] = GH_VM_SETGE,
+};
+
+static void gh_ir_compute(gh_ir_val v) {
+	gh_ir_insn in = *INSN(v);
+	u8 wi = gh_ir_wi(in.type);
+	switch (in.op) {
+		case GH_IR_ZEXT: case GH_IR_SEXT: {
+			// Loads zero-extend, or sign-extend with MOV_OFFSET_SX_A
+			gh_ir_val arg = in.arg[0];
+			u8 from = gh_ir_wi(INSN(arg)->type);
+			if (in.op == GH_IR_SEXT && arg != in_a && (INSN(arg)->op == GH_IR_PARAM || slots[arg])) {
+				i64 offset = INSN(arg)->op == GH_IR_PARAM ? (i64) INSN(arg)->imm : slots[arg];
+				emitb(GH_VM_MOV_OFFSET_SX_A8 + from);
+				emitqw((u64) offset);
+				break;
+			}
+			gh_ir_load(arg);
+			if (in.op == GH_IR_SEXT)
+				emitb(GH_VM_SEXT_A8 + from);
+			else if (in_a_raw)
+				emitb(GH_VM_ZEXT_A8 + from);
+			break;
+		}
+		case GH_IR_SIGN: case GH_IR_NOT: case GH_IR_BNOT:
+			gh_ir_load(in.arg[0]);
+			emitb(ir_vm_ops[in.op] + wi);
+			break;
+		case GH_IR_EQ: case GH_IR_NEQ: case GH_IR_LT:
+		case GH_IR_GT: case GH_IR_LE: case GH_IR_GE:
+			gh_ir_load(in.arg[0]);
+			emitb(GH_VM_PUSH8 + wi);
+			gh_ir_load(in.arg[1]);
+			emitb(GH_VM_CMP8 + wi);
+			emitb(ir_vm_ops[in.op]);
+			break;
+		default:
+			gh_ir_load(in.arg[0]);
+			emitb(GH_VM_PUSH8 + wi);
+			gh_ir_load(in.arg[1]);
+			emitb(ir_vm_ops[in.op] + wi);
+			break;
+	}
+	in_a = v;
+	in_a_raw = 1;
+}
+
+static void gh_ir_lower_call(gh_ir_val v) {
+	gh_ir_insn in = *INSN(v);
+	u64 popsize = 0;
+	for (u32 i = in.list.len; i-- > 0;) {
+		gh_ir_val arg = OPERAND(&in, i);
+		gh_ir_load(arg);
+		emitb(GH_VM_PUSH8 + gh_ir_wi(INSN(arg)->type));
+		popsize += 1 << gh_ir_wi(INSN(arg)->type);
+	}
+	emitb(in.op == GH_IR_SYSFUN ? GH_VM_SYSFUN : GH_VM_CALL);
+	emitqw(in.imm);
+	if (popsize) {
+		emitb(GH_VM_ADD_SP);
+		emitqw(popsize);
+	}
+	in_a = v;
+	in_a_raw = 1;
+}
+
+// A call whose value is returned as the callee left it, to a function
+// taking as many bytes of arguments, can reuse the frame like
+// gh_emit_tail_call does
+static int gh_ir_is_tail(gh_ir_val v) {
+	const gh_ir_insn *in = INSN(v);
+	if (in->op != GH_IR_CALL || !in->next)
+		return 0;
+	const gh_ir_insn *ret = INSN(in->next);
+	if (ret->op != GH_IR_RET || ret->arg[0] != v || !ret->imm)
+		return 0;
+	u64 size = 0;
+	for (u32 i = 0; i < in->list.len; i++)
+		size += 1 << gh_ir_wi(INSN(OPERAND(in, i))->type);
+	return size == fn->params;
+}
+
+// Arguments that read a parameter or are computed here go through a
+// temporary, so every one is read before any parameter is written
+static void gh_ir_lower_tail(gh_ir_val v, u64 start) {
+	gh_ir_insn in = *INSN(v);
+	i64 *tmp = gh_malloc((in.list.len + 1) * sizeof(i64));
+	i64 param = 16;
+	for (u32 i = 0; i < in.list.len; i++) {
+		gh_ir_val arg = OPERAND(&in, i);
+		const gh_ir_insn *a = INSN(arg);
+		tmp[i] = 0;
+		if (a->op == GH_IR_PARAM ? (i64) a->imm != param
+				: a->op != GH_IR_CONST && !slots[arg]) {
+			gh_ir_load(arg);
+			gh_ir_store(arg, &tmp[i]);
+		}
+		param += 1 << gh_ir_wi(a->type);
+	}
+
+	param = 16;
+	for (u32 i = 0; i < in.list.len; i++) {
+		gh_ir_val arg = OPERAND(&in, i);
+		const gh_ir_insn *a = INSN(arg);
+		if (tmp[i]) {
+			gh_ir_load_slot(a->type, tmp[i]);
+			in_a = 0;
+		} else if (a->op != GH_IR_PARAM) {
+			gh_ir_load(arg);
+		}
+		if (tmp[i] || a->op != GH_IR_PARAM) {
+			emitb(GH_VM_MOV_A_OFFSET8 + gh_ir_wi(a->type));
+			emitqw((u64) param);
+		}
+		param += 1 << gh_ir_wi(a->type);
+	}
+	gh_free(tmp);
+
+	if (in.imm == start) {
+		emitb(GH_VM_JMP);
+		emitqw(start + 2 + gh_vm_operand_size(GH_VM_ADD_SP));
+	} else {
+		emitb(GH_VM_LEAVE);
+		emitb(GH_VM_JMP);
+		emitqw(in.imm);
+	}
+	bc->ntail++;
+	in_a = 0;
+}
+
+static void gh_ir_lower_ret(const gh_ir_insn *in) {
+	gh_ir_val v = in->arg[0];
+	if (v) {
+		const gh_ir_insn *val = INSN(v);
+		u8 computed = val->op >= GH_IR_ZEXT && val->op <= GH_IR_GE;
+		if (in->imm) {
+			if (computed && !(in_a == v && in_a_raw))
+				gh_ir_compute(v);
+			else
+				gh_ir_load(v);
+		} else if (!(in_a == v && !in_a_raw)) {
+			if (slots[v] || !computed) {
+				in_a = 0;
+				gh_ir_load(v);
+			} else {
+				gh_ir_load(v);
+				if (gh_ir_wi(val->type) < 3)
+					emitb(GH_VM_ZEXT_A8 + gh_ir_wi(val->type));
+			}
+		}
+	}
+	emitb(GH_VM_LEAVE);
+	emitb(GH_VM_RET);
+}
+
+// Writes the phis of to with their operands coming from from. The moves
+// are parallel, so when one reads another phi of the same block, every
+// operand goes through a temporary first.
+static void gh_ir_moves(u32 from, u32 to) {
+	gh_ir_block *b = BLOCK(to);
+	u32 k = 0;
+	while (b->preds.data[k] != from)
+		k++;
+
+	int through_temps = 0;
+	LOOP_INSNS(to, phi) {
+		if (INSN(phi)->op != GH_IR_PHI)
+			break;
+		const gh_ir_insn *src = INSN(OPERAND(INSN(phi), k));
+		if (src->op == GH_IR_PHI && src->block == to && OPERAND(INSN(phi), k) != phi)
+			through_temps = 1;
+	}
+
+	LOOP_INSNS(to, phi) {
+		if (INSN(phi)->op != GH_IR_PHI)
+			break;
+		gh_ir_val src = OPERAND(INSN(phi), k);
+		if (src == phi)
+			continue;
+		gh_ir_load(src);
+		gh_ir_store(phi, through_temps ? &temps[phi] : &slots[phi]);
+	}
+	if (!through_temps)
+		return ;
+	LOOP_INSNS(to, phi) {
+		if (INSN(phi)->op != GH_IR_PHI)
+			break;
+		if (OPERAND(INSN(phi), k) == phi)
+			continue;
+		gh_ir_load_slot(INSN(phi)->type, temps[phi]);
+		gh_ir_store(phi, &slots[phi]);
+	}
+	in_a = 0;
+}
+
+static int gh_ir_has_phis(u32 block) {
+	return INSN(BLOCK(block)->first)->op == GH_IR_PHI;
+}
+
+static void gh_ir_lower_br(const gh_ir_insn *in, u32 b) {
+	u32 t = BLOCK(b)->succ[0], f = BLOCK(b)->succ[1];
+	gh_ir_load(in->arg[0]);
+	u8 jz = GH_VM_JZ8 + gh_ir_wi(INSN(in->arg[0])->type);
+	if (!gh_ir_has_phis(f)) {
+		gh_ir_jump_to(jz, f);
+		if (gh_ir_has_phis(t))
+			gh_ir_moves(b, t);
+		gh_ir_jump_to(GH_VM_JMP, t);
+		return ;
+	}
+
+	emitb(jz);
+	u64 pos = bc->bytes.used;
+	emitqw(0);
+	gh_ir_val cond = in_a;
+	u8 cond_raw = in_a_raw;
+	gh_ir_moves(b, t);
+	gh_ir_jump_to(GH_VM_JMP, t);
+
+	gh_ir_patch(pos, bc->bytes.used);
+	in_a = cond;
+	in_a_raw = cond_raw;
+	gh_ir_moves(b, f);
+	gh_ir_jump_to(GH_VM_JMP, f);
+}
+
+// Decides which values are computed where they are used
+static void gh_ir_plan(void) {
+	LOOP_ORDER(b) {
+		LOOP_INSNS(b, v) {
+			gh_ir_insn *in = INSN(v);
+			#define USE(x) do { \
+				gh_ir_val _x = (x); \
+				if (_x) { \
+					nuses[_x]++; \
+					user[_x] = v; \
+				} \
+			} while (0)
+			USE(in->arg[0]);
+			USE(in->arg[1]);
+			for (u32 i = 0; i < in->list.len; i++)
+				USE(OPERAND(in, i));
+			#undef USE
+		}
+	}
+
+	LOOP_ORDER(b) {
+		LOOP_INSNS(b, v) {
+			gh_ir_insn *in = INSN(v);
+			if (in->op < GH_IR_ZEXT || in->op > GH_IR_GE || gh_ir_may_trap(in))
+				continue;
+			if (nuses[v] != 1 || INSN(user[v])->block != b
+					|| INSN(user[v])->op == GH_IR_PHI)
+				continue;
+			u8 h = 0;
+			for (int i = 0; i < 2; i++)
+				if (in->arg[i] && deferred[in->arg[i]] && height[in->arg[i]] > h)
+					h = height[in->arg[i]];
+			if (h < MAX_TREE_DEPTH) {
+				deferred[v] = 1;
+				height[v] = h + 1;
+			}
+		}
+	}
+}
+
+void gh_ir_lower(gh_ir_fun *f, gh_bytecode *bytecode) {
+	fn = f;
+	bc = bytecode;
+	u64 n = fn->insns.used;
+	slots = gh_malloc(n * sizeof(i64));
+	temps = gh_malloc(n * sizeof(i64));
+	nuses = gh_malloc(n * sizeof(u32));
+	user = gh_malloc(n * sizeof(gh_ir_val));
+	deferred = gh_malloc(n);
+	height = gh_malloc(n);
+	addrs = gh_malloc(fn->blocks.used * sizeof(u64));
+	memset(slots, 0, n * sizeof(i64));
+	memset(temps, 0, n * sizeof(i64));
+	memset(nuses, 0, n * sizeof(u32));
+	memset(deferred, 0, n);
+	memset(height, 0, n);
+	fixups = INIT_VEC(gh_ir_fixup);
+	frame = 0;
+	gh_ir_plan();
+
+	u64 start = bc->bytes.used;
+	emitb(GH_VM_ENTER);
+	emitb(GH_VM_ADD_SP);
+	u64 frame_pos = bc->bytes.used;
+	emitqw(0);
+
+	LOOP_ORDER(b) {
+		addrs[b] = bc->bytes.used;
+		in_a = 0;
+		LOOP_INSNS(b, v) {
+			gh_ir_insn *in = INSN(v);
+			switch (in->op) {
+				case GH_IR_PHI: case GH_IR_CONST:
+				case GH_IR_PARAM: break;
+				case GH_IR_CALL: case GH_IR_SYSFUN:
+					if (gh_ir_is_tail(v)) {
+						gh_ir_lower_tail(v, start);
+						break;
+					}
+					gh_ir_lower_call(v);
+					if (nuses[v])
+						gh_ir_store(v, &slots[v]);
+					break;
+				case GH_IR_JMP:
+					if (gh_ir_has_phis(BLOCK(b)->succ[0]))
+						gh_ir_moves(b, BLOCK(b)->succ[0]);
+					gh_ir_jump_to(GH_VM_JMP, BLOCK(b)->succ[0]);
+					break;
+				case GH_IR_BR: gh_ir_lower_br(in, b); break;
+				case GH_IR_RET:
+					if (!in->arg[0] || INSN(in->arg[0])->next != v
+							|| !gh_ir_is_tail(in->arg[0]))
+						gh_ir_lower_ret(in);
+					break;
+				case GH_IR_EXIT: emitb(GH_VM_EXIT); break;
+				default:
+					if (deferred[v])
+						break;
+					gh_ir_compute(v);
+					if (nuses[v])
+						gh_ir_store(v, &slots[v]);
+					break;
+			}
+		}
+	}
+
+	LOOP_VEC(fixups, fix, {
+		gh_ir_patch(fix->pos, addrs[fix->block]);
+	});
+	gh_ir_patch(frame_pos, (u64) frame);
+
+	FREE_VEC(fixups);
+	gh_free(slots);
+	gh_free(temps);
+	gh_free(nuses);
+	gh_free(user);
+	gh_free(deferred);
+	gh_free(height);
+	gh_free(addrs);
+}
@@ -0,0 +1,127 @@
+#ifndef _GALACH_IR_H
+#define _GALACH_IR_H
+
+#include "types.h"
+#include "token.h"
+#include "ast.h"
+#include "bytecode.h"
+
+/*
+ * A typed SSA form of one function, between the AST and the bytecode.
+ *
+ * Every instruction defines at most one value, and the value is named by
+ * the instruction's index; index 0 means no value. Each value has a type,
+ * which is one of the integer type keywords and fixes the width the VM
+ * computes it at. Instructions belong to basic blocks as linked lists, phis
+ * first and exactly one terminator last. Block 0 is the entry.
+ *
+ * Only what the direct codegen in bytecode.c compiles the same way is
+ * modelled. Anything else makes gh_ir_build give up, and the function is
+ * then emitted directly.
+ */
+
+typedef u32 gh_ir_val;
+
+enum gh_ir_op {
+	GH_IR_NOP,    // removed by a pass
+	GH_IR_CONST,  // imm
+	GH_IR_PARAM,  // imm: offset from the base pointer
+	GH_IR_PHI,    // one operand per predecessor, in order; imm: the variable
+	GH_IR_COPY,   // arg[0], possibly retyped to another type of the same width
+	GH_IR_ZEXT,   // arg[0], extended to a wider type
+	GH_IR_SEXT,
+
+	GH_IR_SIGN,   GH_IR_NOT,   GH_IR_BNOT,
+
+	GH_IR_ADD,    GH_IR_SUB,   GH_IR_MUL,
+	GH_IR_DIV,    GH_IR_MOD,   GH_IR_SHL,
+	GH_IR_SHR,    GH_IR_BAND,  GH_IR_BXOR,
+	GH_IR_BOR,    GH_IR_AND,   GH_IR_OR,
+	GH_IR_EQ,     GH_IR_NEQ,   GH_IR_LT,
+	GH_IR_GT,     GH_IR_LE,    GH_IR_GE,
+
+	GH_IR_CALL,   // operands are the arguments; imm: code address
+	GH_IR_SYSFUN, // operands are the arguments; imm: sysfun index
+
+	// Terminators
+	GH_IR_JMP,    // to succ[0]
+	GH_IR_BR,     // to succ[0] if arg[0] is nonzero, else to succ[1]
+	GH_IR_RET,    // arg[0], optional; imm: set if the value is returned
+	              // as computed rather than as loaded, see gh_ir_lower
+	GH_IR_EXIT,
+};
+
+typedef struct {
+	u8 op;   // enum gh_ir_op
+	u8 type; // enum gh_token_id
+	u32 block;
+	u32 next; // in the block, 0 at the end
+	gh_ir_val arg[2];
+	gh_list list; // phi operands or call arguments, in gh_ir_fun.extra
+	u64 imm;
+} gh_ir_insn;
+
+DEFINE_VEC(gh_ir_insn);
+
+typedef struct {
+	u32 first, last; // instructions
+	u32 succ[2];
+	u8 nsucc;
+	u8 sealed; // all predecessors are known
+	u8 reachable;
+	VEC(u32) preds;
+
+	// Filled in by the passes
+	u32 rpo;  // position in reverse postorder
+	u32 idom; // immediate dominator
+	u32 pre, post; // dominator tree numbering
+} gh_ir_block;
+
+DEFINE_VEC(gh_ir_block);
+
+typedef struct {
+	VEC(gh_ir_insn) insns;
+	VEC(gh_ir_block) blocks;
+	VEC(u32) extra;
+	VEC(u32) vars;  // interned name of each source variable
+	VEC(u32) order; // reachable blocks in reverse postorder
+	u32 name;       // interned function name
+	u64 params;     // bytes of parameters
+	u8 is_main;
+
+	// Pass statistics
+	u64 ncopies; // copies and trivial phis propagated
+	u64 nvn;     // values replaced by an earlier equal one
+	u64 ndead;   // dead values removed
+} gh_ir_fun;
+
+// What a called name refers to. The IR only knows the function's own
+// parameters and variables, so everything else is resolved by the caller.
+typedef struct {
+	u8 sysfun;
+	u64 target; // code address, or sysfun index
+	gh_type ret;
+	const gh_type *params;
+	u64 nparams;
+} gh_ir_callee;
+
+// Returns 0 and fills in callee if key names a function
+typedef int (*gh_ir_lookup)(u32 key, gh_ir_callee *callee);
+
+// Scratch space shared by the builds of one compilation
+void gh_ir_begin(const gh_lexer *lx, const gh_ast_tree *tree, gh_ir_lookup lookup);
+void gh_ir_end(void);
+
+// Returns -1 if the function uses something the IR doesn't model, in which
+// case nothing needs to be freed
+int gh_ir_build(gh_ir_fun *f, const gh_ast *fun, u8 is_main);
+
+// Copy propagation, global value numbering and dead code elimination
+void gh_ir_optimize(gh_ir_fun *f);
+
+// Appends the function's code, from ENTER on, to the end of bc->bytes
+void gh_ir_lower(gh_ir_fun *f, gh_bytecode *bc);
+
+void gh_ir_deinit(gh_ir_fun *f);
+
+#endif // _GALACH_IR_H
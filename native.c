@@ -0,0 +1,142 @@
+#include <string.h>
+#include <dlfcn.h>
+
+#include "native.h"
+#include "token.h"
+#include "vm.h"
+#include "log.h"
+
+DEFINE_VEC(gh_native);
+static VEC(gh_native) natives;
+
+typedef void *gh_module;
+DEFINE_VEC(gh_module);
+static VEC(gh_module) modules;
+
+// The VM's natives go first, whatever is added before it's used
+static void gh_native_init(void) {
+	if (!VEC_IS_NULL(natives))
+		return ;
+	natives = INIT_VEC(gh_native);
+	modules = INIT_VEC(gh_module);
+	gh_vm_add_natives();
+}
+
+// Bytes of an argument on the stack, 0 if it can't be one
+static u8 gh_native_size(gh_type type) {
+	if (type & GH_ARRAY_REF)
+		type &= ~GH_ARRAY_REF;
+	switch (type) {
+		case GH_TOK_KW_I8: case GH_TOK_KW_U8: return 1;
+		case GH_TOK_KW_I16: case GH_TOK_KW_U16: return 2;
+		case GH_TOK_KW_I32: case GH_TOK_KW_U32: case GH_TOK_KW_F32: return 4;
+		case GH_TOK_KW_I64: case GH_TOK_KW_U64: case GH_TOK_KW_F64:
+		case GH_TOK_KW_STR: return 8;
+		default: return 0;
+	}
+}
+
+i64 gh_native_add(const char *name, gh_native_fn fn, gh_type ret,
+		u8 nparams, const gh_type *params) {
+	gh_native_init();
+	if (!name || !*name || !fn || nparams > GH_NATIVE_MAX_PARAMS
+			|| (ret != GH_TOK_KW_UNIT && !gh_native_size(ret)) || (ret & GH_ARRAY_REF))
+		goto bad;
+	LOOP_VEC(natives, nf, {
+		if (!strcmp(nf->name, name)) {
+			gh_log(GH_LOG_ERR, "native \"%s\" is already defined", name);
+			return -1;
+		}
+	});
+
+	gh_native nf = {
+		.fn = fn,
+		.ret = ret,
+		.nparams = nparams,
+	};
+	for (u8 i = 0; i < nparams; i++) {
+		gh_type t = params[i];
+		nf.sizes[i] = gh_native_size(t);
+		if (!nf.sizes[i])
+			goto bad;
+		// An array's elements are integers, and what's passed is a reference
+		if (t & GH_ARRAY_REF) {
+			t &= ~GH_ARRAY_REF;
+			if (t == GH_TOK_KW_F32 || t == GH_TOK_KW_F64 || t == GH_TOK_KW_STR)
+				goto bad;
+			nf.sizes[i] = 8;
+		} else if (t == GH_TOK_KW_I8 || t == GH_TOK_KW_I16 || t == GH_TOK_KW_I32) {
+			nf.signs |= 1 << i;
+		}
+		nf.params[i] = params[i];
+	}
+	u64 len = strlen(name);
+	nf.name = gh_malloc(len + 1);
+	memcpy(nf.name, name, len + 1);
+	APPEND_VEC(natives, nf);
+	return (i64) natives.used - 1;
+
+bad:
+	gh_log(GH_LOG_ERR, "native \"%s\" has a signature natives can't have",
+		name ? name : "");
+	return -1;
+}
+
+u64 gh_native_count(void) {
+	gh_native_init();
+	return natives.used;
+}
+
+const gh_native *gh_native_get(u64 idx) {
+	return idx < natives.used ? &natives.data[idx] : NULL;
+}
+
+static const gh_native_api api = {
+	.add = gh_native_add,
+	.fail = gh_vm_fail,
+	.array = gh_vm_array,
+	.str = gh_vm_str,
+};
+
+int gh_native_load(const char *path) {
+	gh_native_init();
+	void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!lib) {
+		gh_log(GH_LOG_ERR, "dlopen: %s", dlerror());
+		return -1;
+	}
+	gh_native_entry entry;
+	*(void **) &entry = dlsym(lib, GH_NATIVE_ENTRY);
+	if (!entry) {
+		gh_log(GH_LOG_ERR, "%s: no %s function", path, GH_NATIVE_ENTRY);
+		goto e0;
+	}
+	u64 used = natives.used;
+	if (entry(&api)) {
+		gh_log(GH_LOG_ERR, "%s: failed to load", path);
+		goto e1;
+	}
+	APPEND_VEC(modules, lib);
+	return 0;
+
+e1:
+	// What it did add would point into the library
+	while (natives.used > used)
+		gh_free(natives.data[--natives.used].name);
+e0:
+	(void) dlclose(lib);
+	return -1;
+}
+
+void gh_native_deinit(void) {
+	if (VEC_IS_NULL(natives))
+		return ;
+	LOOP_VEC(natives, nf, {
+		gh_free(nf->name);
+	});
+	FREE_VEC(natives);
+	LOOP_VEC(modules, lib, {
+		(void) dlclose(*lib);
+	});
+	FREE_VEC(modules);
+}
@@ -0,0 +1,74 @@
+#ifndef _GALACH_NATIVE_H
+#define _GALACH_NATIVE_H
+
+#include "types.h"
+#include "bytecode.h"
+
+/*
+ * Functions written in C that Galach code calls by name, like the print
+ * and read sysfuns.
+ *
+ * Every native is in scope in every program, and a call to one compiles
+ * to a SYSFUN with its index in the registry. The VM reads the arguments
+ * off the stack into registers, and the function gets them first to last,
+ * each as 64 bits: integers extended by their signedness, floats as their
+ * bits, a str as its view (see GH_VM_MOV_STR_A) and an array as a
+ * reference (see GH_ARRAY_OF). What it returns, in the same form, goes to
+ * the a register.
+ *
+ * The VM's own natives are registered before any other, so indices only
+ * depend on what the host and the loaded modules add, in order.
+ */
+
+struct gh_vm;
+typedef u64 (*gh_native_fn)(struct gh_vm *vm, const u64 *args);
+
+#define GH_NATIVE_MAX_PARAMS 8
+
+// A parameter that is an array of integers of the size of type. The
+// argument has to name an array, and the function gets a reference to it
+// to pass to gh_vm_array.
+#define GH_ARRAY_REF 0x100
+#define GH_ARRAY_OF(type) ((gh_type) ((type) | GH_ARRAY_REF))
+
+typedef struct {
+	char *name;
+	gh_native_fn fn;
+	gh_type ret;
+	u8 nparams;
+	gh_type params[GH_NATIVE_MAX_PARAMS];
+	u8 sizes[GH_NATIVE_MAX_PARAMS]; // bytes each argument takes on the stack
+	u8 signs; // a bit for each argument, set if it's sign-extended
+} gh_native;
+
+// Returns the index of the new native, or -1 if the name is taken or a
+// native can't have that signature
+i64 gh_native_add(const char *name, gh_native_fn fn, gh_type ret,
+	u8 nparams, const gh_type *params);
+
+u64 gh_native_count(void);
+// NULL if there's no native at idx
+const gh_native *gh_native_get(u64 idx);
+
+// What a module gets to register its natives with, and for them to use
+typedef struct {
+	i64 (*add)(const char *name, gh_native_fn fn, gh_type ret,
+		u8 nparams, const gh_type *params);
+	void (*fail)(struct gh_vm *vm, const char *msg);
+	u8 *(*array)(struct gh_vm *vm, u64 ref, u64 size, u32 *len);
+	const u8 *(*str)(struct gh_vm *vm, u64 view, u32 *len);
+} gh_native_api;
+
+// A module is a shared library that exports this, which returns 0 once
+// it has added its natives, or -1 if it couldn't
+#define GH_NATIVE_ENTRY "gh_native_module"
+typedef int (*gh_native_entry)(const gh_native_api *api);
+
+// Loads a module and runs its entry. It stays loaded until
+// gh_native_deinit. Returns -1 if it couldn't be loaded.
+int gh_native_load(const char *path);
+
+// Removes every native and unloads the modules
+void gh_native_deinit(void);
+
+#endif // _GALACH_NATIVE_H
@@ -0,0 +1,526 @@
+#include <inttypes.h>
+
+#include "opt.h"
+#include "vm.h"
+#include "log.h"
+
+/*
+ * The width of an expression is only known during codegen, where it flows
+ * down from the context. Integer literals are kept modulo 2^64 and truncated
+ * to that width when emitted, so a fold is only sound if its result agrees
+ * with the VM at every width:
+ *
+ * - Wrapping arithmetic and bitwise ops (+ - * & | ^ ~ and unary -) are
+ *   congruent at every width, so they always fold.
+ * - The VM shifts at the operand's width, so a shift by that width or more
+ *   gives something different at each one. Shifts only fold by less than 8,
+ *   the narrowest width, and a << by that much is congruent at every width.
+ * - Division, modulo, right shifts, comparisons and logic ops depend on the
+ *   width and signedness. They are folded only when both operands are small
+ *   and non-negative, which reads the same at every width either way.
+ * - At a float type the literals are converted first and the op is done in
+ *   floating point. That agrees as long as nothing needs rounding, except
+ *   for division, so a division is only folded if it is exact.
+ */
+#define SMALL(x) ((x) < 128)
+
+static gh_ast_tree *tree;
+static gh_lexer *toks;
+static u8 *pure; // per node: evaluating it has no side effects
+static u64 nfolds;
+
+#define NODE(n) gh_ast_get(tree, (n))
+
+static int gh_opt_const(gh_node node, u64 *v) {
+	gh_ast *ast = NODE(node);
+	if (ast->type != GH_AST_PRIMARY || ast->tok.kind != GH_TOK_LIT_INT)
+		return 0;
+	*v = gh_token_int(toks, ast->tok);
+	return 1;
+}
+
+static void gh_opt_set_const(gh_node node, u64 v) {
+	gh_ast *ast = NODE(node);
+	u32 payload = (u32) toks->lits.used;
+	APPEND_VEC(toks->lits, v);
+	*ast = (gh_ast) {
+		.type = GH_AST_PRIMARY,
+		.tok = {
+			.offset = ast->tok.offset,
+			.payload = payload,
+			.kind = GH_TOK_LIT_INT,
+		},
+	};
+	pure[node] = 1;
+	nfolds++;
+}
+
+static void gh_opt_replace(gh_node node, gh_node with) {
+	*NODE(node) = *NODE(with);
+	nfolds++;
+}
+
+static int gh_opt_eval_unary(enum gh_token_id op, u64 a, u64 *res) {
+	switch (op) {
+		case GH_TOK_MINUS: *res = -a; return 1;
+		case GH_TOK_BNEG: *res = ~a; return 1;
+		case GH_TOK_NEG:
+			if (a && !SMALL(a))
+				return 0;
+			*res = !a;
+			return 1;
+		default: return 0;
+	}
+}
+
+static int gh_opt_eval_binary(enum gh_token_id op, u64 a, u64 b, u64 *res) {
+	int small = SMALL(a) && SMALL(b);
+	switch (op) {
+		case GH_TOK_PLUS:  *res = a + b; return 1;
+		case GH_TOK_MINUS: *res = a - b; return 1;
+		case GH_TOK_MULT:  *res = a * b; return 1;
+		case GH_TOK_BAND:  *res = a & b; return 1;
+		case GH_TOK_BOR:   *res = a | b; return 1;
+		case GH_TOK_BXOR:  *res = a ^ b; return 1;
+		case GH_TOK_LSHIFT:
+			if (b >= 8)
+				return 0;
+			*res = a << b;
+			return 1;
+		default: break;
+	}
+
+	if (!small)
+		return 0;
+	switch (op) {
+		case GH_TOK_DIV:    if (!b || a % b) return 0; *res = a / b; return 1;
+		case GH_TOK_MODULO: if (!b) return 0; *res = a % b; return 1;
+		case GH_TOK_RSHIFT: if (b >= 8) return 0; *res = a >> b; return 1;
+		case GH_TOK_EQ:  *res = a == b; return 1;
+		case GH_TOK_NEQ: *res = a != b; return 1;
+		case GH_TOK_GT:  *res = a > b; return 1;
+		case GH_TOK_LT:  *res = a < b; return 1;
+		case GH_TOK_GEQ: *res = a >= b; return 1;
+		case GH_TOK_LEQ: *res = a <= b; return 1;
+		case GH_TOK_AND: *res = a && b; return 1;
+		case GH_TOK_OR:  *res = a || b; return 1;
+		default: return 0;
+	}
+}
+
+// x op k, where k is the constant operand. Returns the operand the node
+// reduces to, or 0, and sets *zero if it reduces to the constant 0.
+static gh_node gh_opt_identity(enum gh_token_id op, gh_node x, u64 k,
+		int k_first, int *zero) {
+	*zero = 0;
+	switch (op) {
+		case GH_TOK_PLUS: case GH_TOK_BOR:
+		case GH_TOK_BXOR:
+			return k == 0 ? x : 0;
+		case GH_TOK_MINUS: case GH_TOK_LSHIFT:
+		case GH_TOK_RSHIFT:
+			return !k_first && k == 0 ? x : 0;
+		case GH_TOK_DIV:
+			return !k_first && k == 1 ? x : 0;
+		case GH_TOK_MULT:
+			if (k == 1)
+				return x;
+			fallthrough();
+		case GH_TOK_BAND:
+			// x is dropped, so it may not do anything
+			if (k == 0 && pure[x])
+				*zero = 1;
+			return 0;
+		case GH_TOK_AND:
+			// unless it is never evaluated
+			if (k == 0 && (k_first || pure[x]))
+				*zero = 1;
+			return 0;
+		default: return 0;
+	}
+}
+
+static void gh_opt_fold_branch(gh_node node) {
+	gh_ast *ast = NODE(node);
+	gh_node first = ast->branch.first, second = ast->branch.second;
+	enum gh_token_id op = ast->tok.kind;
+	u64 a = 0, b = 0, res;
+	int ca = gh_opt_const(first, &a), cb = gh_opt_const(second, &b);
+
+	pure[node] = pure[first] && pure[second];
+	if (ca && cb) {
+		if (gh_opt_eval_binary(op, a, b, &res))
+			gh_opt_set_const(node, res);
+		return ;
+	}
+	if (!ca && !cb)
+		return ;
+
+	int zero;
+	gh_node x = ca ? gh_opt_identity(op, second, a, 1, &zero)
+		: gh_opt_identity(op, first, b, 0, &zero);
+	if (zero)
+		gh_opt_set_const(node, 0);
+	else if (x)
+		gh_opt_replace(node, x);
+}
+
+static void gh_opt_fold_unary(gh_node node) {
+	gh_ast *ast = NODE(node);
+	u64 a, res;
+	pure[node] = pure[ast->unary.child];
+	if (gh_opt_const(ast->unary.child, &a)
+			&& gh_opt_eval_unary(ast->tok.kind, a, &res))
+		gh_opt_set_const(node, res);
+}
+
+u64 gh_opt_fold(gh_ast_tree *t, gh_lexer *lx) {
+	tree = t;
+	toks = lx;
+	nfolds = 0;
+	pure = gh_malloc(tree->nodes.used);
+
+	// Operands come before the expressions using them, so one sweep sees
+	// every operand already folded
+	for (gh_node node = 1; node < tree->nodes.used; node++) {
+		gh_ast *ast = NODE(node);
+		switch (ast->type) {
+			case GH_AST_PRIMARY:
+				// An element read can fail its bounds check
+				pure[node] = !ast->primary.call && !ast->primary.index;
+				break;
+			case GH_AST_UNARY: gh_opt_fold_unary(node); break;
+			case GH_AST_OR:       case GH_AST_AND:
+			case GH_AST_BOR:      case GH_AST_BXOR:
+			case GH_AST_BAND:     case GH_AST_COMPARE:
+			case GH_AST_RELATION: case GH_AST_SHIFTER:
+			case GH_AST_ADDER:    case GH_AST_FACTOR:
+				gh_opt_fold_branch(node);
+				break;
+			default: pure[node] = 0; break;
+		}
+	}
+
+	gh_free(pure);
+	pure = NULL;
+	return nfolds;
+}
+
+/*
+ * Peephole pass. The code is decoded into a list of instructions, patterns
+ * mark the instructions they make redundant as dead, and the live ones are
+ * encoded again. Jump and call operands are absolute addresses, so they are
+ * mapped through the new layout; a removed instruction maps to wherever the
+ * next live one ends up.
+ */
+typedef struct {
+	u64 addr; // address before the pass
+	u64 arg;  // operand, if the op has one
+	u8 op;
+	u8 dead;
+	u8 target; // a jump or call lands here, or a function starts here
+	u8 entry;  // in a JTAB's table, whose layout is fixed
+} gh_insn;
+
+DEFINE_VEC(gh_insn);
+static VEC(gh_insn) insns;
+
+static u64 gh_opt_get(const u8 *b, u64 size) {
+	u64 v = 0;
+	for (u64 i = 0; i < size; i++)
+		v = (v << 8) | b[i];
+	return v;
+}
+
+static int gh_opt_is_jump(u8 op) {
+	switch (op) {
+		case GH_VM_JZ8: case GH_VM_JZ16:
+		case GH_VM_JZ32: case GH_VM_JZ64:
+		case GH_VM_JNZ8: case GH_VM_JNZ16:
+		case GH_VM_JNZ32: case GH_VM_JNZ64:
+		case GH_VM_JMP: case GH_VM_CALL: return 1;
+		default: return 0;
+	}
+}
+
+// Index of the instruction at an address
+static u64 gh_opt_find(u64 addr) {
+	u64 lo = 0, hi = insns.used;
+	while (lo < hi) {
+		u64 mid = lo + (hi - lo) / 2;
+		if (insns.data[mid].addr < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static u64 gh_opt_next_live(u64 i, u64 end) {
+	for (i++; i < end && insns.data[i].dead; i++)
+		;
+	return i;
+}
+
+// Code after an unconditional transfer is unreachable until the next
+// instruction something jumps to, e.g. the implicit return after an
+// explicit one.
+static int gh_peep_unreachable(u64 i, u64 end) {
+	switch (insns.data[i].op) {
+		case GH_VM_RET: case GH_VM_JMP: case GH_VM_EXIT: break;
+		default: return 0;
+	}
+	int n = 0;
+	for (u64 j = i + 1; j < end && !insns.data[j].target; j++) {
+		if (!insns.data[j].dead) {
+			insns.data[j].dead = 1;
+			n = 1;
+		}
+	}
+	return n;
+}
+
+// Whether op reads no more than the low bytes of a and then replaces all
+// of it, so whatever a held above them is never seen
+static int gh_opt_reads_a_within(u8 op, u8 bytes) {
+	static const u8 families[] = {
+		GH_VM_ADD8, GH_VM_SUB8, GH_VM_MUL8, GH_VM_DIV8, GH_VM_MOD8,
+		GH_VM_LSHIFT8, GH_VM_RSHIFT8, GH_VM_BAND8, GH_VM_BXOR8, GH_VM_BOR8,
+		GH_VM_AND8, GH_VM_OR8,
+	};
+	for (u64 k = 0; k < sizeof(families); k++) {
+		if (op >= families[k] && op <= families[k] + 3)
+			return (1u << (op - families[k])) <= bytes;
+	}
+	return 0;
+}
+
+// A load of the slot that was just stored to, at the same width. After a
+// narrow store, a can still hold wider bits (an overflowed ADD, a BNEG, a
+// wide immediate) that the load would have zero-extended away, so it only
+// goes if that can't be told apart: the store is 64 bits wide, or the next
+// op only reads a at the slot's width.
+static int gh_peep_store_load(u64 i, u64 end) {
+	gh_insn *store = &insns.data[i];
+	switch (store->op) {
+		case GH_VM_MOV_A_OFFSET8: case GH_VM_MOV_A_OFFSET16:
+		case GH_VM_MOV_A_OFFSET32: case GH_VM_MOV_A_OFFSET64: break;
+		default: return 0;
+	}
+	u64 j = gh_opt_next_live(i, end);
+	if (j == end)
+		return 0;
+	gh_insn *load = &insns.data[j];
+	if (load->target || load->arg != store->arg
+			|| load->op != store->op - GH_VM_MOV_A_OFFSET8 + GH_VM_MOV_OFFSET_A8)
+		return 0;
+	u8 bytes = (u8) (1u << (store->op - GH_VM_MOV_A_OFFSET8));
+	if (bytes < 8) {
+		u64 k = gh_opt_next_live(j, end);
+		if (k == end || !gh_opt_reads_a_within(insns.data[k].op, bytes))
+			return 0;
+	}
+	load->dead = 1;
+	return 1;
+}
+
+// A jump over nothing but dead code, like the one gh_emit_if emits at the
+// end of a branch with no else
+static int gh_peep_jmp_next(u64 i, u64 end) {
+	gh_insn *jmp = &insns.data[i];
+	if (jmp->op != GH_VM_JMP || jmp->entry)
+		return 0;
+	u64 j = gh_opt_next_live(i, end);
+	if (j == end || jmp->arg <= jmp->addr || jmp->arg > insns.data[j].addr)
+		return 0;
+	jmp->dead = 1;
+	return 1;
+}
+
+static int gh_peep_add_sp_zero(u64 i, u64 end) {
+	(void) end;
+	gh_insn *insn = &insns.data[i];
+	if (insn->op != GH_VM_ADD_SP || insn->arg != 0)
+		return 0;
+	insn->dead = 1;
+	return 1;
+}
+
+// Multiplication, division and modulo by the immediate just loaded. The
+// VM's DIV and MOD are unsigned at every width, so by a power of two they
+// are exactly a logical shift and a mask. Other divisors d of n-bit values
+// use a multiply by a rounded-up reciprocal (Granlund and Montgomery): with
+// l = ceil(log2 d) and m = floor(2^(n+l) / d) + 1, which has at most n + 1
+// bits, x / d = (x * m) >> (n + l) for every x below 2^n. Modulo by other
+// constants would need x twice, which costs more dispatches than the divide.
+static int gh_peep_strength(u64 i, u64 end) {
+	gh_insn *imm = &insns.data[i];
+	if (imm->op < GH_VM_MOV_IMM_A8 || imm->op > GH_VM_MOV_IMM_A64)
+		return 0;
+	u64 j = gh_opt_next_live(i, end);
+	if (j == end || insns.data[j].target)
+		return 0;
+
+	gh_insn *op = &insns.data[j];
+	u8 base;
+	if (op->op >= GH_VM_MUL8 && op->op <= GH_VM_MUL64)
+		base = GH_VM_MUL8;
+	else if (op->op >= GH_VM_DIV8 && op->op <= GH_VM_DIV64)
+		base = GH_VM_DIV8;
+	else if (op->op >= GH_VM_MOD8 && op->op <= GH_VM_MOD64)
+		base = GH_VM_MOD8;
+	else
+		return 0;
+	u8 wi = op->op - base;
+	u32 bits = 8u << wi;
+	u64 d = bits == 64 ? imm->arg : imm->arg & ((1ull << bits) - 1);
+	if (!d)
+		return 0;
+
+	if (!(d & (d - 1))) {
+		u64 k = (u64) __builtin_ctzll(d);
+		switch (base) {
+			case GH_VM_MUL8: op->op = GH_VM_LSHIFT8 + wi; break;
+			case GH_VM_DIV8: op->op = GH_VM_RSHIFT8 + wi; break;
+			default:
+				op->op = GH_VM_BAND8 + wi;
+				imm->arg = d - 1;
+				return 1;
+		}
+		imm->op = GH_VM_MOV_IMM_A8;
+		imm->arg = k;
+		return 1;
+	}
+
+	u32 l = 64 - (u32) __builtin_clzll(d - 1);
+	if (base != GH_VM_DIV8 || bits + l > 127)
+		return 0;
+	u128 m = ((u128) 1 << (bits + l)) / d + 1;
+	u64 lo = (u64) m;
+	if (lo <= 0xff)
+		imm->op = GH_VM_MOV_IMM_A8;
+	else if (lo <= 0xffff)
+		imm->op = GH_VM_MOV_IMM_A16;
+	else if (lo <= 0xffffffff)
+		imm->op = GH_VM_MOV_IMM_A32;
+	else
+		imm->op = GH_VM_MOV_IMM_A64;
+	imm->arg = lo;
+	op->op = GH_VM_MULHI8 + wi;
+	op->arg = l | (m >> 64 ? 0x80 : 0);
+	return 1;
+}
+
+static const struct {
+	const char *name;
+	int (*apply)(u64 i, u64 end);
+} peep_patterns[] = {
+	{"unreachable", gh_peep_unreachable},
+	{"store-load",  gh_peep_store_load},
+	{"jmp-next",    gh_peep_jmp_next},
+	{"add-sp-zero", gh_peep_add_sp_zero},
+	{"strength",    gh_peep_strength},
+};
+#define NPATTERNS (sizeof(peep_patterns) / sizeof(peep_patterns[0]))
+
+static u64 gh_opt_peephole_fun(u64 start, u64 end) {
+	u64 n = 0;
+	int changed;
+	do {
+		changed = 0;
+		for (u64 i = start; i < end; i++) {
+			for (u64 p = 0; p < NPATTERNS && !insns.data[i].dead; p++) {
+				if (peep_patterns[p].apply(i, end)) {
+					changed = 1;
+					n++;
+				}
+			}
+		}
+	} while (changed);
+	return n;
+}
+
+u64 gh_opt_peephole(gh_bytecode *bc) {
+	u64 n = 0;
+	insns = INIT_VEC(gh_insn);
+
+	for (u64 addr = 0; addr < bc->bytes.used;) {
+		u8 op = bc->bytes.data[addr];
+		u64 size = gh_vm_operand_size(op);
+		if (addr + 1 + size > bc->bytes.used) {
+			gh_log(GH_LOG_ERR, "peephole: truncated instruction at 0x%" PRIx64, addr);
+			goto end;
+		}
+		if (insns.used == insns.size)
+			GROW_VEC(insns, insns.size);
+		APPEND_VEC_RAW(insns, ((gh_insn) {
+			.addr = addr,
+			.arg = gh_opt_get(&bc->bytes.data[addr + 1], size),
+			.op = op,
+		}));
+		addr += 1 + size;
+	}
+
+	LOOP_VEC(insns, insn, {
+		if (gh_opt_is_jump(insn->op))
+			insns.data[gh_opt_find(insn->arg)].target = 1;
+	});
+	// Every entry of a jump table is reached from the JTAB, and so is the
+	// code after the table
+	for (u64 i = 0; i < insns.used; i++) {
+		if (insns.data[i].op < GH_VM_JTAB8 || insns.data[i].op > GH_VM_JTAB64)
+			continue;
+		for (u64 j = i + 1; j <= i + 1 + insns.data[i].arg && j < insns.used; j++) {
+			insns.data[j].target = 1;
+			insns.data[j].entry = j <= i + insns.data[i].arg;
+		}
+	}
+	LOOP_VEC(bc->funs, fun, {
+		insns.data[gh_opt_find(fun->offset)].target = 1;
+	});
+
+	LOOP_VEC(bc->funs, fun, {
+		n += gh_opt_peephole_fun(gh_opt_find(fun->offset),
+			gh_opt_find(fun->offset + fun->nbytes));
+	});
+	if (!n)
+		goto end;
+
+	// New address of every instruction, live or not
+	u64 *naddr = gh_malloc((insns.used + 1) * sizeof(u64));
+	u64 used = 0;
+	for (u64 i = 0; i < insns.used; i++) {
+		naddr[i] = used;
+		if (!insns.data[i].dead)
+			used += 1 + gh_vm_operand_size(insns.data[i].op);
+	}
+	naddr[insns.used] = used;
+
+	LOOP_VEC(bc->funs, fun, {
+		u64 nend = naddr[gh_opt_find(fun->offset + fun->nbytes)];
+		fun->offset = naddr[gh_opt_find(fun->offset)];
+		fun->nbytes = nend - fun->offset;
+	});
+	LOOP_VEC(insns, insn, {
+		if (gh_opt_is_jump(insn->op))
+			insn->arg = naddr[gh_opt_find(insn->arg)];
+	});
+	gh_free(naddr);
+
+	VEC(u8) bytes = INIT_VEC(u8);
+	GROW_VEC(bytes, used);
+	LOOP_VEC(insns, insn, {
+		if (insn->dead)
+			continue;
+		u64 size = gh_vm_operand_size(insn->op);
+		APPEND_VEC_RAW(bytes, insn->op);
+		for (u64 i = size; i-- > 0;)
+			APPEND_VEC_RAW(bytes, (u8) (insn->arg >> (i * 8)));
+	});
+	FREE_VEC(bc->bytes);
+	bc->bytes = bytes;
+
+end:
+	FREE_VEC(insns);
+	return n;
+}
@@ -0,0 +1,18 @@
+#ifndef _GALACH_OPT_H
+#define _GALACH_OPT_H
+
+#include "ast.h"
+#include "token.h"
+#include "bytecode.h"
+
+// Folds constant subexpressions and trivial algebraic identities, in place,
+// before codegen. Folded values are added to the lexer's literal pool.
+// Returns the number of nodes rewritten.
+u64 gh_opt_fold(gh_ast_tree *tree, gh_lexer *lx);
+
+// Rewrites redundant instruction sequences in every function, then lays
+// the code out again, fixing up jump and call targets and the function
+// table. Returns the number of rewrites.
+u64 gh_opt_peephole(gh_bytecode *bc);
+
+#endif // _GALACH_OPT_H
@@ -20,6 +20,9 @@ static struct gh_keyword_map {
 	{GH_TOK_KW_U64, "u64"},
 	{GH_TOK_KW_F32, "f32"},
 	{GH_TOK_KW_F64, "f64"},
+	{GH_TOK_KW_V4I32, "v4i32"},
+	{GH_TOK_KW_V2I64, "v2i64"},
+	{GH_TOK_KW_STR, "str"},
 
 	{GH_TOK_KW_VAR, "var"},
 	{GH_TOK_KW_FUN, "fun"},
@@ -55,9 +58,78 @@ static inline int gh_is_alpha_cont(char c) {
 	return gh_is_alpha_start(c) || gh_is_digit(c);
 }
 
-static int gh_parse_string(gh_token *token, char **c) {
+static u64 gh_hash_str(const char *start, u64 size) {
+	u64 h = 14695981039346656037ULL;
+	for (u64 i = 0; i < size; i++)
+		h = (h ^ (u8) start[i]) * 1099511628211ULL;
+	return h;
+}
+
+static void gh_intern_grow(gh_intern_table *table, gh_lexer *lx) {
+	u64 nsize = table->size ? table->size * 2 : 256;
+	u32 *nslots = gh_malloc(nsize * sizeof(u32));
+	memset(nslots, 0, nsize * sizeof(u32));
+	for (u64 i = 0; i < table->size; i++) {
+		if (!table->slots[i]) continue;
+		char *str = lx->strs.data[table->slots[i] - 1];
+		u64 j = gh_hash_str(str, strlen(str)) & (nsize - 1);
+		while (nslots[j])
+			j = (j + 1) & (nsize - 1);
+		nslots[j] = table->slots[i];
+	}
+	gh_free(table->slots);
+	table->slots = nslots;
+	table->size = nsize;
+}
+
+static int gh_intern(gh_lexer *lx, const char *start, u64 size, u32 *idx) {
+	gh_intern_table *table = &lx->intern;
+	if ((table->used + 1) * 2 > table->size)
+		gh_intern_grow(table, lx);
+
+	u64 j = gh_hash_str(start, size) & (table->size - 1);
+	while (table->slots[j]) {
+		char *str = lx->strs.data[table->slots[j] - 1];
+		if (!strncmp(str, start, size) && str[size] == 0) {
+			*idx = table->slots[j] - 1;
+			return 0;
+		}
+		j = (j + 1) & (table->size - 1);
+	}
+
+	char *str = strndup(start, size);
+	if (!str) {
+		gh_log(GH_LOG_ERR, "alloc identifier: %s", strerror(errno));
+		return -1;
+	}
+	*idx = (u32) lx->strs.used;
+	APPEND_VEC(lx->strs, str);
+	table->slots[j] = *idx + 1;
+	table->used++;
+	return 0;
+}
+
+int gh_lex_find(const gh_lexer *lx, const char *name, u32 *idx) {
+	const gh_intern_table *table = &lx->intern;
+	u64 size = strlen(name);
+	if (!table->size)
+		return -1;
+
+	u64 j = gh_hash_str(name, size) & (table->size - 1);
+	while (table->slots[j]) {
+		char *str = lx->strs.data[table->slots[j] - 1];
+		if (!strcmp(str, name)) {
+			*idx = table->slots[j] - 1;
+			return 0;
+		}
+		j = (j + 1) & (table->size - 1);
+	}
+	return -1;
+}
+
+static int gh_parse_string(gh_lexer *lx, u32 *payload, const char **c) {
 	u64 size = 1;
-	char *e = ++*c;
+	const char *e = ++*c;
 	while (*e >= ' ' && *e <= '~' && *e != '"') {
 		if (*e == '\\') e++;
 		e++, size++;
@@ -67,8 +139,8 @@ static int gh_parse_string(gh_token *token, char **c) {
 		return -1;
 	}
 
-	token->info.str = malloc(size);
-	if (!token->info.str) {
+	char *str = malloc(size);
+	if (!str) {
 		gh_log(GH_LOG_ERR, "alloc string: %s", strerror(errno));
 		return -1;
 	}
@@ -76,28 +148,32 @@ static int gh_parse_string(gh_token *token, char **c) {
 	while (*c < e) {
 		if (**c == '\\') {
 			switch (*++(*c)) {
-				case 'a': token->info.str[size] = '\a'; break;
-				case 'b': token->info.str[size] = '\b'; break;
-				case 'n': token->info.str[size] = '\n'; break;
-				case 't': token->info.str[size] = '\t'; break;
-				case 'r': token->info.str[size] = '\r'; break;
-				case '\\': token->info.str[size] = '\\'; break;
+				case 'a': str[size] = '\a'; break;
+				case 'b': str[size] = '\b'; break;
+				case 'n': str[size] = '\n'; break;
+				case 't': str[size] = '\t'; break;
+				case 'r': str[size] = '\r'; break;
+				case '\\': str[size] = '\\'; break;
 				default: {
 					gh_log(GH_LOG_ERR, "invalid escape sequence: \\%c", **c);
-					free(token->info.str);
+					free(str);
 					return -1;
 				}
 			}
 		} else {
-			token->info.str[size] = **c;
+			str[size] = **c;
 		}
 		(*c)++, size++;
 	}
-	token->id = GH_TOK_LIT_STRING;
-	return 0;
+	str[size] = 0;
+	// Interned like identifiers, so equal literals share an entry
+	int ret = gh_intern(lx, str, size, payload);
+	free(str);
+	return ret;
 }
 
-static void gh_parse_number(gh_token *token, char **c) {
+static enum gh_token_id gh_parse_number(gh_lexer *lx, u32 *payload, const char **c) {
+	enum gh_token_id id;
 	u64 x = 0;
 	while (gh_is_digit(**c)) {
 		x = x*10 + (**c - '0');
@@ -106,148 +182,270 @@ static void gh_parse_number(gh_token *token, char **c) {
 	if (**c == '.') {
 		(*c)++;
 		double count = 10;
-		double y = (double) x;
+		union { f64 f; u64 u; } y = { .f = (double) x };
 		while (gh_is_digit(**c)) {
-			y += (**c - '0') / count;
+			y.f += (**c - '0') / count;
 			count *= 10, (*c)++;
 		}
-		token->id = GH_TOK_LIT_FLOAT;
-		token->info.flt = y;
+		id = GH_TOK_LIT_FLOAT;
+		x = y.u;
 	} else {
-		token->id = GH_TOK_LIT_INT;
-		token->info.i = x;
+		id = GH_TOK_LIT_INT;
 	}
 	(*c)--;
+	*payload = (u32) lx->lits.used;
+	APPEND_VEC(lx->lits, x);
+	return id;
 }
 
-static void gh_parse_alpha_str(u64 *size, char **c) {
+static void gh_parse_alpha_str(u64 *size, const char **c) {
 	*size = 0;
 	while (gh_is_alpha_cont(**c))
 		(*c)++, (*size)++;
 	(*c)--;
 }
 
-static inline int gh_cmp_kw(const char *kw, char *start, u64 size) {
+static inline int gh_cmp_kw(const char *kw, const char *start, u64 size) {
 	u64 i;
 	for (i = 0; i < size && kw[i] != 0; i++) {
 		if (kw[i] != start[i]) return 0;
 	}
 
-	if (kw[i] != 0) return 0;
+	if (kw[i] != 0 || i != size) return 0;
 	return 1;
 }
 
-static int gh_parse_kw_or_ident(gh_token *token, char *start, u64 size) {
+static int gh_parse_kw_or_ident(gh_lexer *lx, enum gh_token_id *id, u32 *payload,
+								const char *start, u64 size) {
 	for (u64 i = 0; i < keyword_map_size; i++) {
 		if (gh_cmp_kw(keyword_map[i].str, start, size)) {
-			token->id = keyword_map[i].id;
+			*id = keyword_map[i].id;
 			return 0;
 		}
 	}
 
-	token->id = GH_TOK_IDENT;
-	token->info.str = strndup(start, size);
-	if (!token->info.str) {
-		gh_log(GH_LOG_ERR, "alloc identifier: %s", strerror(errno));
-		return -1;
-	}
-	return 0;
+	*id = GH_TOK_IDENT;
+	return gh_intern(lx, start, size, payload);
 }
 
-token_v gh_token_init(char *c) {
-	u64 lineno = 1;
-	char *linestart = c;
+// Lexes the token starting at lx->c, leaving lx->c just past it.
+// Once the end of the source is reached, this keeps returning EOF.
+static int gh_lex_one(gh_lexer *lx, enum gh_token_id *kind, u32 *offset, u32 *payload) {
+	const char *c = lx->c;
+	while (gh_is_ws(*c)) {
+		if (*c == '\n')
+			APPEND_VEC(lx->lines, (u32) (c + 1 - lx->src));
+		c++;
+	}
 
-	MAKE_VEC(gh_token, tokens);
-	for (;;) {
-		if (gh_is_ws(*c)) {
-			if (*c == '\n') {
-				lineno++;
-				linestart = c+1;
-			}
-			c++;
-			continue;
+	#define CASE(x) case x: switch(*(c+1)) {
+	#define ALT(x, t) case x: id = t; c++; break;
+	#define DFLT(t) default: id = t; break; } break;
+	enum gh_token_id id;
+	*offset = (u32) (c - lx->src);
+	*payload = 0;
+	switch (*c) {
+		CASE('=') ALT('=', GH_TOK_EQ)            DFLT(GH_TOK_ASSIGN);
+		CASE('+') ALT('=', GH_TOK_PLUS_ASSIGN)   DFLT(GH_TOK_PLUS);
+		CASE('*') ALT('=', GH_TOK_MULT_ASSIGN)   DFLT(GH_TOK_MULT);
+		CASE('/') ALT('=', GH_TOK_DIV_ASSIGN)    DFLT(GH_TOK_DIV);
+		CASE('%') ALT('=', GH_TOK_MODULO_ASSIGN) DFLT(GH_TOK_MODULO);
+		CASE('!') ALT('=', GH_TOK_NEQ)           DFLT(GH_TOK_NEG);
+		CASE('-')
+			ALT('>', GH_TOK_RARROW)
+			ALT('=', GH_TOK_MINUS_ASSIGN)
+		DFLT(GH_TOK_MINUS);
+		CASE('>')
+			ALT('=', GH_TOK_GEQ)
+			ALT('>', GH_TOK_RSHIFT)
+		DFLT(GH_TOK_GT);
+		CASE('<')
+			ALT('=', GH_TOK_LEQ)
+			ALT('<', GH_TOK_LSHIFT)
+		DFLT(GH_TOK_LT);
+		CASE('&') ALT('&', GH_TOK_AND) DFLT(GH_TOK_BAND);
+		CASE('|') ALT('|', GH_TOK_OR)  DFLT(GH_TOK_BOR);
+		CASE('^') DFLT(GH_TOK_BXOR);
+		CASE('~') DFLT(GH_TOK_BNEG);
+		CASE('(') DFLT(GH_TOK_LPAREN);
+		CASE(')') DFLT(GH_TOK_RPAREN);
+		CASE('[') DFLT(GH_TOK_LBRACKET);
+		CASE(']') DFLT(GH_TOK_RBRACKET);
+		CASE(';') DFLT(GH_TOK_SEMICOLON);
+		CASE(',') DFLT(GH_TOK_COMMA);
+		CASE(':') DFLT(GH_TOK_COLON);
+		case '\"': {
+			if (gh_parse_string(lx, payload, &c) < 0) goto e0;
+			id = GH_TOK_LIT_STRING;
+			break;
 		}
-
-		#define CASE(x) case x: switch(*(c+1)) {
-		#define ALT(x, t) case x: token.id = t; c++; break;
-		#define DFLT(t) default: token.id = t; break; } break;
-		gh_token token = (gh_token) {
-			.lineno = lineno,
-			.colno = (u64) (c - linestart) + 1,
-		};
-		switch (*c) {
-			CASE('=') ALT('=', GH_TOK_EQ)            DFLT(GH_TOK_ASSIGN);
-			CASE('+') ALT('=', GH_TOK_PLUS_ASSIGN)   DFLT(GH_TOK_PLUS);
-			CASE('*') ALT('=', GH_TOK_MULT_ASSIGN)   DFLT(GH_TOK_MULT);
-			CASE('/') ALT('=', GH_TOK_DIV_ASSIGN)    DFLT(GH_TOK_DIV);
-			CASE('%') ALT('=', GH_TOK_MODULO_ASSIGN) DFLT(GH_TOK_MODULO);
-			CASE('!') ALT('=', GH_TOK_NEQ)           DFLT(GH_TOK_NEG);
-			CASE('-')
-				ALT('>', GH_TOK_RARROW)
-				ALT('=', GH_TOK_MINUS_ASSIGN)
-			DFLT(GH_TOK_MINUS);
-			CASE('>')
-				ALT('=', GH_TOK_GEQ)
-				ALT('>', GH_TOK_RSHIFT)
-			DFLT(GH_TOK_GT);
-			CASE('<')
-				ALT('=', GH_TOK_LEQ)
-				ALT('<', GH_TOK_LSHIFT)
-			DFLT(GH_TOK_LT);
-			CASE('&') ALT('&', GH_TOK_AND) DFLT(GH_TOK_BAND);
-			CASE('|') ALT('|', GH_TOK_OR)  DFLT(GH_TOK_BOR);
-			CASE('^') DFLT(GH_TOK_BXOR);
-			CASE('~') DFLT(GH_TOK_BNEG);
-			CASE('(') DFLT(GH_TOK_LPAREN);
-			CASE(')') DFLT(GH_TOK_RPAREN);
-			CASE(',') DFLT(GH_TOK_COMMA);
-			CASE(':') DFLT(GH_TOK_COLON);
-			case '\"': {
-				if (gh_parse_string(&token, &c) < 0) goto e0;
-				break;
-			}
-			case '0': case '1': case '2': case '3': case '4':
-			case '5': case '6': case '7': case '8': case '9': case '.': {
-				gh_parse_number(&token, &c);
-				break;
-			}
-			case '\0': {
-				token.id = GH_TOK_EOF;
-				break;
-			}
-			default: {
-				if (gh_is_alpha_start(*c)) {
-					u64 size;
-					char *start = c;
-					gh_parse_alpha_str(&size, &c);
-					if (gh_parse_kw_or_ident(&token, start, size) < 0) goto e0;
-				} else {
-					gh_log(GH_LOG_ERR, "invalid char: %c", *c);
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9': case '.': {
+			id = gh_parse_number(lx, payload, &c);
+			break;
+		}
+		case '\0': {
+			lx->c = c;
+			*kind = GH_TOK_EOF;
+			return 0;
+		}
+		default: {
+			if (gh_is_alpha_start(*c)) {
+				u64 size;
+				const char *start = c;
+				gh_parse_alpha_str(&size, &c);
+				if (gh_parse_kw_or_ident(lx, &id, payload, start, size) < 0)
 					goto e0;
-				}
+			} else {
+				gh_log(GH_LOG_ERR, "invalid char: %c", *c);
+				goto e0;
 			}
 		}
-
-		APPEND_VEC(tokens, token);
-		if (token.id == GH_TOK_EOF)
-			break;
-		c++;
 	}
+	#undef CASE
+	#undef ALT
+	#undef DFLT
 
-	return tokens;
+	lx->c = c + 1;
+	*kind = id;
+	return 0;
 
 e0:
-	gh_token_deinit(tokens);
-	return NULL_VEC(gh_token);
+	// Stop lexing; the parser sees EOF and gh_ast_init reports the failure
+	while (*c) c++;
+	lx->c = c;
+	lx->failed = 1;
+	*kind = GH_TOK_EOF;
+	return -1;
+}
+
+int gh_lex_init(gh_lexer *lx, const char *src) {
+	if (strlen(src) > UINT32_MAX) {
+		gh_log(GH_LOG_ERR, "source file is too large");
+		return -1;
+	}
+
+	const u64 size = 16;
+	*lx = (gh_lexer) {
+		.src = src,
+		.c = src,
+		.kinds = gh_malloc(size * sizeof(u8)),
+		.offsets = gh_malloc(size * sizeof(u32)),
+		.payloads = gh_malloc(size * sizeof(u32)),
+		.size = size,
+		.marks = INIT_VEC(u64),
+		.strs = INIT_VEC(gh_str),
+		.lits = INIT_VEC(u64),
+		.lines = INIT_VEC(u32),
+	};
+	APPEND_VEC(lx->lines, 0);
+	return 0;
+}
+
+static void gh_lex_grow(gh_lexer *lx) {
+	u64 nsize = lx->size * 2;
+	u8 *kinds = gh_malloc(nsize * sizeof(u8));
+	u32 *offsets = gh_malloc(nsize * sizeof(u32));
+	u32 *payloads = gh_malloc(nsize * sizeof(u32));
+	u64 keep = lx->marks.used ? lx->marks.data[0] : lx->pos;
+	for (u64 i = keep; i < lx->end; i++) {
+		kinds[i & (nsize - 1)] = lx->kinds[i & (lx->size - 1)];
+		offsets[i & (nsize - 1)] = lx->offsets[i & (lx->size - 1)];
+		payloads[i & (nsize - 1)] = lx->payloads[i & (lx->size - 1)];
+	}
+	gh_free(lx->kinds);
+	gh_free(lx->offsets);
+	gh_free(lx->payloads);
+	lx->kinds = kinds;
+	lx->offsets = offsets;
+	lx->payloads = payloads;
+	lx->size = nsize;
 }
 
-static void gh_token_free(gh_token *token) {
-	if (token->id == GH_TOK_IDENT || token->id == GH_TOK_LIT_STRING)
-		free(token->info.str);
+// Makes sure the token n tokens past the current one has been lexed
+static void gh_lex_fill(gh_lexer *lx, u64 n) {
+	u64 keep = lx->marks.used ? lx->marks.data[0] : lx->pos;
+	while (lx->end <= lx->pos + n) {
+		if (lx->end - keep >= lx->size)
+			gh_lex_grow(lx);
+
+		enum gh_token_id kind;
+		u32 offset, payload;
+		(void) gh_lex_one(lx, &kind, &offset, &payload);
+		u64 i = lx->end++ & (lx->size - 1);
+		lx->kinds[i] = (u8) kind;
+		lx->offsets[i] = offset;
+		lx->payloads[i] = payload;
+	}
+}
+
+gh_tok gh_lex_peek(gh_lexer *lx, u64 n) {
+	gh_lex_fill(lx, n);
+	u64 i = (lx->pos + n) & (lx->size - 1);
+	return (gh_tok) {
+		.offset = lx->offsets[i],
+		.payload = lx->payloads[i],
+		.kind = lx->kinds[i],
+	};
+}
+
+gh_tok gh_lex_next(gh_lexer *lx) {
+	gh_tok tok = gh_lex_peek(lx, 0);
+	if (tok.kind != GH_TOK_EOF)
+		lx->pos++;
+	return tok;
+}
+
+u64 gh_lex_mark(gh_lexer *lx) {
+	APPEND_VEC(lx->marks, lx->pos);
+	return lx->pos;
+}
+
+void gh_lex_release(gh_lexer *lx, u64 mark) {
+	(void) mark;
+	lx->marks.used--;
+}
+
+void gh_lex_reset(gh_lexer *lx, u64 mark) {
+	lx->pos = mark;
+	lx->marks.used--;
+}
+
+gh_token gh_token_get(const gh_lexer *lx, gh_tok tok) {
+	gh_token token = { .id = tok.kind };
+	switch (token.id) {
+		case GH_TOK_IDENT:
+		case GH_TOK_LIT_STRING: token.info.str = gh_token_str(lx, tok); break;
+		case GH_TOK_LIT_INT: token.info.i = gh_token_int(lx, tok); break;
+		case GH_TOK_LIT_FLOAT: token.info.flt = gh_token_flt(lx, tok); break;
+		default: break;
+	}
+	return token;
+}
+
+// Only called when reporting errors, so a binary search over
+// the line table is plenty.
+void gh_token_pos(const gh_lexer *lx, gh_tok tok, u64 *lineno, u64 *colno) {
+	u64 lo = 0, hi = lx->lines.used;
+	while (hi - lo > 1) {
+		u64 mid = lo + (hi - lo) / 2;
+		if (lx->lines.data[mid] <= tok.offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	*lineno = lo + 1;
+	*colno = (u64) (tok.offset - lx->lines.data[lo]) + 1;
 }
 
-void gh_token_deinit(token_v tokens) {
-	LOOP_VEC(tokens, token, { gh_token_free(token); });
-	FREE_VEC(tokens);
+void gh_lex_deinit(gh_lexer *lx) {
+	LOOP_VEC(lx->strs, str, { free(*str); });
+	gh_free(lx->kinds);
+	gh_free(lx->offsets);
+	gh_free(lx->payloads);
+	gh_free(lx->intern.slots);
+	FREE_VEC(lx->marks);
+	FREE_VEC(lx->strs);
+	FREE_VEC(lx->lits);
+	FREE_VEC(lx->lines);
 }
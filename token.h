@@ -17,6 +17,9 @@ typedef struct {
 		GH_TOK_KW_U64,
 		GH_TOK_KW_F32,
 		GH_TOK_KW_F64,
+		GH_TOK_KW_V4I32,
+		GH_TOK_KW_V2I64,
+		GH_TOK_KW_STR,
 
 		GH_TOK_KW_VAR,
 		GH_TOK_KW_FUN,
@@ -74,6 +77,9 @@ typedef struct {
 		
 		GH_TOK_LPAREN,
 		GH_TOK_RPAREN,
+		GH_TOK_LBRACKET,
+		GH_TOK_RBRACKET,
+		GH_TOK_SEMICOLON,
 
 		GH_TOK_COMMA,
 		GH_TOK_EOF,
@@ -84,14 +90,83 @@ typedef struct {
 		double flt;
 		u64 i;
 	} info;
-
-	u64 lineno;
-	u64 colno;
 } gh_token;
 
-DEFINE_VEC(gh_token);
-typedef VEC(gh_token) token_v;
+// A token as handed out by the lexer. The AST keeps these by value, since
+// the lookahead ring they come from is reused as the parser moves on.
+typedef struct {
+	u32 offset;  // byte offset of the token in the source
+	u32 payload; // index into strs or lits, depending on the kind
+	u8 kind;     // enum gh_token_id
+} gh_tok;
+
+typedef char *gh_str;
+DEFINE_VEC(gh_str);
 
-token_v gh_token_init(char *c);
-void gh_token_deinit(token_v tokens);
+// Identifiers and string literals are interned, so every occurrence of a
+// name or of a string shares one entry in the string pool.
+typedef struct {
+	u32 *slots; // index into strs + 1, 0 means empty
+	u64 size;
+	u64 used;
+} gh_intern_table;
+
+// Pull-based lexer. Tokens are only produced when the parser asks for them,
+// and are kept in a small ring of parallel arrays. The ring only has to hold
+// the lookahead, plus everything after the oldest mark, so memory use is
+// bounded by the longest construct the parser may rewind over rather than
+// by the size of the file.
+//
+// The string/literal pools and the line table outlive the parse, since the
+// AST refers to them.
+typedef struct {
+	const char *src;
+	const char *c;
+
+	u8 *kinds;
+	u32 *offsets;
+	u32 *payloads;
+	u64 size;  // capacity of the ring, always a power of two
+	u64 pos;   // absolute number of the current token
+	u64 end;   // absolute number of tokens lexed so far
+	VEC(u64) marks;
+
+	VEC(gh_str) strs;  // identifiers and string literals, interned
+	VEC(u64) lits;     // integer literals, and float literals as bits
+	VEC(u32) lines;    // byte offset of the start of each line
+	gh_intern_table intern;
+
+	u8 failed;
+} gh_lexer;
+
+int gh_lex_init(gh_lexer *lx, const char *src);
+void gh_lex_deinit(gh_lexer *lx);
+
+gh_tok gh_lex_peek(gh_lexer *lx, u64 n);
+gh_tok gh_lex_next(gh_lexer *lx);
+
+// Marks nest: every mark has to be either released or reset to,
+// innermost first.
+u64 gh_lex_mark(gh_lexer *lx);
+void gh_lex_release(gh_lexer *lx, u64 mark);
+void gh_lex_reset(gh_lexer *lx, u64 mark);
+
+// Finds an identifier that occurs in the source, without interning it
+int gh_lex_find(const gh_lexer *lx, const char *name, u32 *idx);
+
+gh_token gh_token_get(const gh_lexer *lx, gh_tok tok);
+void gh_token_pos(const gh_lexer *lx, gh_tok tok, u64 *lineno, u64 *colno);
+
+static inline char *gh_token_str(const gh_lexer *lx, gh_tok tok) {
+	return lx->strs.data[tok.payload];
+}
+
+static inline u64 gh_token_int(const gh_lexer *lx, gh_tok tok) {
+	return lx->lits.data[tok.payload];
+}
+
+static inline f64 gh_token_flt(const gh_lexer *lx, gh_tok tok) {
+	union { u64 u; f64 f; } x = { .u = gh_token_int(lx, tok) };
+	return x.f;
+}
 #endif // _GALACH_TOKEN_H
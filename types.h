@@ -11,9 +11,21 @@ typedef uint32_t  u32;
 typedef int32_t   i32;
 typedef uint64_t  u64;
 typedef int64_t   i64;
+typedef unsigned __int128 u128;
 typedef float     f32;
 typedef double    f64;
 
+// The bits of a float, which is how it's stored in bytecode and the VM
+typedef union {
+	f32 f;
+	u32 u;
+} f32_u32;
+
+typedef union {
+	f64 f;
+	u64 u;
+} f64_u64;
+
 #if defined(__has_builtin)
 #	if __has_builtin(__builtin_expect)
 #		define LIKELY(x)   __builtin_expect(!!(x), 1)
@@ -92,6 +104,10 @@ for (u64 __vec_counter__ = 0; __vec_counter__ < (vec).used; __vec_counter__++) {
 	_vec->size = 0; \
 } while (0)
 
+DEFINE_VEC(u8);
+DEFINE_VEC(u32);
+DEFINE_VEC(u64);
+
 #define NULL_VEC(type) ((VEC(type)){})
 #define VEC_IS_NULL(vec) (!(vec).data)
 
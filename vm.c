@@ -2,19 +2,21 @@
 #include <string.h>
 #include <setjmp.h>
 #include <errno.h>
+#include <unistd.h>
 #include "vm.h"
+#include "native.h"
 #include "log.h"
 
+// What the program printed goes out first, so it comes before the crash
 #define fail() do { \
+	(void) gh_vm_flush(vm); \
 	gh_log(GH_LOG_ERR, \
 		"vm crashed from %s\n" \
 		"line: %d\n", __func__, __LINE__ \
 	); \
-	longjmp(fail_buf, 1); \
+	longjmp(*vm->fail, 1); \
 } while (0)
 
-static jmp_buf fail_buf;
-
 // The stack is backwards due to poor design decisions
 // when making the bytecode...
 //
@@ -34,6 +36,8 @@ void gh_vm_init(gh_vm *vm, gh_bytecode *bytecode) {
 	*vm = (gh_vm) {};
 	vm->bc = bytecode;
 	vm->stack = INIT_VEC(u8);
+	gh_vm_output(vm, STDOUT_FILENO, GH_VM_OUT_SIZE);
+	gh_vm_input(vm, STDIN_FILENO, GH_VM_IN_SIZE);
 }
 
 static void debug_stack(gh_vm *vm) {
@@ -158,35 +162,59 @@ static void mov_offset_a64(gh_vm *vm, i64 offset) {
 		| ((u64)vm->stack.data[pos+7] << 0);
 }
 
+// A load zero-extends, these sign-extend what was loaded instead
+static void mov_offset_sx_a8(gh_vm *vm, i64 offset) {
+	mov_offset_a8(vm, offset);
+	vm->a = (u64) (i64) (i8) A8;
+}
+
+static void mov_offset_sx_a16(gh_vm *vm, i64 offset) {
+	mov_offset_a16(vm, offset);
+	vm->a = (u64) (i64) (i16) A16;
+}
+
+static void mov_offset_sx_a32(gh_vm *vm, i64 offset) {
+	mov_offset_a32(vm, offset);
+	vm->a = (u64) (i64) (i32) A32;
+}
+
 static void sign_a8(gh_vm *vm) { vm->a = -A8; }
 static void sign_a16(gh_vm *vm) { vm->a = -A16; }
 static void sign_a32(gh_vm *vm) { vm->a = -A32; }
 static void sign_a64(gh_vm *vm) { vm->a = -A64; }
 
-static void zext_a8_16(gh_vm *vm) { vm->a = A8; }
-static void zext_a16_32(gh_vm *vm) { vm->a = A16; }
-static void zext_a32_64(gh_vm *vm) { vm->a = A32; }
-
-static void sext_a8_16(gh_vm *vm) {
-	i16 i = (i16) ((i8) A8);
-	vm->a = (u64) i;
-}
-
-static void sext_a16_32(gh_vm *vm) {
-	i32 i = (i32) ((i16) A16);
-	vm->a = (u64) i;
-}
+static void zext_a8(gh_vm *vm) { vm->a = A8; }
+static void zext_a16(gh_vm *vm) { vm->a = A16; }
+static void zext_a32(gh_vm *vm) { vm->a = A32; }
 
-static void sext_a32_64(gh_vm *vm) {
-	i32 i = (i64) ((i32) A32);
-	vm->a = (u64) i;
-}
+static void sext_a8(gh_vm *vm) { vm->a = (u64) (i64) (i8) A8; }
+static void sext_a16(gh_vm *vm) { vm->a = (u64) (i64) (i16) A16; }
+static void sext_a32(gh_vm *vm) { vm->a = (u64) (i64) (i32) A32; }
 
 static void mov_imm_a8(gh_vm *vm) { vm->a = (u64) get8(vm); }
 static void mov_imm_a16(gh_vm *vm) { vm->a = (u64) get16(vm); }
 static void mov_imm_a32(gh_vm *vm) { vm->a = (u64) get32(vm); }
 static void mov_imm_a64(gh_vm *vm) { vm->a = (u64) get64(vm); }
 
+void gh_vm_fail(gh_vm *vm, const char *msg) {
+	(void) vm;
+	gh_log(GH_LOG_ERR, "%s", msg);
+	fail();
+}
+
+const u8 *gh_vm_str(gh_vm *vm, u64 view, u32 *len) {
+	u64 offset = view >> 32;
+	*len = (u32) view;
+	if (offset + *len > vm->bc->rodata.used) fail();
+	return vm->bc->rodata.data + offset;
+}
+
+static void mov_str_a(gh_vm *vm) {
+	u32 len;
+	vm->a = get64(vm);
+	(void) gh_vm_str(vm, vm->a, &len);
+}
+
 static void neg_a8(gh_vm *vm) { vm->a = !A8; }
 static void neg_a16(gh_vm *vm) { vm->a = !A16; }
 static void neg_a32(gh_vm *vm) { vm->a = !A32; }
@@ -273,11 +301,42 @@ static void leave(gh_vm *vm) {
 
 static void add_sp(gh_vm *vm) {
 	i64 offset = (i64)get64(vm);
-	if (offset > 0)
+	if (offset > 0) {
 		if ((u64)offset > SP) fail();
+	} else {
+		// Making room for a frame
+		GROW_VEC(vm->stack, (u64)-offset);
+	}
 	SP -= offset;
 }
 
+#define INDEX_FUNS(bits) \
+static void mov_index_a ## bits(gh_vm *vm) { \
+	i64 offset = (i64) get64(vm); \
+	mov_offset_a ## bits(vm, offset + (i64) (A64 * (bits / 8))); \
+} \
+static void mov_a_index ## bits(gh_vm *vm) { \
+	i64 offset = (i64) get64(vm); \
+	u64 i = pop_val64(vm); \
+	mov_a_offset ## bits(vm, offset + (i64) (i * (bits / 8))); \
+}
+
+INDEX_FUNS(8) ; INDEX_FUNS(16) ; INDEX_FUNS(32) ; INDEX_FUNS(64) ;
+
+static void bound(gh_vm *vm) {
+	u64 n = get64(vm);
+	if (A64 >= n) fail();
+}
+
+static void clear(gh_vm *vm) {
+	u64 n = get64(vm);
+	i64 offset = (i64) A64 + (i64) n;
+	if (offset > 0 && (u64) offset > vm->bp) fail();
+	u64 pos = vm->bp - offset;
+	if (pos + n > vm->stack.used) fail();
+	memset(&vm->stack.data[pos], 0, n);
+}
+
 static void push8(gh_vm *vm) { push_val8(vm, A8); }
 static void push16(gh_vm *vm) { push_val16(vm, A16); }
 static void push32(gh_vm *vm) { push_val32(vm, A32); }
@@ -302,6 +361,179 @@ OPFUNS(bor, |) ;
 OPFUNS(and, &&) ;
 OPFUNS(or, ||) ;
 
+static void mulhi(gh_vm *vm, u64 val, u32 bits) {
+	u8 arg = get8(vm);
+	u128 p = (u128) val * A64;
+	u32 shift = bits + (arg & 0x7f);
+	if (arg & 0x80) {
+		// The full product is p + (val << 64), which may not fit
+		p = (p >> 64) + val;
+		shift -= 64;
+	}
+	if (shift > 127) fail();
+	vm->a = (u64) (p >> shift);
+}
+
+static void mulhi8(gh_vm *vm) { mulhi(vm, pop_val8(vm), 8); }
+static void mulhi16(gh_vm *vm) { mulhi(vm, pop_val16(vm), 16); }
+static void mulhi32(gh_vm *vm) { mulhi(vm, pop_val32(vm), 32); }
+static void mulhi64(gh_vm *vm) { mulhi(vm, pop_val64(vm), 64); }
+
+static f32 bits_f32(u32 u) { return ((f32_u32) { .u = u }).f; }
+static f64 bits_f64(u64 u) { return ((f64_u64) { .u = u }).f; }
+static u64 f32_bits(f32 f) { return ((f32_u32) { .f = f }).u; }
+static u64 f64_bits(f64 f) { return ((f64_u64) { .f = f }).u; }
+
+#define AF32 bits_f32(A32)
+#define AF64 bits_f64(A64)
+
+#define FOPFUNS(name, op) \
+static void name ## 32 (gh_vm *vm) { vm->a = f32_bits(bits_f32(pop_val32(vm)) op AF32); } \
+static void name ## 64 (gh_vm *vm) { vm->a = f64_bits(bits_f64(pop_val64(vm)) op AF64); }
+
+FOPFUNS(fadd, +) ;
+FOPFUNS(fsub, -) ;
+FOPFUNS(fmul, *) ;
+FOPFUNS(fdiv, /) ;
+
+#define FCMP_FUN(bits) \
+static void fcmp ## bits(gh_vm *vm) { \
+	f ## bits b = bits_f ## bits(pop_val ## bits(vm)); \
+	vm->f_gt = b > AF ## bits; \
+	vm->f_eql = b == AF ## bits; \
+	vm->f_lt = b < AF ## bits; \
+}
+
+FCMP_FUN(32) ; FCMP_FUN(64) ;
+
+static void fsign32(gh_vm *vm) { vm->a = f32_bits(-AF32); }
+static void fsign64(gh_vm *vm) { vm->a = f64_bits(-AF64); }
+
+static void itof32(gh_vm *vm) { vm->a = f32_bits((f32) (i64) A64); }
+static void itof64(gh_vm *vm) { vm->a = f64_bits((f64) (i64) A64); }
+static void utof32(gh_vm *vm) { vm->a = f32_bits((f32) A64); }
+static void utof64(gh_vm *vm) { vm->a = f64_bits((f64) A64); }
+static void fext(gh_vm *vm) { vm->a = f64_bits((f64) AF32); }
+
+// C leaves a conversion out of range undefined, so it's clamped first.
+// An f32 widens to an f64 exactly.
+static u64 f_to_i64(f64 x) {
+	if (x != x)
+		return 0;
+	if (x <= -9223372036854775808.0)
+		return (u64) INT64_MIN;
+	if (x >= 9223372036854775808.0)
+		return (u64) INT64_MAX;
+	return (u64) (i64) x;
+}
+
+static u64 f_to_u64(f64 x) {
+	if (!(x > 0))
+		return 0;
+	if (x >= 18446744073709551616.0)
+		return UINT64_MAX;
+	return (u64) x;
+}
+
+static void ftoi32(gh_vm *vm) { vm->a = f_to_i64((f64) AF32); }
+static void ftoi64(gh_vm *vm) { vm->a = f_to_i64(AF64); }
+static void ftou32(gh_vm *vm) { vm->a = f_to_u64((f64) AF32); }
+static void ftou64(gh_vm *vm) { vm->a = f_to_u64(AF64); }
+
+// A vector is stored in the frame like an array of its lanes: lane i is
+// at bp+offset+i*width, big-endian like every other value
+static u32 load_be32(const u8 *p) {
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+}
+
+static u64 load_be64(const u8 *p) {
+	return ((u64)load_be32(p) << 32) | load_be32(p + 4);
+}
+
+static void store_be32(u8 *p, u32 dw) {
+	p[0] = (dw >> 24) & 0xff;
+	p[1] = (dw >> 16) & 0xff;
+	p[2] = (dw >> 8) & 0xff;
+	p[3] = (dw >> 0) & 0xff;
+}
+
+static void store_be64(u8 *p, u64 qw) {
+	store_be32(p, (u32) (qw >> 32));
+	store_be32(p + 4, (u32) qw);
+}
+
+#define VMOV_FUNS(bits, lane) \
+static void vload_at ## bits(gh_vm *vm, i64 offset) { \
+	u64 pos = calc_bp_pos(vm, 16, offset) + 16; \
+	for (u32 i = 0; i < 128 / bits; i++) \
+		vm->v.lane[i] = load_be ## bits(&vm->stack.data[pos - (i + 1) * (bits / 8)]); \
+} \
+static void vstore_at ## bits(gh_vm *vm, i64 offset) { \
+	u64 pos = calc_bp_pos(vm, 16, offset) + 16; \
+	for (u32 i = 0; i < 128 / bits; i++) \
+		store_be ## bits(&vm->stack.data[pos - (i + 1) * (bits / 8)], vm->v.lane[i]); \
+} \
+static void vload ## bits(gh_vm *vm) { vload_at ## bits(vm, (i64) get64(vm)); } \
+static void vstore ## bits(gh_vm *vm) { vstore_at ## bits(vm, (i64) get64(vm)); } \
+static void vload_index ## bits(gh_vm *vm) { \
+	i64 offset = (i64) get64(vm); \
+	vload_at ## bits(vm, offset + (i64) (A64 * (bits / 8))); \
+} \
+static void vstore_index ## bits(gh_vm *vm) { \
+	i64 offset = (i64) get64(vm); \
+	u64 i = pop_val64(vm); \
+	vstore_at ## bits(vm, offset + (i64) (i * (bits / 8))); \
+}
+
+VMOV_FUNS(32, d) ; VMOV_FUNS(64, q) ;
+
+// On the stack a vector is only ever popped by the next vector op, so it
+// is kept in the host's layout
+static void vpush(gh_vm *vm) {
+	GROW_VEC(vm->stack, sizeof(gh_vreg));
+	memcpy(&vm->stack.data[SP], &vm->v, sizeof(gh_vreg));
+	SP += sizeof(gh_vreg);
+}
+
+static gh_vreg pop_vec(gh_vm *vm) {
+	gh_vreg v;
+	SP -= sizeof(gh_vreg);
+	memcpy(&v, &vm->stack.data[SP], sizeof(gh_vreg));
+	return v;
+}
+
+static void vsplat32(gh_vm *vm) { vm->v.d = (gh_v4u32) { A32, A32, A32, A32 }; }
+static void vsplat64(gh_vm *vm) { vm->v.q = (gh_v2u64) { A64, A64 }; }
+
+#define VOPFUNS(name, op) \
+static void name ## 32 (gh_vm *vm) { vm->v.d = pop_vec(vm).d op vm->v.d; } \
+static void name ## 64 (gh_vm *vm) { vm->v.q = pop_vec(vm).q op vm->v.q; }
+
+VOPFUNS(vadd, +) ;
+VOPFUNS(vsub, -) ;
+VOPFUNS(vmul, *) ;
+
+static void vand(gh_vm *vm) { vm->v.q = pop_vec(vm).q & vm->v.q; }
+static void vor(gh_vm *vm) { vm->v.q = pop_vec(vm).q | vm->v.q; }
+static void vxor(gh_vm *vm) { vm->v.q = pop_vec(vm).q ^ vm->v.q; }
+
+// Vector comparisons give -1 in the lanes that hold, negated to the 1 a
+// scalar comparison gives
+#define VCMPFUNS(name, op) \
+static void name ## 32 (gh_vm *vm) { \
+	vm->v.d = (gh_v4u32) -((gh_v4i32) pop_vec(vm).d op (gh_v4i32) vm->v.d); \
+} \
+static void name ## 64 (gh_vm *vm) { \
+	vm->v.q = (gh_v2u64) -((gh_v2i64) pop_vec(vm).q op (gh_v2i64) vm->v.q); \
+}
+
+VCMPFUNS(vcmpeq, ==) ;
+VCMPFUNS(vcmplt, <) ;
+VCMPFUNS(vcmpgt, >) ;
+
+static void vsum32(gh_vm *vm) { vm->a = (u32) (vm->v.d[0] + vm->v.d[1] + vm->v.d[2] + vm->v.d[3]); }
+static void vsum64(gh_vm *vm) { vm->a = vm->v.q[0] + vm->v.q[1]; }
+
 #define CMP_FUN(bits) \
 static void cmp ## bits(gh_vm *vm) { \
 	i ## bits b = pop_val ## bits(vm); \
@@ -327,6 +559,28 @@ static void jz ## bits(gh_vm *vm) { \
 
 JZ_FUN(8) ; JZ_FUN(16) ; JZ_FUN(32) ; JZ_FUN(64) ;
 
+#define JNZ_FUN(bits) \
+static void jnz ## bits(gh_vm *vm) { \
+	u64 addr = get64(vm); \
+	if (A ## bits) vm->ip = addr; \
+}
+
+JNZ_FUN(8) ; JNZ_FUN(16) ; JNZ_FUN(32) ; JNZ_FUN(64) ;
+
+#define JTAB_FUN(bits) \
+static void jtab ## bits(gh_vm *vm) { \
+	u64 n = get64(vm); \
+	u64 i = A ## bits; \
+	if (i >= n) { \
+		vm->ip += n * GH_VM_JTAB_ENTRY; \
+		return ; \
+	} \
+	vm->ip += i * GH_VM_JTAB_ENTRY + 1; \
+	vm->ip = get64(vm); \
+}
+
+JTAB_FUN(8) ; JTAB_FUN(16) ; JTAB_FUN(32) ; JTAB_FUN(64) ;
+
 static void jmp(gh_vm *vm) { vm->ip = get64(vm); }
 
 static void call(gh_vm *vm) {
@@ -335,59 +589,367 @@ static void call(gh_vm *vm) {
 	vm->ip = addr;
 }
 
-static void sysfun_print8(gh_vm *vm) {
-	enter(vm);
-	mov_offset_a8(vm, 8);
-	printf("%d\n", (int)A8);
-	leave(vm);
+// Output goes through the VM's buffer, which is written to out_fd only
+// when it fills up, on a flush, and when gh_vm_run finishes.
+
+static int out_write(int fd, const u8 *data, u64 len) {
+	while (len) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			gh_log(GH_LOG_ERR, "write: %s", strerror(errno));
+			return -1;
+		}
+		data += n;
+		len -= (u64) n;
+	}
+	return 0;
 }
 
-static void sysfun_print16(gh_vm *vm) {
-	enter(vm);
-	mov_offset_a16(vm, 8);
-	printf("%hd\n", (short)A16);
-	leave(vm);
+int gh_vm_flush(gh_vm *vm) {
+	u64 used = vm->out_used;
+	vm->out_used = 0;
+	return used ? out_write(vm->out_fd, vm->out, used) : 0;
 }
 
-static void sysfun_print32(gh_vm *vm) {
-	enter(vm);
-	mov_offset_a32(vm, 8);
-	printf("%d\n", (int)A32);
-	leave(vm);
+void gh_vm_output(gh_vm *vm, int fd, u64 size) {
+	(void) gh_vm_flush(vm);
+	if (size < GH_VM_OUT_MIN)
+		size = GH_VM_OUT_MIN;
+	if (size != vm->out_size) {
+		gh_free(vm->out);
+		vm->out = gh_malloc(size);
+		vm->out_size = size;
+	}
+	vm->out_fd = fd;
 }
 
-static void sysfun_print64(gh_vm *vm) {
-	enter(vm);
-	mov_offset_a64(vm, 8);
-	printf("%lld\n", (long long)A64);
-	leave(vm);
+// Room for n more bytes, which is at most GH_VM_OUT_MIN
+static u8 *out_reserve(gh_vm *vm, u64 n) {
+	if (vm->out_size - vm->out_used < n && gh_vm_flush(vm))
+		fail();
+	return vm->out + vm->out_used;
 }
 
-static void (*sysfuns[])(gh_vm *vm) = {
-	[GH_SYSFUN_PRINT8] = sysfun_print8,
-	[GH_SYSFUN_PRINT16] = sysfun_print16,
-	[GH_SYSFUN_PRINT32] = sysfun_print32,
-	[GH_SYSFUN_PRINT64] = sysfun_print64,
-};
+static void out_bytes(gh_vm *vm, const u8 *data, u64 len) {
+	if (vm->out_size - vm->out_used < len) {
+		if (gh_vm_flush(vm))
+			fail();
+		// Too big to be worth copying
+		if (len >= vm->out_size) {
+			if (out_write(vm->out_fd, data, len))
+				fail();
+			return ;
+		}
+	}
+	memcpy(vm->out + vm->out_used, data, len);
+	vm->out_used += len;
+}
 
-static void sysfun(gh_vm *vm) {
-	u64 idx = get64(vm);
-	if (idx > GH_SYSFUN_LAST) fail();
-	sysfuns[idx](vm);
+static const char digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+// Formats x in decimal, then a newline, two digits at a time from the end
+static void out_u64(gh_vm *vm, u64 x, u8 neg) {
+	u8 tmp[24];
+	u8 *p = tmp + sizeof(tmp);
+	*--p = '\n';
+	while (x >= 100) {
+		const char *d = &digit_pairs[(x % 100) * 2];
+		x /= 100;
+		*--p = (u8) d[1];
+		*--p = (u8) d[0];
+	}
+	if (x >= 10) {
+		*--p = (u8) digit_pairs[x * 2 + 1];
+		*--p = (u8) digit_pairs[x * 2];
+	} else {
+		*--p = (u8) ('0' + x);
+	}
+	if (neg)
+		*--p = '-';
+	u64 len = (u64) (tmp + sizeof(tmp) - p);
+	memcpy(out_reserve(vm, len), p, len);
+	vm->out_used += len;
 }
 
-static void ret(gh_vm *vm) {
-	vm->ip = pop_val64(vm);
+static void out_i64(gh_vm *vm, i64 x) {
+	if (x < 0)
+		out_u64(vm, -(u64) x, 1);
+	else
+		out_u64(vm, (u64) x, 0);
 }
 
-void gh_vm_run(gh_vm *vm) {
-	if (setjmp(fail_buf))
-		return ;
+static void out_f64(gh_vm *vm, f64 x) {
+	char *p = (char *) out_reserve(vm, 32);
+	vm->out_used += (u64) snprintf(p, 32, "%g\n", x);
+}
+
+// The VM's own natives, see native.h. They're still called sysfuns, since
+// that's what they compile to.
+
+static u64 sysfun_print8(gh_vm *vm, const u64 *args) {
+	// Printed unsigned, as it always has been
+	out_u64(vm, (u8) args[0], 0);
+	return 0;
+}
+
+static u64 sysfun_print_int(gh_vm *vm, const u64 *args) {
+	out_i64(vm, (i64) args[0]);
+	return 0;
+}
+
+static u64 sysfun_printf32(gh_vm *vm, const u64 *args) {
+	f32_u32 x = { .u = (u32) args[0] };
+	out_f64(vm, (f64) x.f);
+	return 0;
+}
 
-	if (!vm->bc->main_defined)
+static u64 sysfun_printf64(gh_vm *vm, const u64 *args) {
+	f64_u64 x = { .u = args[0] };
+	out_f64(vm, x.f);
+	return 0;
+}
+
+static u64 sysfun_print(gh_vm *vm, const u64 *args) {
+	u32 len;
+	const u8 *s = gh_vm_str(vm, args[0], &len);
+	out_bytes(vm, s, len);
+	*out_reserve(vm, 1) = '\n';
+	vm->out_used++;
+	return 0;
+}
+
+static u64 sysfun_flush(gh_vm *vm, const u64 *args) {
+	(void) args;
+	if (gh_vm_flush(vm))
 		fail();
+	return 0;
+}
+
+// The put sysfuns write their argument as raw little-endian bytes
+static void sysfun_put(gh_vm *vm, u64 x, u64 bytes) {
+	u8 *out = out_reserve(vm, bytes);
+	for (u64 i = 0; i < bytes; i++, x >>= 8)
+		out[i] = (u8) x;
+	vm->out_used += bytes;
+}
+
+static u64 sysfun_put8(gh_vm *vm, const u64 *args) { sysfun_put(vm, args[0], 1); return 0; }
+static u64 sysfun_put16(gh_vm *vm, const u64 *args) { sysfun_put(vm, args[0], 2); return 0; }
+static u64 sysfun_put32(gh_vm *vm, const u64 *args) { sysfun_put(vm, args[0], 4); return 0; }
+static u64 sysfun_put64(gh_vm *vm, const u64 *args) { sysfun_put(vm, args[0], 8); return 0; }
+
+// Input is read from in_fd a buffer at a time, and parsed in place
+
+void gh_vm_input(gh_vm *vm, int fd, u64 size) {
+	if (size < GH_VM_IN_MIN)
+		size = GH_VM_IN_MIN;
+	if (size != vm->in_size) {
+		gh_free(vm->in);
+		vm->in = gh_malloc(size);
+		vm->in_size = size;
+	}
+	// Unread input belonged to the old fd
+	vm->in_pos = vm->in_len = 0;
+	vm->in_eof = 0;
+	vm->in_fd = fd;
+}
+
+// Returns -1 at the end of the input
+static int in_fill(gh_vm *vm) {
+	if (vm->in_eof)
+		return -1;
+	vm->in_pos = vm->in_len = 0;
+	for (;;) {
+		ssize_t n = read(vm->in_fd, vm->in, vm->in_size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			gh_log(GH_LOG_ERR, "read: %s", strerror(errno));
+			fail();
+		}
+		if (!n) {
+			vm->in_eof = 1;
+			return -1;
+		}
+		vm->in_len = (u64) n;
+		return 0;
+	}
+}
+
+// The next byte of input, or -1 at the end
+static inline int in_peek(gh_vm *vm) {
+	if (vm->in_pos == vm->in_len && in_fill(vm))
+		return -1;
+	return vm->in[vm->in_pos];
+}
+
+static inline int in_is_ws(int c) {
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static void in_skip_ws(gh_vm *vm) {
+	while (in_is_ws(in_peek(vm)))
+		vm->in_pos++;
+}
+
+// An optionally signed decimal integer, wrapping at 64 bits, and the
+// whitespace around it
+static u64 in_int(gh_vm *vm) {
+	in_skip_ws(vm);
+	int c = in_peek(vm);
+	u8 neg = c == '-';
+	if (neg) {
+		vm->in_pos++;
+		c = in_peek(vm);
+	}
+	if (c < '0' || c > '9') {
+		gh_log(GH_LOG_ERR, "expected an integer in the input");
+		fail();
+	}
+	u64 x = 0;
+	do {
+		// Digits up to the end of what's buffered, without peeking each
+		const u8 *p = vm->in + vm->in_pos, *end = vm->in + vm->in_len;
+		while (p < end && (u8) (*p - '0') < 10)
+			x = x * 10 + (u64) (*p++ - '0');
+		vm->in_pos = (u64) (p - vm->in);
+		c = in_peek(vm);
+	} while (c >= '0' && c <= '9');
+	in_skip_ws(vm);
+	return neg ? -x : x;
+}
+
+u8 *gh_vm_array(gh_vm *vm, u64 ref, u64 size, u32 *len) {
+	i64 offset = (i32) ref;
+	*len = (u32) (ref >> 32);
+	if (offset > 0 && (u64) offset > vm->bp) fail();
+	u64 end = vm->bp - (u64) offset;
+	if (end > SP || (u64) *len * size > end) fail();
+	return vm->stack.data + end;
+}
+
+static u64 sysfun_eof(gh_vm *vm, const u64 *args) {
+	(void) args;
+	return in_peek(vm) < 0;
+}
+
+static u64 sysfun_read32(gh_vm *vm, const u64 *args) {
+	(void) args;
+	return (u64) (i64) (i32) in_int(vm);
+}
 
-	vm->ip = vm->bc->funs.data[vm->bc->main_idx].offset;
+static u64 sysfun_read64(gh_vm *vm, const u64 *args) {
+	(void) args;
+	return in_int(vm);
+}
+
+// Reads up to the next newline, which is skipped, into the array, and
+// returns the length of the line or -1 at the end of the input. What
+// doesn't fit in the array is dropped, so a line was cut short if the
+// length is larger than the array.
+static u64 sysfun_readline(gh_vm *vm, const u64 *args) {
+	u32 cap;
+	u8 *end = gh_vm_array(vm, args[0], 1, &cap);
+	if (in_peek(vm) < 0)
+		return (u64) -1;
+	u64 len = 0;
+	while (in_peek(vm) >= 0) {
+		const u8 *p = vm->in + vm->in_pos;
+		u64 avail = vm->in_len - vm->in_pos;
+		const u8 *nl = memchr(p, '\n', avail);
+		u64 n = nl ? (u64) (nl - p) : avail;
+		for (u64 i = 0; i < n && len + i < cap; i++)
+			end[-1 - (i64) (len + i)] = p[i];
+		len += n;
+		vm->in_pos += n;
+		if (nl) {
+			vm->in_pos++;
+			break;
+		}
+	}
+	return (u64) (i64) (i32) len;
+}
+
+// Read integers into the array until it's full or the input ends, and
+// return how many were read
+#define READN_FUN(bits) \
+static u64 sysfun_readn ## bits(gh_vm *vm, const u64 *args) { \
+	u32 len; \
+	u8 *end = gh_vm_array(vm, args[0], bits / 8, &len); \
+	in_skip_ws(vm); \
+	u32 n = 0; \
+	for (; n < len && in_peek(vm) >= 0; n++) { \
+		u64 x = in_int(vm); \
+		u8 *e = end - (u64) (n + 1) * (bits / 8); \
+		for (u32 i = bits / 8; i-- > 0; x >>= 8) \
+			e[i] = (u8) x; \
+	} \
+	return n; \
+}
+
+READN_FUN(32) ; READN_FUN(64) ;
+
+void gh_vm_add_natives(void) {
+	#define ADD_NATIVE(_name, _fn, _ret, ...) do { \
+		const gh_type params[] = {__VA_ARGS__}; \
+		(void) gh_native_add(_name, _fn, _ret, sizeof(params) / sizeof(gh_type), params); \
+	} while (0)
+	ADD_NATIVE("print8", sysfun_print8, GH_TOK_KW_UNIT, GH_TOK_KW_I8);
+	ADD_NATIVE("print16", sysfun_print_int, GH_TOK_KW_UNIT, GH_TOK_KW_I16);
+	ADD_NATIVE("print32", sysfun_print_int, GH_TOK_KW_UNIT, GH_TOK_KW_I32);
+	ADD_NATIVE("print64", sysfun_print_int, GH_TOK_KW_UNIT, GH_TOK_KW_I64);
+	ADD_NATIVE("printf32", sysfun_printf32, GH_TOK_KW_UNIT, GH_TOK_KW_F32);
+	ADD_NATIVE("printf64", sysfun_printf64, GH_TOK_KW_UNIT, GH_TOK_KW_F64);
+	ADD_NATIVE("print", sysfun_print, GH_TOK_KW_UNIT, GH_TOK_KW_STR);
+	ADD_NATIVE("flush", sysfun_flush, GH_TOK_KW_UNIT);
+	ADD_NATIVE("put8", sysfun_put8, GH_TOK_KW_UNIT, GH_TOK_KW_I8);
+	ADD_NATIVE("put16", sysfun_put16, GH_TOK_KW_UNIT, GH_TOK_KW_I16);
+	ADD_NATIVE("put32", sysfun_put32, GH_TOK_KW_UNIT, GH_TOK_KW_I32);
+	ADD_NATIVE("put64", sysfun_put64, GH_TOK_KW_UNIT, GH_TOK_KW_I64);
+	ADD_NATIVE("eof", sysfun_eof, GH_TOK_KW_I32);
+	ADD_NATIVE("read32", sysfun_read32, GH_TOK_KW_I32);
+	ADD_NATIVE("read64", sysfun_read64, GH_TOK_KW_I64);
+	ADD_NATIVE("readline", sysfun_readline, GH_TOK_KW_I32, GH_ARRAY_OF(GH_TOK_KW_U8));
+	ADD_NATIVE("readn32", sysfun_readn32, GH_TOK_KW_I32, GH_ARRAY_OF(GH_TOK_KW_I32));
+	ADD_NATIVE("readn64", sysfun_readn64, GH_TOK_KW_I32, GH_ARRAY_OF(GH_TOK_KW_I64));
+	#undef ADD_NATIVE
+}
+
+// The arguments were pushed last to first, so the first one is on top
+static void sysfun(gh_vm *vm) {
+	const gh_native *nf = gh_native_get(get64(vm));
+	if (!nf) fail();
+	u64 args[GH_NATIVE_MAX_PARAMS];
+	u64 pos = SP;
+	for (u8 i = 0; i < nf->nparams; i++) {
+		u8 size = nf->sizes[i];
+		if (pos < size) fail();
+		pos -= size;
+		const u8 *p = vm->stack.data + pos;
+		u64 x = 0;
+		for (u8 j = 0; j < size; j++)
+			x = x << 8 | p[j];
+		if (nf->signs >> i & 1) {
+			u8 shift = (u8) (64 - size * 8);
+			x = (u64) ((i64) (x << shift) >> shift);
+		}
+		args[i] = x;
+	}
+	vm->a = nf->fn(vm, args);
+}
+
+static void ret(gh_vm *vm) {
+	vm->ip = pop_val64(vm);
+}
+
+// Runs from ip until EXIT, or until ip runs off the end of the code
+static void exec(gh_vm *vm) {
 	while (vm->ip < vm->bc->bytes.used) {
 		//gh_log(GH_LOG_INFO, "ip: 0x%llx, a: %lld", vm->ip, vm->a);
 		u8 op = vm->bc->bytes.data[vm->ip++];
@@ -402,23 +964,41 @@ void gh_vm_run(gh_vm *vm) {
 			case GH_VM_MOV_OFFSET_A32: mov_offset_a32(vm, (i64)get64(vm)); break;
 			case GH_VM_MOV_OFFSET_A64: mov_offset_a64(vm, (i64)get64(vm)); break;
 
+			case GH_VM_MOV_OFFSET_SX_A8:  mov_offset_sx_a8(vm, (i64)get64(vm)); break;
+			case GH_VM_MOV_OFFSET_SX_A16: mov_offset_sx_a16(vm, (i64)get64(vm)); break;
+			case GH_VM_MOV_OFFSET_SX_A32: mov_offset_sx_a32(vm, (i64)get64(vm)); break;
+
+			case GH_VM_MOV_INDEX_A8: mov_index_a8(vm); break;
+			case GH_VM_MOV_INDEX_A16: mov_index_a16(vm); break;
+			case GH_VM_MOV_INDEX_A32: mov_index_a32(vm); break;
+			case GH_VM_MOV_INDEX_A64: mov_index_a64(vm); break;
+
+			case GH_VM_MOV_A_INDEX8: mov_a_index8(vm); break;
+			case GH_VM_MOV_A_INDEX16: mov_a_index16(vm); break;
+			case GH_VM_MOV_A_INDEX32: mov_a_index32(vm); break;
+			case GH_VM_MOV_A_INDEX64: mov_a_index64(vm); break;
+
+			case GH_VM_BOUND: bound(vm); break;
+			case GH_VM_CLEAR: clear(vm); break;
+
 			case GH_VM_SIGN_A8: sign_a8(vm); break;
 			case GH_VM_SIGN_A16: sign_a16(vm); break;
 			case GH_VM_SIGN_A32: sign_a32(vm); break;
 			case GH_VM_SIGN_A64: sign_a64(vm); break;
 
-			case GH_VM_ZEXT_A8_16: zext_a8_16(vm); break;
-			case GH_VM_ZEXT_A16_32: zext_a16_32(vm); break;
-			case GH_VM_ZEXT_A32_64: zext_a32_64(vm); break;
+			case GH_VM_ZEXT_A8: zext_a8(vm); break;
+			case GH_VM_ZEXT_A16: zext_a16(vm); break;
+			case GH_VM_ZEXT_A32: zext_a32(vm); break;
 
-			case GH_VM_SEXT_A8_16: sext_a8_16(vm); break;
-			case GH_VM_SEXT_A16_32: sext_a16_32(vm); break;
-			case GH_VM_SEXT_A32_64: sext_a32_64(vm); break;
+			case GH_VM_SEXT_A8: sext_a8(vm); break;
+			case GH_VM_SEXT_A16: sext_a16(vm); break;
+			case GH_VM_SEXT_A32: sext_a32(vm); break;
 
 			case GH_VM_MOV_IMM_A8: mov_imm_a8(vm); break;
 			case GH_VM_MOV_IMM_A16: mov_imm_a16(vm); break;
 			case GH_VM_MOV_IMM_A32: mov_imm_a32(vm); break;
 			case GH_VM_MOV_IMM_A64: mov_imm_a64(vm); break;
+			case GH_VM_MOV_STR_A: mov_str_a(vm); break;
 
 			case GH_VM_NEG_A8: neg_a8(vm); break;
 			case GH_VM_NEG_A16: neg_a16(vm); break;
@@ -466,6 +1046,62 @@ void gh_vm_run(gh_vm *vm) {
 			case GH_VM_MOD32: mod32(vm); break;
 			case GH_VM_MOD64: mod64(vm); break;
 
+			case GH_VM_MULHI8: mulhi8(vm); break;
+			case GH_VM_MULHI16: mulhi16(vm); break;
+			case GH_VM_MULHI32: mulhi32(vm); break;
+			case GH_VM_MULHI64: mulhi64(vm); break;
+
+			case GH_VM_FADD32: fadd32(vm); break;
+			case GH_VM_FADD64: fadd64(vm); break;
+			case GH_VM_FSUB32: fsub32(vm); break;
+			case GH_VM_FSUB64: fsub64(vm); break;
+			case GH_VM_FMUL32: fmul32(vm); break;
+			case GH_VM_FMUL64: fmul64(vm); break;
+			case GH_VM_FDIV32: fdiv32(vm); break;
+			case GH_VM_FDIV64: fdiv64(vm); break;
+			case GH_VM_FCMP32: fcmp32(vm); break;
+			case GH_VM_FCMP64: fcmp64(vm); break;
+			case GH_VM_FSIGN32: fsign32(vm); break;
+			case GH_VM_FSIGN64: fsign64(vm); break;
+			case GH_VM_ITOF32: itof32(vm); break;
+			case GH_VM_ITOF64: itof64(vm); break;
+			case GH_VM_UTOF32: utof32(vm); break;
+			case GH_VM_UTOF64: utof64(vm); break;
+			case GH_VM_FTOI32: ftoi32(vm); break;
+			case GH_VM_FTOI64: ftoi64(vm); break;
+			case GH_VM_FTOU32: ftou32(vm); break;
+			case GH_VM_FTOU64: ftou64(vm); break;
+			case GH_VM_FEXT: fext(vm); break;
+
+			case GH_VM_VLOAD32: vload32(vm); break;
+			case GH_VM_VLOAD64: vload64(vm); break;
+			case GH_VM_VSTORE32: vstore32(vm); break;
+			case GH_VM_VSTORE64: vstore64(vm); break;
+			case GH_VM_VLOAD_INDEX32: vload_index32(vm); break;
+			case GH_VM_VLOAD_INDEX64: vload_index64(vm); break;
+			case GH_VM_VSTORE_INDEX32: vstore_index32(vm); break;
+			case GH_VM_VSTORE_INDEX64: vstore_index64(vm); break;
+			case GH_VM_VPUSH: vpush(vm); break;
+			case GH_VM_VSPLAT32: vsplat32(vm); break;
+			case GH_VM_VSPLAT64: vsplat64(vm); break;
+			case GH_VM_VADD32: vadd32(vm); break;
+			case GH_VM_VADD64: vadd64(vm); break;
+			case GH_VM_VSUB32: vsub32(vm); break;
+			case GH_VM_VSUB64: vsub64(vm); break;
+			case GH_VM_VMUL32: vmul32(vm); break;
+			case GH_VM_VMUL64: vmul64(vm); break;
+			case GH_VM_VAND: vand(vm); break;
+			case GH_VM_VOR: vor(vm); break;
+			case GH_VM_VXOR: vxor(vm); break;
+			case GH_VM_VCMPEQ32: vcmpeq32(vm); break;
+			case GH_VM_VCMPEQ64: vcmpeq64(vm); break;
+			case GH_VM_VCMPLT32: vcmplt32(vm); break;
+			case GH_VM_VCMPLT64: vcmplt64(vm); break;
+			case GH_VM_VCMPGT32: vcmpgt32(vm); break;
+			case GH_VM_VCMPGT64: vcmpgt64(vm); break;
+			case GH_VM_VSUM32: vsum32(vm); break;
+			case GH_VM_VSUM64: vsum64(vm); break;
+
 			case GH_VM_LSHIFT8: lshift8(vm); break;
 			case GH_VM_LSHIFT16: lshift16(vm); break;
 			case GH_VM_LSHIFT32: lshift32(vm); break;
@@ -518,17 +1154,97 @@ void gh_vm_run(gh_vm *vm) {
 			case GH_VM_JZ32: jz32(vm); break;
 			case GH_VM_JZ64: jz64(vm); break;
 
+			case GH_VM_JNZ8: jnz8(vm); break;
+			case GH_VM_JNZ16: jnz16(vm); break;
+			case GH_VM_JNZ32: jnz32(vm); break;
+			case GH_VM_JNZ64: jnz64(vm); break;
+
+			case GH_VM_JTAB8: jtab8(vm); break;
+			case GH_VM_JTAB16: jtab16(vm); break;
+			case GH_VM_JTAB32: jtab32(vm); break;
+			case GH_VM_JTAB64: jtab64(vm); break;
+
 			case GH_VM_JMP: jmp(vm); break;
 
 			case GH_VM_CALL: call(vm); break;
 
 			case GH_VM_RET: ret(vm); break;
 			case GH_VM_SYSFUN: sysfun(vm); break;
-			case GH_VM_EXIT: goto end;
+			case GH_VM_EXIT: return ;
 		}
 	}
+}
+
+void gh_vm_run(gh_vm *vm) {
+	jmp_buf buf, *outer = vm->fail;
+	vm->fail = &buf;
+	if (!setjmp(buf)) {
+		if (!vm->bc->main_defined)
+			fail();
+		vm->ip = vm->bc->funs.data[vm->bc->main_idx].offset;
+		exec(vm);
+	}
+	vm->fail = outer;
+	(void) gh_vm_flush(vm);
+}
+
+// Pushes an argument the way the compiler does, so as wide as its type
+static void push_arg(gh_vm *vm, gh_type type, u64 x) {
+	switch (type) {
+		case GH_TOK_KW_I8: case GH_TOK_KW_U8: push_val8(vm, (u8) x); break;
+		case GH_TOK_KW_I16: case GH_TOK_KW_U16: push_val16(vm, (u16) x); break;
+		case GH_TOK_KW_I32: case GH_TOK_KW_U32:
+		case GH_TOK_KW_F32: push_val32(vm, (u32) x); break;
+		default: push_val64(vm, x); break;
+	}
+}
+
+// The result in the same form as a native's arguments, since a only
+// holds it at its own width
+static u64 extend_ret(gh_type type, u64 x) {
+	switch (type) {
+		case GH_TOK_KW_UNIT: return 0;
+		case GH_TOK_KW_I8: return (u64) (i64) (i8) x;
+		case GH_TOK_KW_U8: return (u8) x;
+		case GH_TOK_KW_I16: return (u64) (i64) (i16) x;
+		case GH_TOK_KW_U16: return (u16) x;
+		case GH_TOK_KW_I32: return (u64) (i64) (i32) x;
+		case GH_TOK_KW_U32: case GH_TOK_KW_F32: return (u32) x;
+		default: return x;
+	}
+}
+
+int gh_vm_call(gh_vm *vm, u64 fun, const u64 *args, u64 *ret) {
+	if (fun >= vm->bc->funs.used)
+		return -1;
+	const gh_fun *f = &vm->bc->funs.data[fun];
+	// A native may call in while the VM is running, which carries on from
+	// where it was once this returns
+	u64 sp = SP, bp = vm->bp, ip = vm->ip;
+	jmp_buf buf, *outer = vm->fail;
+	vm->fail = &buf;
+	if (setjmp(buf)) {
+		vm->fail = outer;
+		SP = sp;
+		vm->bp = bp;
+		vm->ip = ip;
+		return -1;
+	}
 
-end:
+	for (u32 i = f->nparams; i-- > 0;)
+		push_arg(vm, f->params[i], args[i]);
+	// Returning from it jumps past the end of the code, which stops exec
+	push_val64(vm, vm->bc->bytes.used);
+	vm->ip = f->offset;
+	exec(vm);
+
+	vm->fail = outer;
+	SP = sp;
+	vm->bp = bp;
+	vm->ip = ip;
+	if (ret)
+		*ret = extend_ret(f->ret, vm->a);
+	return 0;
 }
 
 void gh_vm_debug(FILE *fp, gh_vm *vm) {
@@ -537,5 +1253,8 @@ void gh_vm_debug(FILE *fp, gh_vm *vm) {
 }
 
 void gh_vm_deinit(gh_vm *vm) {
+	(void) gh_vm_flush(vm);
+	gh_free(vm->out);
+	gh_free(vm->in);
 	FREE_VEC(vm->stack);
 }
@@ -2,6 +2,7 @@
 #define _GALACH_VM_H
 
 #include <stdio.h>
+#include <setjmp.h>
 #include "bytecode.h"
 
 // NOTE: For some of these instructions, *the order is important*
@@ -25,6 +26,48 @@ typedef enum {
 	GH_VM_MOV_OFFSET_A32,
 	GH_VM_MOV_OFFSET_A64,
 
+	// Move data from bp+offset to the a register, sign-extended to 64 bits.
+	// MOV_OFFSET_A zero-extends, so a load never needs a separate extension.
+	// bits: |  8  |  64  |
+	//       ^     ^- offset
+	//       ^- op
+	GH_VM_MOV_OFFSET_SX_A8,
+	GH_VM_MOV_OFFSET_SX_A16,
+	GH_VM_MOV_OFFSET_SX_A32,
+
+	// Move the element at index a of an array at bp+offset to the a register.
+	// The index is all 64 bits of a, scaled by the width.
+	// bits: |  8  |  64  |
+	//       ^     ^- offset
+	//       ^- op
+	GH_VM_MOV_INDEX_A8,
+	GH_VM_MOV_INDEX_A16,
+	GH_VM_MOV_INDEX_A32,
+	GH_VM_MOV_INDEX_A64,
+
+	// Pops a 64-bit index from the stack and moves the a register to that
+	// element of an array at bp+offset
+	// bits: |  8  |  64  |
+	//       ^     ^- offset
+	//       ^- op
+	GH_VM_MOV_A_INDEX8,
+	GH_VM_MOV_A_INDEX16,
+	GH_VM_MOV_A_INDEX32,
+	GH_VM_MOV_A_INDEX64,
+
+	// Crash unless all 64 bits of a, unsigned, are less than n. This checks
+	// an index against the length of its array.
+	// bits: |  8  |  64  |
+	//       ^     ^- n
+	//       ^- op
+	GH_VM_BOUND,
+
+	// Zero n bytes of the frame, from bp plus the offset in the a register
+	// bits: |  8  |  64  |
+	//       ^     ^- n
+	//       ^- op
+	GH_VM_CLEAR,
+
 	// Switch the sign of the a register
 	// bits: |  8  |
 	//       ^- op
@@ -33,19 +76,20 @@ typedef enum {
 	GH_VM_SIGN_A32,
 	GH_VM_SIGN_A64,
 
-	// Zero-extends the value in the a register to a larger bitwidth
+	// Zero-extends the value in the a register from a bitwidth to all 64
+	// bits, which converts it to every larger width at once
 	// bits: |  8  |
 	//       ^- op
-	GH_VM_ZEXT_A8_16,
-	GH_VM_ZEXT_A16_32,
-	GH_VM_ZEXT_A32_64,
+	GH_VM_ZEXT_A8,
+	GH_VM_ZEXT_A16,
+	GH_VM_ZEXT_A32,
 
-	// Sign-extends the value in the a register to a larger bitwidth
+	// Sign-extends the value in the a register from a bitwidth to all 64 bits
 	// bits: |  8  |
 	//       ^- op
-	GH_VM_SEXT_A8_16,
-	GH_VM_SEXT_A16_32,
-	GH_VM_SEXT_A32_64,
+	GH_VM_SEXT_A8,
+	GH_VM_SEXT_A16,
+	GH_VM_SEXT_A32,
 
 	// Move an immediate into the a register
 	// bits: |  8  |  8/16/32/64  |
@@ -58,6 +102,14 @@ typedef enum {
 	GH_VM_MOV_IMM_A32,
 	GH_VM_MOV_IMM_A64,
 
+	// Move a view of a string in the bytecode's rodata into the a register:
+	// the offset of its first byte in the high 32 bits, and its length in
+	// the low 32 bits. Nothing is copied.
+	// bits: |  8  |  64  |
+	//       ^     ^- view
+	//       ^- op
+	GH_VM_MOV_STR_A,
+
 	// If a is nonzero, make it zero. Otherwise, set it to one.
 	// bits: |  8  |
 	//       ^- op
@@ -139,6 +191,175 @@ typedef enum {
 	GH_VM_MOD32,
 	GH_VM_MOD64,
 
+	// Pops a value from the stack and multiplies it with the a register,
+	// keeping the high bits: a = (val * m) >> (n + shift), for n the width
+	// and m all 64 bits of a, plus 2^64 if the top bit of shift is set.
+	// This is unsigned division by a constant, see gh_peep_strength.
+	// bits: |  8  |  8  |
+	//       ^     ^- shift
+	//       ^- op
+	GH_VM_MULHI8,
+	GH_VM_MULHI16,
+	GH_VM_MULHI32,
+	GH_VM_MULHI64,
+
+	// === Floating point arithmetic ===
+	// An f32 is the low 32 bits of the a register or of a stack value, and
+	// an f64 all 64, so floats are moved, pushed and tested with the integer
+	// ops of their width. The ops below come in pairs, 32 then 64.
+
+	// Pops a value from the stack and adds it to the a register
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_FADD32,
+	GH_VM_FADD64,
+
+	// Pops a value from the stack and subtracts the a register from this value
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_FSUB32,
+	GH_VM_FSUB64,
+
+	// Pops a value from the stack and multiplies it with the a register
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_FMUL32,
+	GH_VM_FMUL64,
+
+	// Pops a value from the stack and divides it by the a register
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_FDIV32,
+	GH_VM_FDIV64,
+
+	// Like CMP. If either value is a NaN, no flag is set, so only SETNEQ
+	// sets a.
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_FCMP32,
+	GH_VM_FCMP64,
+
+	// Switch the sign of the a register
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_FSIGN32,
+	GH_VM_FSIGN64,
+
+	// Converts all 64 bits of the a register, as a signed integer, to a float
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_ITOF32,
+	GH_VM_ITOF64,
+
+	// Converts all 64 bits of the a register, as an unsigned integer, to a float
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_UTOF32,
+	GH_VM_UTOF64,
+
+	// Converts the float in the a register to a signed integer in all 64
+	// bits, rounded toward zero. Out of range it's the nearest end of the
+	// range, and NaN is 0. A narrower integer type keeps the low bits.
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_FTOI32,
+	GH_VM_FTOI64,
+
+	// The same, to an unsigned integer
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_FTOU32,
+	GH_VM_FTOU64,
+
+	// Converts the f32 in the a register to an f64
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_FEXT,
+
+
+	// === Vectors ===
+	// The v register holds 16 bytes, as 4 i32 lanes or 2 i64 lanes. In the
+	// frame a vector is laid out like an array of its lanes, so a lane is
+	// read and written with the array ops, and a run of an array's elements
+	// moves to and from v at once with the indexed loads and stores. The
+	// lane-wise ops pop a vector pushed by VPUSH as their first operand and
+	// leave the result in v. They come in pairs, 32 then 64, where the lane
+	// width matters.
+
+	// Move the vector at bp+offset to the v register
+	// bits: |  8  |  64  |
+	//       ^     ^- offset
+	//       ^- op
+	GH_VM_VLOAD32,
+	GH_VM_VLOAD64,
+
+	// Move the v register to bp+offset
+	// bits: |  8  |  64  |
+	//       ^     ^- offset
+	//       ^- op
+	GH_VM_VSTORE32,
+	GH_VM_VSTORE64,
+
+	// Move the vector at bp+offset+a*width to the v register, which is a
+	// run of array elements from index a on
+	// bits: |  8  |  64  |
+	//       ^     ^- offset
+	//       ^- op
+	GH_VM_VLOAD_INDEX32,
+	GH_VM_VLOAD_INDEX64,
+
+	// Move the v register to bp+offset+pop*width, popping the index
+	// bits: |  8  |  64  |
+	//       ^     ^- offset
+	//       ^- op
+	GH_VM_VSTORE_INDEX32,
+	GH_VM_VSTORE_INDEX64,
+
+	// Push the v register to the stack
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_VPUSH,
+
+	// Set every lane of the v register to the a register
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_VSPLAT32,
+	GH_VM_VSPLAT64,
+
+	// Lane-wise arithmetic, wrapping like the scalar ops
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_VADD32,
+	GH_VM_VADD64,
+	GH_VM_VSUB32,
+	GH_VM_VSUB64,
+	GH_VM_VMUL32,
+	GH_VM_VMUL64,
+
+	// Lane-wise bitwise ops, the same at either lane width
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_VAND,
+	GH_VM_VOR,
+	GH_VM_VXOR,
+
+	// Signed lane-wise comparisons. Each lane is set to 1 where the popped
+	// vector's lane is equal to, less than, or greater than v's, else 0.
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_VCMPEQ32,
+	GH_VM_VCMPEQ64,
+	GH_VM_VCMPLT32,
+	GH_VM_VCMPLT64,
+	GH_VM_VCMPGT32,
+	GH_VM_VCMPGT64,
+
+	// Set the a register to the wrapping sum of the lanes of v
+	// bits: |  8  |
+	//       ^- op
+	GH_VM_VSUM32,
+	GH_VM_VSUM64,
+
 
 	// === Bit shifting ===
 	// Shifts a value from the stack to the left by the 8-bit value in the a register
@@ -235,6 +456,27 @@ typedef enum {
 	GH_VM_JZ32,
 	GH_VM_JZ64,
 
+	// If the a register is nonzero, jump to this address
+	// bits: |  8  |  64  |
+	//       ^     ^- address
+	//       ^- op
+	GH_VM_JNZ8,
+	GH_VM_JNZ16,
+	GH_VM_JNZ32,
+	GH_VM_JNZ64,
+
+	// Jumps through a table of n JMP instructions that follows, indexed
+	// by the unsigned value of the a register. If a is n or more, execution
+	// continues after the table instead. Only the entries' addresses are
+	// read, so dispatching costs a single instruction.
+	// bits: |  8  |  64  |
+	//       ^     ^- n
+	//       ^- op
+	GH_VM_JTAB8,
+	GH_VM_JTAB16,
+	GH_VM_JTAB32,
+	GH_VM_JTAB64,
+
 	// Jump to this address
 	// bits: |  8  |  64  |
 	//       ^     ^- address
@@ -266,6 +508,67 @@ typedef enum {
 	GH_VM_EXIT,
 } gh_vm_op;
 
+// Size in bytes of the operand that follows an op
+static inline u64 gh_vm_operand_size(u8 op) {
+	switch (op) {
+		case GH_VM_MOV_IMM_A8:
+		case GH_VM_MULHI8: case GH_VM_MULHI16:
+		case GH_VM_MULHI32: case GH_VM_MULHI64: return 1;
+		case GH_VM_MOV_IMM_A16: return 2;
+		case GH_VM_MOV_IMM_A32: return 4;
+		case GH_VM_MOV_IMM_A64: case GH_VM_MOV_STR_A:
+		case GH_VM_MOV_A_OFFSET8: case GH_VM_MOV_A_OFFSET16:
+		case GH_VM_MOV_A_OFFSET32: case GH_VM_MOV_A_OFFSET64:
+		case GH_VM_MOV_OFFSET_A8: case GH_VM_MOV_OFFSET_A16:
+		case GH_VM_MOV_OFFSET_A32: case GH_VM_MOV_OFFSET_A64:
+		case GH_VM_MOV_OFFSET_SX_A8: case GH_VM_MOV_OFFSET_SX_A16:
+		case GH_VM_MOV_OFFSET_SX_A32:
+		case GH_VM_MOV_INDEX_A8: case GH_VM_MOV_INDEX_A16:
+		case GH_VM_MOV_INDEX_A32: case GH_VM_MOV_INDEX_A64:
+		case GH_VM_MOV_A_INDEX8: case GH_VM_MOV_A_INDEX16:
+		case GH_VM_MOV_A_INDEX32: case GH_VM_MOV_A_INDEX64:
+		case GH_VM_BOUND: case GH_VM_CLEAR:
+		case GH_VM_VLOAD32: case GH_VM_VLOAD64:
+		case GH_VM_VSTORE32: case GH_VM_VSTORE64:
+		case GH_VM_VLOAD_INDEX32: case GH_VM_VLOAD_INDEX64:
+		case GH_VM_VSTORE_INDEX32: case GH_VM_VSTORE_INDEX64:
+		case GH_VM_ADD_SP:
+		case GH_VM_JZ8: case GH_VM_JZ16:
+		case GH_VM_JZ32: case GH_VM_JZ64:
+		case GH_VM_JNZ8: case GH_VM_JNZ16:
+		case GH_VM_JNZ32: case GH_VM_JNZ64:
+		case GH_VM_JTAB8: case GH_VM_JTAB16:
+		case GH_VM_JTAB32: case GH_VM_JTAB64:
+		case GH_VM_JMP: case GH_VM_CALL:
+		case GH_VM_SYSFUN: return 8;
+		default: return 0;
+	}
+}
+
+// Size in bytes of an entry of a JTAB's table
+#define GH_VM_JTAB_ENTRY 9
+
+// GCC's vector extensions compile the lane-wise ops to the host's SIMD
+// instructions, SSE2 on any x86-64, or to scalar code where there are none
+typedef u32 gh_v4u32 __attribute__((vector_size(16)));
+typedef i32 gh_v4i32 __attribute__((vector_size(16)));
+typedef u64 gh_v2u64 __attribute__((vector_size(16)));
+typedef i64 gh_v2i64 __attribute__((vector_size(16)));
+
+typedef union {
+	gh_v4u32 d;
+	gh_v2u64 q;
+} gh_vreg;
+
+// Default size of a VM's output buffer, and the least it can be set to,
+// see gh_vm_output
+#define GH_VM_OUT_SIZE (64 * 1024)
+#define GH_VM_OUT_MIN 64
+
+// The same for the input buffer, see gh_vm_input
+#define GH_VM_IN_SIZE (1024 * 1024)
+#define GH_VM_IN_MIN 64
+
 typedef struct gh_vm {
 	gh_bytecode *bc;
 	VEC(u8) stack;
@@ -274,6 +577,7 @@ typedef struct gh_vm {
 	u64 sp;
 	u64 bp;
 	u64 a;
+	gh_vreg v;
 
 	// Equal flag
 	// If the CMP between the two values shows they are identical,
@@ -289,11 +593,62 @@ typedef struct gh_vm {
 	// If the CMP between the two value shows that the first one
 	// is less than the second, this is set.
 	u8 f_lt  : 1;
+
+	// Where a crash unwinds to, set by gh_vm_run and gh_vm_call for as
+	// long as they run
+	jmp_buf *fail;
+
+	// What the program prints is buffered here until it's written to out_fd
+	u8 *out;
+	u64 out_used;
+	u64 out_size;
+	int out_fd;
+
+	// Input read from in_fd that the program hasn't consumed yet is in
+	// in[in_pos..in_len]
+	u8 *in;
+	u64 in_pos;
+	u64 in_len;
+	u64 in_size;
+	int in_fd;
+	u8 in_eof;
 } gh_vm;
 
+// The VM's output goes to stdout, buffered by GH_VM_OUT_SIZE bytes, and
+// its input comes from stdin, GH_VM_IN_SIZE bytes at a time
 void gh_vm_init(gh_vm *vm, gh_bytecode *bytecode);
 void gh_vm_run(gh_vm *vm);
 
+// Calls the function at index fun in the bytecode's funs, see
+// gh_bytecode_find, and sets ret to what it returns. The arguments and the
+// result are passed like a native's, see native.h. The VM keeps its stack
+// and buffers from one call to the next, and output is only flushed when
+// the buffer fills or on gh_vm_flush. Returns -1 if the VM crashed, which
+// leaves it as it was before the call. A native may call back into the VM
+// that is running it.
+int gh_vm_call(gh_vm *vm, u64 fun, const u64 *args, u64 *ret);
+
+// Flushes what's buffered, then sends output to fd through a buffer of
+// size bytes
+void gh_vm_output(gh_vm *vm, int fd, u64 size);
+// Returns -1 if the write fails, in which case the buffered output is lost
+int gh_vm_flush(gh_vm *vm);
+// Reads input from fd through a buffer of size bytes. Anything buffered
+// from the old fd is dropped.
+void gh_vm_input(gh_vm *vm, int fd, u64 size);
+
+// Adds the print, put and read sysfuns to the natives, see native.h
+void gh_vm_add_natives(void);
+
+// For natives: crashes the VM with a message
+void gh_vm_fail(gh_vm *vm, const char *msg) __attribute__((noreturn));
+// The len elements of an array passed by reference, each size bytes and
+// big-endian. Element i takes up the size bytes before the returned
+// pointer minus i * size.
+u8 *gh_vm_array(gh_vm *vm, u64 ref, u64 size, u32 *len);
+// The len bytes of a str's view into the rodata, see GH_VM_MOV_STR_A
+const u8 *gh_vm_str(gh_vm *vm, u64 view, u32 *len);
+
 void gh_vm_debug(FILE *fp, gh_vm *vm);
 void gh_vm_deinit(gh_vm *vm);
 